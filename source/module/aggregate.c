@@ -0,0 +1,565 @@
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HPSS includes
+ */
+#include <hpss_xml.h>
+
+/*
+ * Local includes
+ */
+#include "aggregate.h"
+#include "config.h"
+#include "logging.h"
+
+/*
+ * Each session process fills its own container so that containers are never
+ * shared between processes. Containers live in
+ * $HPSS_DSI_AGGREGATE_DIR/.containers and are named
+ * <hostname>.<pid>.<time>.<sequence>. A new container is started once the
+ * current one reaches $HPSS_DSI_AGGREGATE_CONTAINER_SIZE bytes. The create
+ * asks for a COS suitable for a file of that size.
+ *
+ * Uploads reserve their extent under the lock and write it through their own
+ * open of the container, which is closed before the member index is set. An
+ * index therefore only ever points at committed data, and uploads only wait
+ * on each other to reserve space. Extents of failed uploads are left unused.
+ *
+ * Every account that uploads into or reads from the aggregate directory must
+ * be able to use the containers, so the directory and containers are given
+ * $HPSS_DSI_AGGREGATE_MODE and, if set, $HPSS_DSI_AGGREGATE_GROUP.
+ *
+ * Member placeholders carry these UDA keys:
+ *
+ *   /hpss/user/aggregate/container  <container path>
+ *   /hpss/user/aggregate/offset     <offset of the data within the container>
+ *   /hpss/user/aggregate/length     <length of the data>
+ *
+ * An empty container key means the file is no longer a member. Containers
+ * are never compacted; the extents of deleted and overwritten members stay
+ * in place until the container is removed, which is safe once no placeholder
+ * names it.
+ */
+#define AGGREGATE_CONTAINER_DIR          ".containers"
+#define AGGREGATE_DEFAULT_MAX_MEMBER     (1024 * 1024)
+#define AGGREGATE_DEFAULT_CONTAINER_SIZE (4ULL * 1024 * 1024 * 1024)
+#define AGGREGATE_DEFAULT_MODE           0660
+
+static struct
+{
+    pthread_mutex_t Lock;
+    char *          Directory;
+    uint64_t        MaxMemberSize;
+    uint64_t        ContainerSize;
+    mode_t          Mode;  // Of containers; the directory adds search bits
+    gid_t           Group; // -1 to keep the creator's
+
+    /* The container being filled. */
+    char *   Container;
+    uint64_t Offset; // Next free byte
+    unsigned Sequence;
+} Aggregate = {.Lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t AggregateInitialized = PTHREAD_ONCE_INIT;
+
+static void
+aggregate_init()
+{
+    const char *directory = getenv("HPSS_DSI_AGGREGATE_DIR");
+    if (!directory || *directory != '/')
+    {
+        if (directory && *directory)
+            WARN("Ignoring HPSS_DSI_AGGREGATE_DIR, it must be an absolute "
+                 "path: %s",
+                 directory);
+        return;
+    }
+
+    Aggregate.Directory = strdup(directory);
+    if (!Aggregate.Directory)
+        return;
+
+    /* Strip trailing slashes except for '/'. */
+    size_t length = strlen(Aggregate.Directory);
+    while (length > 1 && Aggregate.Directory[length - 1] == '/')
+        Aggregate.Directory[--length] = '\0';
+
+    Aggregate.MaxMemberSize = config_get_env_int("HPSS_DSI_AGGREGATE_MAX_SIZE",
+                                                 AGGREGATE_DEFAULT_MAX_MEMBER);
+    Aggregate.ContainerSize = config_get_env_int(
+        "HPSS_DSI_AGGREGATE_CONTAINER_SIZE", AGGREGATE_DEFAULT_CONTAINER_SIZE);
+    Aggregate.Mode = config_get_env_int("HPSS_DSI_AGGREGATE_MODE",
+                                        AGGREGATE_DEFAULT_MODE) & 0666;
+    Aggregate.Group = config_get_env_int("HPSS_DSI_AGGREGATE_GROUP", -1);
+
+    INFO("Aggregating uploads of at most %" PRIu64 " bytes beneath %s",
+         Aggregate.MaxMemberSize,
+         Aggregate.Directory);
+}
+
+bool
+aggregate_enabled_for(const char *Pathname)
+{
+    pthread_once(&AggregateInitialized, aggregate_init);
+
+    if (!Aggregate.Directory || Aggregate.MaxMemberSize == 0)
+        return false;
+
+    size_t length = strlen(Aggregate.Directory);
+    if (strncmp(Pathname, Aggregate.Directory, length) != 0)
+        return false;
+
+    /* Never aggregate the containers themselves. */
+    const char *rest = Pathname + length;
+    if (length > 1)
+    {
+        if (*rest != '/')
+            return false;
+        rest++;
+    }
+    return strncmp(rest,
+                   AGGREGATE_CONTAINER_DIR "/",
+                   strlen(AGGREGATE_CONTAINER_DIR "/")) != 0;
+}
+
+uint64_t
+aggregate_max_member_size()
+{
+    pthread_once(&AggregateInitialized, aggregate_init);
+    return Aggregate.MaxMemberSize;
+}
+
+/* Gives a new directory or container the shared mode and group. */
+static globus_result_t
+aggregate_share(const char *Pathname, mode_t Mode)
+{
+    /* The create's mode was subject to the umask. */
+    int retval = Hpss_Chmod(Pathname, Mode);
+    if (!retval && Aggregate.Group != (gid_t)-1)
+        retval = Hpss_Chown(Pathname, -1, Aggregate.Group);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+    return GLOBUS_SUCCESS;
+}
+
+/* Called locked. Creates the next container and leaves it empty. */
+static globus_result_t
+aggregate_create_container()
+{
+    char                  hostname[256];
+    hpss_cos_hints_t      hints_in;
+    hpss_cos_hints_t      hints_out;
+    hpss_cos_priorities_t priorities;
+    globus_result_t       result   = GLOBUS_SUCCESS;
+    mode_t                dir_mode = Aggregate.Mode | ((Aggregate.Mode & 0444) >> 2);
+
+    size_t length = strlen(Aggregate.Directory) +
+                    strlen("/" AGGREGATE_CONTAINER_DIR) + 1;
+    char container_dir[length];
+    snprintf(container_dir,
+             length,
+             "%s/" AGGREGATE_CONTAINER_DIR,
+             strcmp(Aggregate.Directory, "/") == 0 ? "" : Aggregate.Directory);
+
+    int retval = Hpss_Mkdir(container_dir, dir_mode);
+    if (retval && hpss_error_status(retval) != -EEXIST)
+        return hpss_error_to_globus_result(retval);
+    if (!retval)
+    {
+        result = aggregate_share(container_dir, dir_mode);
+        if (result)
+            return result;
+    }
+
+    if (gethostname(hostname, sizeof(hostname)) != 0)
+        strcpy(hostname, "localhost");
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    length = strlen(container_dir) + strlen(hostname) + 64;
+    Aggregate.Container = malloc(length);
+    if (!Aggregate.Container)
+        return GlobusGFSErrorMemory("container path");
+    snprintf(Aggregate.Container,
+             length,
+             "%s/%s.%d.%ld.%u",
+             container_dir,
+             hostname,
+             getpid(),
+             (long)time(NULL),
+             Aggregate.Sequence++);
+
+    /* Place the container by its eventual size, not the size of a member. */
+    memset(&hints_in, 0, sizeof(hints_in));
+    memset(&hints_out, 0, sizeof(hints_out));
+    memset(&priorities, 0, sizeof(priorities));
+    CONVERT_LONGLONG_TO_U64(Aggregate.ContainerSize, hints_in.MinFileSize);
+    CONVERT_LONGLONG_TO_U64(Aggregate.ContainerSize, hints_in.MaxFileSize);
+    priorities.MinFileSizePriority = HIGHLY_DESIRED_PRIORITY;
+    priorities.MaxFileSizePriority = HIGHLY_DESIRED_PRIORITY;
+
+    int fd = Hpss_Open(Aggregate.Container,
+                       O_WRONLY | O_CREAT | O_EXCL,
+                       Aggregate.Mode,
+                       &hints_in,
+                       &priorities,
+                       &hints_out);
+    if (fd < 0)
+    {
+        result = hpss_error_to_globus_result(fd);
+        goto cleanup;
+    }
+
+    retval = Hpss_Close(fd);
+    if (retval)
+    {
+        result = hpss_error_to_globus_result(retval);
+        goto cleanup;
+    }
+
+    result = aggregate_share(Aggregate.Container, Aggregate.Mode);
+    if (result)
+        goto cleanup;
+
+    Aggregate.Offset = 0;
+    INFO("Created container %s", Aggregate.Container);
+
+cleanup:
+    if (result)
+    {
+        free(Aggregate.Container);
+        Aggregate.Container = NULL;
+    }
+    return result;
+}
+
+/* Called locked. Later uploads go to a new container. */
+static void
+aggregate_retire_container()
+{
+    if (!Aggregate.Container)
+        return;
+
+    INFO("Filled container %s to %" PRIu64 " bytes",
+         Aggregate.Container,
+         Aggregate.Offset);
+
+    free(Aggregate.Container);
+    Aggregate.Container = NULL;
+    Aggregate.Offset    = 0;
+}
+
+/* Writes an extent reserved by aggregate_store() and commits it. */
+static globus_result_t
+aggregate_write(const char *Container,
+                uint64_t    Offset,
+                const char *Buffer,
+                uint64_t    Length)
+{
+    hpss_cos_hints_t      hints_in;
+    hpss_cos_hints_t      hints_out;
+    hpss_cos_priorities_t priorities;
+    globus_result_t       result = GLOBUS_SUCCESS;
+    int                   retval = 0;
+
+    memset(&hints_in, 0, sizeof(hints_in));
+    memset(&hints_out, 0, sizeof(hints_out));
+    memset(&priorities, 0, sizeof(priorities));
+
+    int fd = Hpss_Open(
+        Container, O_WRONLY, 0, &hints_in, &priorities, &hints_out);
+    if (fd < 0)
+        return hpss_error_to_globus_result(fd);
+
+    retval = Hpss_SetFileOffset(fd, Offset);
+    if (retval)
+    {
+        result = hpss_error_to_globus_result(retval);
+        goto cleanup;
+    }
+
+    ssize_t rc = Hpss_Write(fd, Buffer, Length);
+    if (rc < 0)
+        result = hpss_error_to_globus_result(rc);
+    else if (rc != Length)
+        result = GlobusGFSErrorGeneric("Short write to container");
+
+cleanup:
+    retval = Hpss_Close(fd);
+    if (retval && !result)
+        result = hpss_error_to_globus_result(retval);
+    return result;
+}
+
+static globus_result_t
+aggregate_set_index(const char *Pathname,
+                    const char *Container,
+                    uint64_t    Offset,
+                    uint64_t    Length)
+{
+    char                 offset_buf[32];
+    char                 length_buf[32];
+    hpss_userattr_t      user_attrs[3];
+    hpss_userattr_list_t attr_list;
+
+    snprintf(offset_buf, sizeof(offset_buf), "%" PRIu64, Offset);
+    snprintf(length_buf, sizeof(length_buf), "%" PRIu64, Length);
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/aggregate/container";
+    attr_list.Pair[0].Value = (char *)Container;
+    attr_list.Pair[1].Key   = "/hpss/user/aggregate/offset";
+    attr_list.Pair[1].Value = offset_buf;
+    attr_list.Pair[2].Key   = "/hpss/user/aggregate/length";
+    attr_list.Pair[2].Value = length_buf;
+
+    int retval = Hpss_UserAttrSetAttrs(Pathname, &attr_list, NULL);
+    if (retval != HPSS_E_NOERROR)
+        return hpss_error_to_globus_result(retval);
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+aggregate_store(const char *Pathname, const char *Buffer, uint64_t Length)
+{
+    char *          container = NULL;
+    uint64_t        offset    = 0;
+    globus_result_t result    = GLOBUS_SUCCESS;
+
+    pthread_mutex_lock(&Aggregate.Lock);
+    {
+        if (Aggregate.Container &&
+            Aggregate.Offset + Length > Aggregate.ContainerSize)
+            aggregate_retire_container();
+
+        if (!Aggregate.Container)
+            result = aggregate_create_container();
+
+        if (!result)
+        {
+            container = strdup(Aggregate.Container);
+            if (!container)
+                result = GlobusGFSErrorMemory("container path");
+        }
+
+        if (!result)
+        {
+            offset = Aggregate.Offset;
+            Aggregate.Offset += Length;
+        }
+    }
+    pthread_mutex_unlock(&Aggregate.Lock);
+
+    if (!result)
+        result = aggregate_write(container, offset, Buffer, Length);
+
+    if (!result)
+        result = aggregate_set_index(Pathname, container, offset, Length);
+
+    if (!result)
+        DEBUG("Aggregated %s into %s at offset %" PRIu64 " length %" PRIu64,
+              Pathname,
+              container,
+              offset,
+              Length);
+
+    free(container);
+    return result;
+}
+
+/* Returns a malloc'ed copy of the UDA value or NULL if it is unset. */
+static char *
+aggregate_uda_value(char *Value)
+{
+    char *value = Hpss_ChompXMLHeader(Value, NULL);
+    if (value && *value == '\0')
+    {
+        free(value);
+        value = NULL;
+    }
+    return value;
+}
+
+/*
+ * The index is user settable, so only names directly beneath our container
+ * directory are believed.
+ */
+static bool
+aggregate_is_container(const char *Container)
+{
+    size_t length = strlen(Aggregate.Directory);
+
+    /* The root directory has no separator of its own. */
+    if (length == 1)
+        length = 0;
+
+    if (strncmp(Container, Aggregate.Directory, length) != 0)
+        return false;
+    Container += length;
+
+    if (strncmp(Container,
+                "/" AGGREGATE_CONTAINER_DIR "/",
+                strlen("/" AGGREGATE_CONTAINER_DIR "/")) != 0)
+        return false;
+    Container += strlen("/" AGGREGATE_CONTAINER_DIR "/");
+
+    return *Container != '\0' && !strchr(Container, '/') &&
+           strcmp(Container, ".") != 0 && strcmp(Container, "..") != 0;
+}
+
+static bool
+aggregate_parse_u64(const char *Value, uint64_t *Number)
+{
+    char *end = NULL;
+
+    if (*Value < '0' || *Value > '9')
+        return false;
+
+    errno   = 0;
+    *Number = strtoull(Value, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+globus_result_t
+aggregate_lookup(const char *        Pathname,
+                 const hpss_stat_t * Stat,
+                 aggregate_member_t *Member)
+{
+    int                  retval = 0;
+    char *               offset = NULL;
+    char *               length = NULL;
+    char                 container_buf[HPSS_XML_SIZE];
+    char                 offset_buf[HPSS_XML_SIZE];
+    char                 length_buf[HPSS_XML_SIZE];
+    hpss_userattr_t      user_attrs[3];
+    hpss_userattr_list_t attr_list;
+    globus_result_t      result = GLOBUS_SUCCESS;
+
+    memset(Member, 0, sizeof(*Member));
+
+    /* Sites that never aggregated have no members to look for. */
+    pthread_once(&AggregateInitialized, aggregate_init);
+    if (!Aggregate.Directory)
+        return GLOBUS_SUCCESS;
+
+    /* Members keep their index wherever they are moved to. */
+    if (!S_ISREG(Stat->st_mode) || Stat->st_size != 0)
+        return GLOBUS_SUCCESS;
+
+    memset(container_buf, 0, sizeof(container_buf));
+    memset(offset_buf, 0, sizeof(offset_buf));
+    memset(length_buf, 0, sizeof(length_buf));
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/aggregate/container";
+    attr_list.Pair[0].Value = container_buf;
+    attr_list.Pair[1].Key   = "/hpss/user/aggregate/offset";
+    attr_list.Pair[1].Value = offset_buf;
+    attr_list.Pair[2].Key   = "/hpss/user/aggregate/length";
+    attr_list.Pair[2].Value = length_buf;
+
+#if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4)
+    retval = Hpss_UserAttrGetAttrs((char *)Pathname, &attr_list, UDA_API_VALUE);
+#else
+    retval = Hpss_UserAttrGetAttrs(
+        Pathname, &attr_list, UDA_API_VALUE, HPSS_XML_SIZE - 1);
+#endif
+    if (retval != HPSS_E_NOERROR)
+    {
+        if (hpss_error_status(retval) == -ENOENT)
+            return GLOBUS_SUCCESS;
+        return hpss_error_to_globus_result(retval);
+    }
+
+    Member->Container = aggregate_uda_value(container_buf);
+    if (!Member->Container)
+        return GLOBUS_SUCCESS;
+
+    offset = aggregate_uda_value(offset_buf);
+    length = aggregate_uda_value(length_buf);
+    if (!offset || !length)
+    {
+        result = GlobusGFSErrorGeneric("Incomplete aggregate index");
+        goto cleanup;
+    }
+
+    if (!aggregate_is_container(Member->Container) ||
+        !aggregate_parse_u64(offset, &Member->Offset) ||
+        !aggregate_parse_u64(length, &Member->Length) ||
+        Member->Offset + Member->Length < Member->Offset)
+    {
+        WARN("Ignoring the illegal aggregate index of %s", Pathname);
+        result = GlobusGFSErrorGeneric("Illegal aggregate index");
+        goto cleanup;
+    }
+
+cleanup:
+    free(offset);
+    free(length);
+    if (result)
+        aggregate_member_destroy(Member);
+    return result;
+}
+
+globus_result_t
+aggregate_check_extent(const aggregate_member_t *Member)
+{
+    hpss_stat_t hpss_stat_buf;
+
+    int retval = Hpss_Stat(Member->Container, &hpss_stat_buf);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    if (!S_ISREG(hpss_stat_buf.st_mode) ||
+        Member->Offset + Member->Length > hpss_stat_buf.st_size)
+        return GlobusGFSErrorGeneric("Aggregate member lies outside its container");
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+aggregate_clear(const char *Pathname)
+{
+    hpss_userattr_t      user_attrs[1];
+    hpss_userattr_list_t attr_list;
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/aggregate/container";
+    attr_list.Pair[0].Value = "";
+
+    int retval = Hpss_UserAttrSetAttrs(Pathname, &attr_list, NULL);
+    if (retval != HPSS_E_NOERROR && hpss_error_status(retval) != -ENOENT)
+        return hpss_error_to_globus_result(retval);
+    return GLOBUS_SUCCESS;
+}
+
+void
+aggregate_member_destroy(aggregate_member_t *Member)
+{
+    free(Member->Container);
+    memset(Member, 0, sizeof(*Member));
+}
+
+void
+aggregate_shutdown()
+{
+    pthread_mutex_lock(&Aggregate.Lock);
+    aggregate_retire_container();
+    pthread_mutex_unlock(&Aggregate.Lock);
+}
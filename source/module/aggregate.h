@@ -0,0 +1,75 @@
+#ifndef HPSS_DSI_AGGREGATE_H
+#define HPSS_DSI_AGGREGATE_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * Local includes
+ */
+#include "hpss.h"
+
+/*
+ * Small file aggregation. When $HPSS_DSI_AGGREGATE_DIR is set, small uploads
+ * beneath it are appended to a large container file instead of getting a
+ * bitfile of their own. The uploaded path becomes an empty placeholder whose
+ * UDA records where its data lives in the container.
+ */
+typedef struct
+{
+    char *   Container; // NULL if the file is not an aggregate member
+    uint64_t Offset;    // Of the member's data within Container
+    uint64_t Length;
+} aggregate_member_t;
+
+/* True if Pathname is beneath $HPSS_DSI_AGGREGATE_DIR. */
+bool
+aggregate_enabled_for(const char *Pathname);
+
+/* Largest upload that will be aggregated. */
+uint64_t
+aggregate_max_member_size();
+
+/*
+ * Appends Buffer to this process's current container and records the
+ * member index in Pathname's UDA once the data is committed. Pathname must
+ * already exist.
+ */
+globus_result_t
+aggregate_store(const char *Pathname, const char *Buffer, uint64_t Length);
+
+/*
+ * Fills in Member if Pathname is an aggregate member. Stat is Pathname's
+ * stat; UDA is only consulted for empty regular files, wherever they are,
+ * and only while $HPSS_DSI_AGGREGATE_DIR is set, so other files cost
+ * nothing. Indexes naming anything but one of our containers are an error.
+ */
+globus_result_t
+aggregate_lookup(const char *        Pathname,
+                 const hpss_stat_t * Stat,
+                 aggregate_member_t *Member);
+
+/* Checks that Member's data lies within its container before it is read. */
+globus_result_t
+aggregate_check_extent(const aggregate_member_t *Member);
+
+/* Removes the member index from Pathname, ie. after it is overwritten. */
+globus_result_t
+aggregate_clear(const char *Pathname);
+
+void
+aggregate_member_destroy(aggregate_member_t *Member);
+
+/* Stops filling this process's container. */
+void
+aggregate_shutdown();
+
+#endif /* HPSS_DSI_AGGREGATE_H */
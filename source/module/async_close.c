@@ -0,0 +1,198 @@
+/*
+ * System includes
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Local includes
+ */
+#include "async_close.h"
+#include "config.h"
+#include "hpss.h"
+#include "logging.h"
+
+/*
+ * Closes are handed to up to $HPSS_DSI_ASYNC_CLOSE_WORKERS threads, started
+ * on demand. At most ASYNC_CLOSE_QUEUE_MAX closes wait in the queue; beyond
+ * that the caller closes synchronously, which bounds both memory and the
+ * number of files a session can leave open.
+ */
+#define ASYNC_CLOSE_DEFAULT_WORKERS 4
+#define ASYNC_CLOSE_QUEUE_MAX       64
+
+struct close_request
+{
+    int                   FD;
+    char *                Pathname;
+    async_close_error_cb  OnError;
+    struct close_request *Next;
+};
+
+static struct
+{
+    pthread_mutex_t       Lock;
+    pthread_cond_t        WorkCond;  // Workers wait for requests
+    pthread_cond_t        DrainCond; // async_close_drain() waits for Pending
+    bool                  Enabled;
+    bool                  StrictDurability;
+    int                   MaxWorkers;
+    int                   Workers;
+    int                   Queued;
+    int                   Pending; // Queued plus in progress
+    struct close_request *Head;
+    struct close_request *Tail;
+} AsyncClose = {.Lock      = PTHREAD_MUTEX_INITIALIZER,
+                .WorkCond  = PTHREAD_COND_INITIALIZER,
+                .DrainCond = PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t AsyncCloseInitialized = PTHREAD_ONCE_INIT;
+
+static void
+async_close_init()
+{
+    AsyncClose.Enabled = config_get_env_int("HPSS_DSI_ASYNC_CLOSE", 0) != 0;
+    AsyncClose.StrictDurability =
+        config_get_env_int("HPSS_DSI_STRICT_DURABILITY", 0) != 0;
+    AsyncClose.MaxWorkers = config_get_env_int("HPSS_DSI_ASYNC_CLOSE_WORKERS",
+                                               ASYNC_CLOSE_DEFAULT_WORKERS);
+    if (AsyncClose.MaxWorkers <= 0)
+        AsyncClose.Enabled = false;
+}
+
+bool
+async_close_enabled()
+{
+    pthread_once(&AsyncCloseInitialized, async_close_init);
+    return AsyncClose.Enabled;
+}
+
+bool
+async_close_enabled_for_writes()
+{
+    return async_close_enabled() && !AsyncClose.StrictDurability;
+}
+
+static void
+async_close_now(int FD, const char *Pathname, async_close_error_cb OnError)
+{
+    int retval = Hpss_Close(FD);
+    if (retval)
+    {
+        WARN("Deferred close of %s failed", Pathname);
+        if (OnError)
+            OnError(Pathname);
+    }
+}
+
+static void *
+async_close_worker(void *Arg)
+{
+    pthread_mutex_lock(&AsyncClose.Lock);
+    while (1)
+    {
+        while (!AsyncClose.Head)
+            pthread_cond_wait(&AsyncClose.WorkCond, &AsyncClose.Lock);
+
+        struct close_request *request = AsyncClose.Head;
+        AsyncClose.Head               = request->Next;
+        if (!AsyncClose.Head)
+            AsyncClose.Tail = NULL;
+        AsyncClose.Queued--;
+
+        pthread_mutex_unlock(&AsyncClose.Lock);
+        {
+            async_close_now(request->FD, request->Pathname, request->OnError);
+            free(request->Pathname);
+            free(request);
+        }
+        pthread_mutex_lock(&AsyncClose.Lock);
+
+        if (--AsyncClose.Pending == 0)
+            pthread_cond_broadcast(&AsyncClose.DrainCond);
+    }
+    return NULL;
+}
+
+void
+async_close(int FD, const char *Pathname, async_close_error_cb OnError)
+{
+    pthread_t             thread;
+    pthread_attr_t        attr;
+    struct close_request *request = NULL;
+
+    if (async_close_enabled())
+        request = malloc(sizeof(*request));
+    if (request)
+    {
+        request->FD       = FD;
+        request->Pathname = strdup(Pathname);
+        request->OnError  = OnError;
+        request->Next     = NULL;
+        if (!request->Pathname)
+        {
+            free(request);
+            request = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&AsyncClose.Lock);
+    {
+        if (request && AsyncClose.Queued >= ASYNC_CLOSE_QUEUE_MAX)
+        {
+            DEBUG("Close queue is full, closing %s now", Pathname);
+            free(request->Pathname);
+            free(request);
+            request = NULL;
+        }
+
+        int busy = AsyncClose.Pending - AsyncClose.Queued;
+        int idle = AsyncClose.Workers - busy;
+
+        /* Start another worker if every worker already has a close. */
+        if (request && AsyncClose.Workers < AsyncClose.MaxWorkers &&
+            AsyncClose.Queued >= idle)
+        {
+            if (pthread_attr_init(&attr) == 0)
+            {
+                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+                if (pthread_create(&thread, &attr, async_close_worker, NULL) == 0)
+                    AsyncClose.Workers++;
+                pthread_attr_destroy(&attr);
+            }
+        }
+
+        if (request && AsyncClose.Workers == 0)
+        {
+            free(request->Pathname);
+            free(request);
+            request = NULL;
+        }
+
+        if (request)
+        {
+            if (AsyncClose.Tail)
+                AsyncClose.Tail->Next = request;
+            else
+                AsyncClose.Head = request;
+            AsyncClose.Tail = request;
+            AsyncClose.Queued++;
+            AsyncClose.Pending++;
+            pthread_cond_signal(&AsyncClose.WorkCond);
+        }
+    }
+    pthread_mutex_unlock(&AsyncClose.Lock);
+
+    if (!request)
+        async_close_now(FD, Pathname, OnError);
+}
+
+void
+async_close_drain()
+{
+    pthread_mutex_lock(&AsyncClose.Lock);
+    while (AsyncClose.Pending > 0)
+        pthread_cond_wait(&AsyncClose.DrainCond, &AsyncClose.Lock);
+    pthread_mutex_unlock(&AsyncClose.Lock);
+}
@@ -0,0 +1,35 @@
+#ifndef HPSS_DSI_ASYNC_CLOSE_H
+#define HPSS_DSI_ASYNC_CLOSE_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+
+/*
+ * Deferred Hpss_Close(). When $HPSS_DSI_ASYNC_CLOSE is enabled, transfers
+ * report completion first and hand the close to a small pool of workers.
+ * STOR keeps closing synchronously when $HPSS_DSI_STRICT_DURABILITY is set.
+ */
+typedef void (*async_close_error_cb)(const char *Pathname);
+
+/* True if RETR may close asynchronously. */
+bool
+async_close_enabled();
+
+/* True if STOR may close asynchronously. */
+bool
+async_close_enabled_for_writes();
+
+/*
+ * Queues FD for closing. OnError, if not NULL, is called from the worker if
+ * the close fails. If the queue is full, FD is closed before returning.
+ */
+void
+async_close(int FD, const char *Pathname, async_close_error_cb OnError);
+
+/* Waits for all queued closes to finish. */
+void
+async_close_drain();
+
+#endif /* HPSS_DSI_ASYNC_CLOSE_H */
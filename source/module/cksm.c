@@ -2,11 +2,17 @@
  * System includes
  */
 #include <assert.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
 
 /*
  * Local includes
  */
+#include "aggregate.h"
 #include "cksm.h"
+#include "config.h"
+#include "digest.h"
 #include "hpss.h"
 #include "pio.h"
 #include "stat.h"
@@ -21,6 +27,27 @@ cksm_pio_callout(char *    Buffer,
 void
 cksm_transfer_complete_callback(globus_result_t Result, void *UserArg);
 
+static globus_off_t
+cksm_uda_to_offset(char *XML);
+
+static bool
+cksm_uda_is_fresh(char *             Pathname,
+                  const hpss_stat_t *HpssStat,
+                  char *             FileSize,
+                  char *             LastUpdate);
+
+static bool
+cksm_uda_freshness_enabled()
+{
+    return config_get_env_int("HPSS_DSI_UDA_FRESHNESS", 0) != 0;
+}
+
+/*
+ * Seconds that a file's mtime may trail the lastupdate of its checksum. The
+ * two clocks differ, and deferred closes finish after the checksum is saved.
+ */
+#define CKSM_DEFAULT_FRESHNESS_SKEW 300
+
 void
 cksm_update_markers(cksm_marker_t *Marker, globus_off_t Bytes)
 {
@@ -135,21 +162,514 @@ cksm_open_for_reading(char *Pathname, int *FileFD, int *FileStripeWidth)
     return GLOBUS_SUCCESS;
 }
 
+/*
+ * $HPSS_DSI_CKSM_PIPELINE_BUFFERS blocks may wait to be hashed. 0 hashes on
+ * the PIO thread.
+ */
+#define CKSM_PIPELINE_DEFAULT_BUFFERS 4
+
+static double
+cksm_elapsed_ms(const struct timespec *Start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - Start->tv_sec) * 1000.0 +
+           (now.tv_nsec - Start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Block digest cache. A whole file CKSM also checksums each aligned block of
+ * $HPSS_DSI_CKSM_CACHE_BLOCK_SIZE bytes and saves the block checksums in UDA
+ * so that later ranged CKSMs of whole blocks need not read the file. The
+ * block size is doubled until the list fits in a UDA value. Only adler32
+ * and crc32c ranges spanning several blocks can be answered, by combining
+ * the block checksums.
+ *
+ * /hpss/user/cksum/blocks/algorithm                          crc32c
+ * /hpss/user/cksum/blocks/blocksize                      1073741824
+ * /hpss/user/cksum/blocks/filesize                       2147483648
+ * /hpss/user/cksum/blocks/digests                 e3069283,0a1b2c3d
+ */
+#define CKSM_CACHE_UDA_OVERHEAD 256
+
+struct cksm_blocks
+{
+    const digest_engine_t *Engine;
+    char *                 Pathname;
+    globus_off_t           BlockSize;
+    globus_off_t           FileSize;
+    globus_off_t           Offset; // Bytes checksummed
+    digest_t               Current;
+    bool                   InBlock; // Current is initialized
+    bool                   Failed;
+    char *                 Digests; // Comma separated
+    size_t                 Used;
+};
+
+static void
+cksm_blocks_destroy(cksm_blocks_t *Blocks)
+{
+    if (Blocks)
+    {
+        digest_destroy(&Blocks->Current);
+        free(Blocks->Pathname);
+        free(Blocks->Digests);
+        free(Blocks);
+    }
+}
+
+/* Returns NULL if the cache is disabled or does not apply. */
+static cksm_blocks_t *
+cksm_blocks_create(const digest_engine_t *Engine,
+                   const char *           Pathname,
+                   globus_off_t           FileSize)
+{
+    cksm_blocks_t *blocks     = NULL;
+    globus_off_t   block_size = 0;
+    size_t         max_blocks = 0;
+    size_t         entry      = digest_string_length(Engine) + 1;
+
+    block_size = config_get_env_int("HPSS_DSI_CKSM_CACHE_BLOCK_SIZE", 0);
+    if (block_size <= 0 || FileSize <= 0 || digest_is_tree(Engine))
+        return NULL;
+
+    max_blocks = (HPSS_XML_SIZE - CKSM_CACHE_UDA_OVERHEAD) / entry;
+    while ((FileSize + block_size - 1) / block_size > max_blocks)
+        block_size *= 2;
+
+    blocks = calloc(1, sizeof(cksm_blocks_t));
+    if (!blocks)
+        return NULL;
+
+    blocks->Engine    = Engine;
+    blocks->BlockSize = block_size;
+    blocks->FileSize  = FileSize;
+    blocks->Pathname  = strdup(Pathname);
+    blocks->Digests   = malloc(((FileSize + block_size - 1) / block_size) * entry);
+    if (!blocks->Pathname || !blocks->Digests)
+    {
+        cksm_blocks_destroy(blocks);
+        return NULL;
+    }
+    blocks->Digests[0] = '\0';
+    return blocks;
+}
+
+static void
+cksm_blocks_finish_block(cksm_blocks_t *Blocks)
+{
+    char string[DIGEST_MAX_STRING];
+
+    Blocks->InBlock = false;
+    if (digest_final(&Blocks->Current, string))
+    {
+        Blocks->Failed = true;
+        return;
+    }
+
+    Blocks->Used += sprintf(Blocks->Digests + Blocks->Used,
+                            "%s%s",
+                            Blocks->Used ? "," : "",
+                            string);
+}
+
+/* Failures only disable the cache. */
+static void
+cksm_blocks_update(cksm_blocks_t *Blocks, const char *Buffer, size_t Length)
+{
+    while (Length > 0 && !Blocks->Failed)
+    {
+        if (!Blocks->InBlock)
+        {
+            if (digest_init(&Blocks->Current, Blocks->Engine))
+            {
+                Blocks->Failed = true;
+                return;
+            }
+            Blocks->InBlock = true;
+        }
+
+        globus_off_t room = Blocks->BlockSize - (Blocks->Offset % Blocks->BlockSize);
+        size_t       n    = Length < room ? Length : room;
+
+        if (digest_update(&Blocks->Current, Buffer, n))
+            Blocks->Failed = true;
+
+        Buffer += n;
+        Length -= n;
+        Blocks->Offset += n;
+
+        if (Blocks->Offset % Blocks->BlockSize == 0)
+            cksm_blocks_finish_block(Blocks);
+    }
+}
+
+static void
+cksm_blocks_save(cksm_blocks_t *Blocks)
+{
+    int                  retval = 0;
+    char                 blocksize_buf[32];
+    char                 filesize_buf[32];
+    char                 lastupdate_buf[32];
+    hpss_userattr_t      user_attrs[5];
+    hpss_userattr_list_t attr_list;
+
+    if (Blocks->InBlock)
+        cksm_blocks_finish_block(Blocks);
+
+    if (Blocks->Failed || Blocks->Offset != Blocks->FileSize)
+        return;
+
+    snprintf(blocksize_buf,
+             sizeof(blocksize_buf),
+             "%" GLOBUS_OFF_T_FORMAT,
+             Blocks->BlockSize);
+    snprintf(filesize_buf,
+             sizeof(filesize_buf),
+             "%" GLOBUS_OFF_T_FORMAT,
+             Blocks->FileSize);
+    snprintf(lastupdate_buf, sizeof(lastupdate_buf), "%lu", time(NULL));
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/cksum/blocks/algorithm";
+    attr_list.Pair[0].Value = (char *)digest_name(Blocks->Engine);
+    attr_list.Pair[1].Key   = "/hpss/user/cksum/blocks/blocksize";
+    attr_list.Pair[1].Value = blocksize_buf;
+    attr_list.Pair[2].Key   = "/hpss/user/cksum/blocks/digests";
+    attr_list.Pair[2].Value = Blocks->Digests;
+    attr_list.Pair[3].Key   = "/hpss/user/cksum/blocks/filesize";
+    attr_list.Pair[3].Value = filesize_buf;
+    attr_list.Pair[4].Key   = "/hpss/user/cksum/blocks/lastupdate";
+    attr_list.Pair[4].Value = lastupdate_buf;
+
+    retval = Hpss_UserAttrSetAttrs(Blocks->Pathname, &attr_list, NULL);
+    if (retval)
+    {
+        WARN("Failed to save the block checksums of %s", Blocks->Pathname);
+        return;
+    }
+
+    DEBUG("Saved %s block checksums of %s, block size %lld",
+          digest_name(Blocks->Engine),
+          Blocks->Pathname,
+          (long long)Blocks->BlockSize);
+}
+
+/*
+ * Looks up Offset/Length in the block cache. *ChecksumString is NULL when
+ * the cache can not answer, including on any error.
+ */
+static void
+cksm_from_block_cache(char *                 Pathname,
+                      globus_off_t           Offset,
+                      globus_off_t           Length,
+                      const digest_engine_t *Engine,
+                      char **                ChecksumString)
+{
+    int                  retval     = 0;
+    char *               value      = NULL;
+    char *               digests    = NULL;
+    char *               entry      = NULL;
+    char *               saveptr    = NULL;
+    globus_off_t         block_size = 0;
+    globus_off_t         file_size  = 0;
+    globus_off_t         end        = 0;
+    globus_off_t         offset     = 0;
+    char                 algorithm[HPSS_XML_SIZE];
+    char                 blocksize[HPSS_XML_SIZE];
+    char                 filesize[HPSS_XML_SIZE];
+    char                 digest_list[HPSS_XML_SIZE];
+    char                 lastupdate[HPSS_XML_SIZE];
+    char                 result[DIGEST_MAX_STRING];
+    hpss_userattr_t      user_attrs[5];
+    hpss_userattr_list_t attr_list;
+    hpss_stat_t          hpss_stat_buf;
+
+    *ChecksumString = NULL;
+
+    if (config_get_env_int("HPSS_DSI_CKSM_CACHE_BLOCK_SIZE", 0) <= 0)
+        return;
+
+    if (Hpss_Stat(Pathname, &hpss_stat_buf))
+        return;
+
+    memset(algorithm, 0, sizeof(algorithm));
+    memset(blocksize, 0, sizeof(blocksize));
+    memset(filesize, 0, sizeof(filesize));
+    memset(digest_list, 0, sizeof(digest_list));
+    memset(lastupdate, 0, sizeof(lastupdate));
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/cksum/blocks/algorithm";
+    attr_list.Pair[0].Value = algorithm;
+    attr_list.Pair[1].Key   = "/hpss/user/cksum/blocks/blocksize";
+    attr_list.Pair[1].Value = blocksize;
+    attr_list.Pair[2].Key   = "/hpss/user/cksum/blocks/filesize";
+    attr_list.Pair[2].Value = filesize;
+    attr_list.Pair[3].Key   = "/hpss/user/cksum/blocks/digests";
+    attr_list.Pair[3].Value = digest_list;
+    attr_list.Pair[4].Key   = "/hpss/user/cksum/blocks/lastupdate";
+    attr_list.Pair[4].Value = lastupdate;
+
+#if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4)
+    retval = Hpss_UserAttrGetAttrs(Pathname, &attr_list, UDA_API_VALUE);
+#else
+    retval = Hpss_UserAttrGetAttrs(Pathname,
+                                   &attr_list,
+                                   UDA_API_VALUE,
+                                   HPSS_XML_SIZE - 1);
+#endif
+    if (retval != HPSS_E_NOERROR)
+        return;
+
+    value = Hpss_ChompXMLHeader(algorithm, NULL);
+    if (!value || strcasecmp(value, digest_name(Engine)) != 0)
+        goto cleanup;
+
+    block_size = cksm_uda_to_offset(blocksize);
+    file_size  = cksm_uda_to_offset(filesize);
+    if (block_size <= 0 || file_size != hpss_stat_buf.st_size)
+        goto cleanup;
+
+    if (cksm_uda_freshness_enabled() &&
+        !cksm_uda_is_fresh(Pathname, &hpss_stat_buf, filesize, lastupdate))
+        goto cleanup;
+
+    if (Length == -1)
+        Length = file_size - Offset;
+    end = Offset + Length;
+
+    /* Only whole blocks. */
+    if (Length <= 0 || end > file_size || Offset % block_size != 0 ||
+        (end % block_size != 0 && end != file_size))
+        goto cleanup;
+
+    if ((end - Offset) > block_size && !digest_can_combine(Engine))
+        goto cleanup;
+
+    digests = Hpss_ChompXMLHeader(digest_list, NULL);
+    if (!digests)
+        goto cleanup;
+
+    for (entry = strtok_r(digests, ",", &saveptr); entry && offset < end;
+         entry = strtok_r(NULL, ",", &saveptr), offset += block_size)
+    {
+        if (offset < Offset)
+            continue;
+
+        globus_off_t length = block_size;
+        if (offset + length > file_size)
+            length = file_size - offset;
+
+        if (offset == Offset)
+            snprintf(result, sizeof(result), "%s", entry);
+        else if (!digest_combine(Engine, result, entry, length, result))
+            goto cleanup;
+    }
+
+    if (offset < end)
+        goto cleanup;
+
+    DEBUG("Answered ranged CKSM of %s from the block cache", Pathname);
+    *ChecksumString = strdup(result);
+
+cleanup:
+    if (value)
+        free(value);
+    if (digests)
+        free(digests);
+}
+
+static globus_result_t
+cksm_hash(cksm_info_t *CksmInfo, const char *Buffer, uint32_t Length)
+{
+    globus_result_t result = digest_update(&CksmInfo->Digest, Buffer, Length);
+    if (!result && CksmInfo->Blocks)
+        cksm_blocks_update(CksmInfo->Blocks, Buffer, Length);
+    return result;
+}
+
+static void *
+cksm_hash_thread(void *Arg)
+{
+    cksm_info_t *    cksm_info = Arg;
+    cksm_pipeline_t *pipeline  = &cksm_info->Pipeline;
+    globus_result_t  result    = GLOBUS_SUCCESS;
+    struct timespec  start;
+
+    pthread_mutex_lock(&pipeline->Lock);
+    while (!result)
+    {
+        if (pipeline->Filled == 0 && !pipeline->Finished)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (pipeline->Filled == 0 && !pipeline->Finished)
+                pthread_cond_wait(&pipeline->Cond, &pipeline->Lock);
+            pipeline->HashWaitMS += cksm_elapsed_ms(&start);
+        }
+
+        if (pipeline->Filled == 0)
+            break;
+
+        cksm_block_t *block = &pipeline->Blocks[pipeline->Head];
+
+        pthread_mutex_unlock(&pipeline->Lock);
+        {
+            result = cksm_hash(cksm_info, block->Buffer, block->Length);
+        }
+        pthread_mutex_lock(&pipeline->Lock);
+
+        if (result)
+            cksm_info->Result = result;
+        else
+            cksm_update_markers(cksm_info->Marker, block->Length);
+
+        pipeline->Head = (pipeline->Head + 1) % pipeline->BlockCount;
+        pipeline->Filled--;
+        pthread_cond_broadcast(&pipeline->Cond);
+    }
+    pthread_mutex_unlock(&pipeline->Lock);
+
+    return NULL;
+}
+
+static globus_result_t
+cksm_start_pipeline(cksm_info_t *CksmInfo)
+{
+    cksm_pipeline_t *pipeline = &CksmInfo->Pipeline;
+    globus_result_t  result   = GLOBUS_SUCCESS;
+    int              count    = 0;
+
+    count = config_get_env_int("HPSS_DSI_CKSM_PIPELINE_BUFFERS",
+                               CKSM_PIPELINE_DEFAULT_BUFFERS);
+    if (count <= 0)
+        return GLOBUS_SUCCESS;
+
+    pipeline->Blocks = calloc(count, sizeof(cksm_block_t));
+    if (!pipeline->Blocks)
+        return GlobusGFSErrorMemory("cksm_block_t");
+
+    for (pipeline->BlockCount = 0; pipeline->BlockCount < count;
+         pipeline->BlockCount++)
+    {
+        pipeline->Blocks[pipeline->BlockCount].Buffer =
+            malloc(CksmInfo->BlockSize);
+        if (!pipeline->Blocks[pipeline->BlockCount].Buffer)
+        {
+            result = GlobusGFSErrorMemory("checksum buffer");
+            goto cleanup;
+        }
+    }
+
+    pthread_mutex_init(&pipeline->Lock, NULL);
+    pthread_cond_init(&pipeline->Cond, NULL);
+
+    result = pio_launch_attached(cksm_hash_thread, CksmInfo, &pipeline->Thread);
+    if (result)
+    {
+        pthread_mutex_destroy(&pipeline->Lock);
+        pthread_cond_destroy(&pipeline->Cond);
+        goto cleanup;
+    }
+    pipeline->Started = true;
+
+cleanup:
+    if (result)
+    {
+        for (int i = 0; i < pipeline->BlockCount; i++)
+            free(pipeline->Blocks[i].Buffer);
+        free(pipeline->Blocks);
+        pipeline->Blocks     = NULL;
+        pipeline->BlockCount = 0;
+    }
+    return result;
+}
+
+/* Waits for everything queued to be hashed. */
+static void
+cksm_stop_pipeline(cksm_info_t *CksmInfo)
+{
+    cksm_pipeline_t *pipeline = &CksmInfo->Pipeline;
+
+    if (!pipeline->Started)
+        return;
+
+    pthread_mutex_lock(&pipeline->Lock);
+    {
+        pipeline->Finished = true;
+        pthread_cond_broadcast(&pipeline->Cond);
+    }
+    pthread_mutex_unlock(&pipeline->Lock);
+
+    pthread_join(pipeline->Thread, NULL);
+
+    DEBUG("CKSM pipeline: mover waited %.3f ms, hashing waited %.3f ms",
+          pipeline->MoverWaitMS,
+          pipeline->HashWaitMS);
+
+    pthread_mutex_destroy(&pipeline->Lock);
+    pthread_cond_destroy(&pipeline->Cond);
+    for (int i = 0; i < pipeline->BlockCount; i++)
+        free(pipeline->Blocks[i].Buffer);
+    free(pipeline->Blocks);
+    pipeline->Started = false;
+}
+
+/* Only blocks if every buffer is waiting to be hashed. */
+static globus_result_t
+cksm_queue_block(cksm_info_t *CksmInfo, char *Buffer, uint32_t Length)
+{
+    cksm_pipeline_t *pipeline = &CksmInfo->Pipeline;
+    globus_result_t  result   = GLOBUS_SUCCESS;
+    struct timespec  start;
+
+    pthread_mutex_lock(&pipeline->Lock);
+    {
+        if (pipeline->Filled == pipeline->BlockCount && !CksmInfo->Result)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (pipeline->Filled == pipeline->BlockCount && !CksmInfo->Result)
+                pthread_cond_wait(&pipeline->Cond, &pipeline->Lock);
+            pipeline->MoverWaitMS += cksm_elapsed_ms(&start);
+        }
+
+        result = CksmInfo->Result;
+        if (!result)
+        {
+            int tail = (pipeline->Head + pipeline->Filled) % pipeline->BlockCount;
+            memcpy(pipeline->Blocks[tail].Buffer, Buffer, Length);
+            pipeline->Blocks[tail].Length = Length;
+            pipeline->Filled++;
+            pthread_cond_broadcast(&pipeline->Cond);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->Lock);
+
+    return result;
+}
+
 int
 cksm_pio_callout(char *    Buffer,
                  uint32_t *Length,
                  uint64_t  Offset,
                  void *    CallbackArg)
 {
-    int          rc        = 0;
-    cksm_info_t *cksm_info = CallbackArg;
+    globus_result_t result    = GLOBUS_SUCCESS;
+    cksm_info_t *   cksm_info = CallbackArg;
 
     assert(*Length <= cksm_info->BlockSize);
 
-    rc = MD5_Update(&cksm_info->MD5Context, Buffer, *Length);
-    if (rc != 1)
+    if (cksm_info->Pipeline.Started)
+        return cksm_queue_block(cksm_info, Buffer, *Length) != GLOBUS_SUCCESS;
+
+    result = cksm_hash(cksm_info, Buffer, *Length);
+    if (result)
     {
-        cksm_info->Result = GlobusGFSErrorGeneric("MD5_Update() failed");
+        cksm_info->Result = result;
         return 1;
     }
 
@@ -174,15 +694,32 @@ cksm_range_complete_callback(globus_off_t *Offset,
         *Eot = 1;
 }
 
+globus_result_t
+cksm_md5_final(MD5_CTX *Context, char ChecksumString[2 * MD5_DIGEST_LENGTH + 1])
+{
+    int           i;
+    unsigned char md5_digest[MD5_DIGEST_LENGTH];
+
+    if (MD5_Final(md5_digest, Context) != 1)
+        return GlobusGFSErrorGeneric("MD5_Final() failed");
+
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+    {
+        sprintf(&(ChecksumString[i * 2]), "%02x", (unsigned int)md5_digest[i]);
+    }
+
+    return GLOBUS_SUCCESS;
+}
+
 void
 cksm_transfer_complete_callback(globus_result_t Result, void *UserArg)
 {
     globus_result_t result    = Result;
     cksm_info_t *   cksm_info = UserArg;
     int             rc        = 0;
-    unsigned char   md5_digest[MD5_DIGEST_LENGTH];
-    char            cksm_string[2 * MD5_DIGEST_LENGTH + 1];
-    int             i;
+    char            cksm_string[DIGEST_MAX_STRING];
+
+    cksm_stop_pipeline(cksm_info);
 
     /* Give our error priority. */
     if (cksm_info->Result)
@@ -193,71 +730,54 @@ cksm_transfer_complete_callback(globus_result_t Result, void *UserArg)
         result = hpss_error_to_globus_result(rc);
 
     if (!result)
-    {
-        rc = MD5_Final(md5_digest, &cksm_info->MD5Context);
-        if (rc != 1)
-            result = GlobusGFSErrorGeneric("MD5_Final() failed");
-    }
-
-    if (!result)
-    {
-        for (i = 0; i < MD5_DIGEST_LENGTH; i++)
-        {
-            sprintf(&(cksm_string[i * 2]), "%02x", (unsigned int)md5_digest[i]);
-        }
-    }
+        result = digest_final(&cksm_info->Digest, cksm_string);
+    digest_destroy(&cksm_info->Digest);
 
     cksm_stop_markers(cksm_info->Marker);
 
-    cksm_info->Callback(
-        cksm_info->Operation, result, result ? NULL : cksm_string);
+    cksm_info->Done(result, result ? NULL : cksm_string, cksm_info->DoneArg);
 
-    if (!result && cksm_info->CommandInfo->cksm_offset == 0 &&
-        cksm_info->CommandInfo->cksm_length == -1)
-    {
-        if (cksm_info->UseUDAChecksums)
-            cksm_set_uda_checksum(cksm_info->Pathname, cksm_string);
-    }
+    if (!result && cksm_info->Blocks)
+        cksm_blocks_save(cksm_info->Blocks);
+    cksm_blocks_destroy(cksm_info->Blocks);
 
-    free(cksm_info->Pathname);
     free(cksm_info);
 }
 
-void
-cksm(globus_gfs_operation_t     Operation,
-     globus_gfs_command_info_t *CommandInfo,
-     bool                       UseUDAChecksums,
-     commands_callback          Callback)
+globus_result_t
+cksm_compute(globus_gfs_operation_t Operation,
+             char *                 Pathname,
+             globus_off_t           Offset,
+             globus_off_t           Length,
+             const digest_engine_t *Engine,
+             int                    Flags,
+             cksm_done_callback     Done,
+             void *                 DoneArg)
 {
-    globus_result_t result            = GLOBUS_SUCCESS;
-    cksm_info_t *   cksm_info         = NULL;
-    int             rc                = 0;
-    int             file_stripe_width = 0;
-    char *          checksum_string   = NULL;
-    hpss_stat_t     hpss_stat_buf;
+    globus_result_t    result            = GLOBUS_SUCCESS;
+    cksm_info_t *      cksm_info         = NULL;
+    int                rc                = 0;
+    int                file_stripe_width = 0;
+    hpss_stat_t        hpss_stat_buf;
+    aggregate_member_t member;
+
+    rc = Hpss_Stat(Pathname, &hpss_stat_buf);
+    if (rc)
+        return hpss_error_to_globus_result(rc);
 
-    if (CommandInfo->cksm_offset == 0 && CommandInfo->cksm_length == -1)
+    /* Members are read from their container. */
+    result = aggregate_lookup(Pathname, &hpss_stat_buf, &member);
+    if (result)
+        return result;
+    if (member.Container)
     {
-        if (UseUDAChecksums)
+        result = aggregate_check_extent(&member);
+        if (result)
         {
-            result = cksm_get_uda_checksum(CommandInfo->pathname,
-                                           &checksum_string);
-            if (result || checksum_string)
-            {
-                Callback(Operation, result, result ? NULL : checksum_string);
-                if (checksum_string)
-                    free(checksum_string);
-                return;
-            }
+            aggregate_member_destroy(&member);
+            return result;
         }
-    }
-
-    rc = Hpss_Stat(CommandInfo->pathname, &hpss_stat_buf);
-    if (rc)
-    {
-        result = hpss_error_to_globus_result(rc);
-        Callback(Operation, result, NULL);
-        return;
+        hpss_stat_buf.st_size = member.Length;
     }
 
     cksm_info = malloc(sizeof(cksm_info_t));
@@ -267,35 +787,42 @@ cksm(globus_gfs_operation_t     Operation,
         goto cleanup;
     }
     memset(cksm_info, 0, sizeof(cksm_info_t));
-    cksm_info->Operation       = Operation;
-    cksm_info->CommandInfo     = CommandInfo;
-    cksm_info->Callback        = Callback;
-    cksm_info->UseUDAChecksums = UseUDAChecksums;
-    cksm_info->FileFD          = -1;
-    cksm_info->Pathname        = strdup(CommandInfo->pathname);
-    cksm_info->RangeLength     = CommandInfo->cksm_length;
+    cksm_info->Operation   = Operation;
+    cksm_info->Done        = Done;
+    cksm_info->DoneArg     = DoneArg;
+    cksm_info->FileFD      = -1;
+    cksm_info->RangeLength = Length;
     if (cksm_info->RangeLength == -1)
-        cksm_info->RangeLength =
-            hpss_stat_buf.st_size - CommandInfo->cksm_offset;
+        cksm_info->RangeLength = hpss_stat_buf.st_size - Offset;
 
-    rc = MD5_Init(&cksm_info->MD5Context);
-    if (rc != 1)
-    {
-        result = GlobusGFSErrorGeneric("Failed to create MD5 context");
+    result = digest_init(&cksm_info->Digest, Engine);
+    if (result)
         goto cleanup;
-    }
+
+    if ((Flags & CKSM_FLAG_CACHE_BLOCKS) && Offset == 0 && Length == -1 &&
+        !member.Container)
+        cksm_info->Blocks =
+            cksm_blocks_create(Engine, Pathname, hpss_stat_buf.st_size);
 
     globus_gridftp_server_get_block_size(Operation, &cksm_info->BlockSize);
 
     /*
      * Open the file.
      */
-    result = cksm_open_for_reading(
-        CommandInfo->pathname, &cksm_info->FileFD, &file_stripe_width);
+    result = cksm_open_for_reading(member.Container ? member.Container : Pathname,
+                                   &cksm_info->FileFD,
+                                   &file_stripe_width);
     if (result)
         goto cleanup;
 
-    result = cksm_start_markers(&cksm_info->Marker, Operation);
+    if (!(Flags & CKSM_FLAG_NO_MARKERS))
+    {
+        result = cksm_start_markers(&cksm_info->Marker, Operation);
+        if (result)
+            goto cleanup;
+    }
+
+    result = cksm_start_pipeline(cksm_info);
     if (result)
         goto cleanup;
 
@@ -306,23 +833,137 @@ cksm(globus_gfs_operation_t     Operation,
                        cksm_info->FileFD,
                        file_stripe_width,
                        cksm_info->BlockSize,
-                       CommandInfo->cksm_offset,
+                       member.Offset + Offset,
                        cksm_info->RangeLength,
                        cksm_pio_callout,
                        cksm_range_complete_callback,
                        cksm_transfer_complete_callback,
                        cksm_info);
 
+cleanup:
+    if (result && cksm_info)
+    {
+        cksm_stop_pipeline(cksm_info);
+        cksm_stop_markers(cksm_info->Marker);
+        if (cksm_info->FileFD != -1)
+            Hpss_Close(cksm_info->FileFD);
+        digest_destroy(&cksm_info->Digest);
+        cksm_blocks_destroy(cksm_info->Blocks);
+        free(cksm_info);
+    }
+    aggregate_member_destroy(&member);
+    return result;
+}
+
+typedef struct
+{
+    globus_gfs_operation_t Operation;
+    commands_callback      Callback;
+    char *                 Pathname;
+    const digest_engine_t *Engine;
+    bool                   SaveUDAChecksum;
+} cksm_command_t;
+
+static void
+cksm_command_done(globus_result_t Result, char *Checksum, void *UserArg)
+{
+    cksm_command_t *command = UserArg;
+
+    command->Callback(command->Operation, Result, Checksum);
+
+    if (!Result && command->SaveUDAChecksum)
+        cksm_set_uda_checksum(
+            command->Pathname, digest_name(command->Engine), Checksum);
+
+    free(command->Pathname);
+    free(command);
+}
+
+void
+cksm(globus_gfs_operation_t     Operation,
+     globus_gfs_command_info_t *CommandInfo,
+     bool                       UseUDAChecksums,
+     commands_callback          Callback)
+{
+    globus_result_t        result          = GLOBUS_SUCCESS;
+    cksm_command_t *       command         = NULL;
+    char *                 checksum_string = NULL;
+    bool                   whole_file      = false;
+    const digest_engine_t *engine          = NULL;
+
+    engine = digest_lookup(CommandInfo->cksm_alg);
+    if (!engine)
+    {
+        Callback(Operation,
+                 GlobusGFSErrorGeneric("Unsupported checksum algorithm"),
+                 NULL);
+        return;
+    }
+
+    whole_file = CommandInfo->cksm_offset == 0 && CommandInfo->cksm_length == -1;
+
+    if (whole_file && UseUDAChecksums)
+    {
+        result = cksm_get_uda_checksum(
+            CommandInfo->pathname, digest_name(engine), &checksum_string);
+        if (result || checksum_string)
+        {
+            Callback(Operation, result, result ? NULL : checksum_string);
+            if (checksum_string)
+                free(checksum_string);
+            return;
+        }
+    }
+
+    if (!whole_file && UseUDAChecksums)
+    {
+        cksm_from_block_cache(CommandInfo->pathname,
+                              CommandInfo->cksm_offset,
+                              CommandInfo->cksm_length,
+                              engine,
+                              &checksum_string);
+        if (checksum_string)
+        {
+            Callback(Operation, GLOBUS_SUCCESS, checksum_string);
+            free(checksum_string);
+            return;
+        }
+    }
+
+    command = malloc(sizeof(cksm_command_t));
+    if (!command)
+    {
+        result = GlobusGFSErrorMemory("cksm_command_t");
+        goto cleanup;
+    }
+    command->Operation       = Operation;
+    command->Callback        = Callback;
+    command->Engine          = engine;
+    command->SaveUDAChecksum = whole_file && UseUDAChecksums;
+    command->Pathname        = strdup(CommandInfo->pathname);
+    if (!command->Pathname)
+    {
+        result = GlobusGFSErrorMemory("pathname");
+        goto cleanup;
+    }
+
+    result = cksm_compute(Operation,
+                          CommandInfo->pathname,
+                          CommandInfo->cksm_offset,
+                          CommandInfo->cksm_length,
+                          engine,
+                          command->SaveUDAChecksum ? CKSM_FLAG_CACHE_BLOCKS : 0,
+                          cksm_command_done,
+                          command);
+
 cleanup:
     if (result)
     {
-        if (cksm_info)
+        if (command)
         {
-            if (cksm_info->FileFD != -1)
-                Hpss_Close(cksm_info->FileFD);
-            if (cksm_info->Pathname)
-                free(cksm_info->Pathname);
-            free(cksm_info);
+            if (command->Pathname)
+                free(command->Pathname);
+            free(command);
         }
         Callback(Operation, result, NULL);
     }
@@ -338,7 +979,7 @@ cleanup:
  * /hpss/user/cksum/filesize                                     1
  */
 globus_result_t
-cksm_set_uda_checksum(char *Pathname, char *Checksum)
+cksm_set_uda_checksum(char *Pathname, const char *Algorithm, char *Checksum)
 {
     int                  retval = 0;
     char                 filesize_buf[32];
@@ -360,7 +1001,7 @@ cksm_set_uda_checksum(char *Pathname, char *Checksum)
     attr_list.Pair = user_attrs;
 
     attr_list.Pair[0].Key   = "/hpss/user/cksum/algorithm";
-    attr_list.Pair[0].Value = "md5";
+    attr_list.Pair[0].Value = (char *)Algorithm;
     attr_list.Pair[1].Key   = "/hpss/user/cksum/checksum";
     attr_list.Pair[1].Value = Checksum;
     attr_list.Pair[2].Key   = "/hpss/user/cksum/lastupdate";
@@ -382,7 +1023,9 @@ cksm_set_uda_checksum(char *Pathname, char *Checksum)
 }
 
 globus_result_t
-cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString)
+cksm_get_uda_checksum(char *       Pathname,
+                      const char * Algorithm,
+                      char **      ChecksumString)
 {
     int                  retval = 0;
     char *               tmp    = NULL;
@@ -390,16 +1033,41 @@ cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString)
     char                 algorithm[HPSS_XML_SIZE];
     char                 checksum[HPSS_XML_SIZE];
     char                 state[HPSS_XML_SIZE];
-    hpss_userattr_t      user_attrs[3];
+    char                 filesize[HPSS_XML_SIZE];
+    char                 lastupdate[HPSS_XML_SIZE];
+    hpss_userattr_t      user_attrs[5];
     hpss_userattr_list_t attr_list;
+    hpss_stat_t          hpss_stat_buf;
+    bool                 check_freshness = cksm_uda_freshness_enabled();
 
     *ChecksumString = NULL;
 
     memset(algorithm, 0, sizeof(algorithm));
     memset(checksum, 0, sizeof(checksum));
     memset(state, 0, sizeof(state));
+    memset(filesize, 0, sizeof(filesize));
+    memset(lastupdate, 0, sizeof(lastupdate));
 
-    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    if (check_freshness)
+    {
+        aggregate_member_t member;
+
+        retval = Hpss_Stat(Pathname, &hpss_stat_buf);
+        if (retval)
+            return hpss_error_to_globus_result(retval);
+
+        /* The size was recorded from stat_object(), ie. the member's. */
+        globus_result_t result =
+            aggregate_lookup(Pathname, &hpss_stat_buf, &member);
+        if (result)
+            return result;
+        if (member.Container)
+            hpss_stat_buf.st_size = member.Length;
+        aggregate_member_destroy(&member);
+    }
+
+    /* The size and time are only fetched when they will be checked. */
+    attr_list.len  = check_freshness ? 5 : 3;
     attr_list.Pair = user_attrs;
 
     attr_list.Pair[0].Key   = "/hpss/user/cksum/algorithm";
@@ -408,7 +1076,10 @@ cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString)
     attr_list.Pair[1].Value = checksum;
     attr_list.Pair[2].Key   = "/hpss/user/cksum/state";
     attr_list.Pair[2].Value = state;
-
+    attr_list.Pair[3].Key   = "/hpss/user/cksum/filesize";
+    attr_list.Pair[3].Value = filesize;
+    attr_list.Pair[4].Key   = "/hpss/user/cksum/lastupdate";
+    attr_list.Pair[4].Value = lastupdate;
 
 #if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4)
     retval = Hpss_UserAttrGetAttrs(Pathname, &attr_list, UDA_API_VALUE);
@@ -433,7 +1104,7 @@ cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString)
     strcpy(value, tmp);
     free(tmp);
 
-    if (strcmp(value, "md5") != 0)
+    if (strcasecmp(value, Algorithm) != 0)
         return GLOBUS_SUCCESS;
 
     tmp = Hpss_ChompXMLHeader(state, NULL);
@@ -446,6 +1117,10 @@ cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString)
     if (strcmp(value, "Valid") != 0)
         return GLOBUS_SUCCESS;
 
+    if (check_freshness &&
+        !cksm_uda_is_fresh(Pathname, &hpss_stat_buf, filesize, lastupdate))
+        return GLOBUS_SUCCESS;
+
     *ChecksumString = Hpss_ChompXMLHeader(checksum, NULL);
     return GLOBUS_SUCCESS;
 }
@@ -454,7 +1129,7 @@ globus_result_t
 cksm_clear_uda_checksum(char *Pathname)
 {
     int                  retval = 0;
-    hpss_userattr_t      user_attrs[1];
+    hpss_userattr_t      user_attrs[3];
     hpss_userattr_list_t attr_list;
 
     attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
@@ -462,6 +1137,10 @@ cksm_clear_uda_checksum(char *Pathname)
 
     attr_list.Pair[0].Key   = "/hpss/user/cksum/state";
     attr_list.Pair[0].Value = "Invalid";
+    attr_list.Pair[1].Key   = "/hpss/user/cksum/prefix/offset";
+    attr_list.Pair[1].Value = "-1";
+    attr_list.Pair[2].Key   = "/hpss/user/cksum/blocks/filesize";
+    attr_list.Pair[2].Value = "-1";
 
     retval = Hpss_UserAttrSetAttrs(Pathname, &attr_list, NULL);
     if (retval != HPSS_E_NOERROR && hpss_error_status(retval) != -ENOENT)
@@ -469,3 +1148,154 @@ cksm_clear_uda_checksum(char *Pathname)
 
     return GLOBUS_SUCCESS;
 }
+
+/*
+ * The digest of the first Offset bytes of a file left behind by a failed
+ * STOR, so that a client can verify what it has already sent before it
+ * restarts. It is invalidated by cksm_clear_uda_checksum().
+ *
+ * /hpss/user/cksum/prefix/offset                        1073741824
+ * /hpss/user/cksum/prefix/md5         4e2b8e4ce5a12c1a9c0a1e8b7f3c11d2
+ * /hpss/user/cksum/prefix/filesize                      1073741824
+ */
+globus_result_t
+cksm_set_uda_prefix(char *Pathname, globus_off_t Offset, char *Checksum)
+{
+    int                  retval = 0;
+    char                 offset_buf[32];
+    char                 filesize_buf[32];
+    globus_result_t      result = GLOBUS_SUCCESS;
+    hpss_userattr_t      user_attrs[3];
+    hpss_userattr_list_t attr_list;
+    globus_gfs_stat_t    gfs_stat;
+
+    result = stat_object(Pathname, &gfs_stat);
+    if (result != GLOBUS_SUCCESS)
+        return result;
+
+    snprintf(offset_buf, sizeof(offset_buf), "%" GLOBUS_OFF_T_FORMAT, Offset);
+    snprintf(filesize_buf, sizeof(filesize_buf), "%lu", gfs_stat.size);
+    stat_destroy(&gfs_stat);
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/cksum/prefix/md5";
+    attr_list.Pair[0].Value = Checksum;
+    attr_list.Pair[1].Key   = "/hpss/user/cksum/prefix/filesize";
+    attr_list.Pair[1].Value = filesize_buf;
+    attr_list.Pair[2].Key   = "/hpss/user/cksum/prefix/offset";
+    attr_list.Pair[2].Value = offset_buf;
+
+    retval = Hpss_UserAttrSetAttrs(Pathname, &attr_list, NULL);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    return GLOBUS_SUCCESS;
+}
+
+static globus_off_t
+cksm_uda_to_offset(char *XML)
+{
+    char *       tmp    = NULL;
+    char *       end    = NULL;
+    globus_off_t offset = -1;
+
+    tmp = Hpss_ChompXMLHeader(XML, NULL);
+    if (!tmp)
+        return -1;
+
+    offset = strtoll(tmp, &end, 10);
+    if (end == tmp || *end != '\0')
+        offset = -1;
+    free(tmp);
+    return offset;
+}
+
+/*
+ * The stored checksum describes the file if it was computed over the
+ * current size and no earlier than $HPSS_DSI_UDA_FRESHNESS_SKEW seconds
+ * before the last modification. HpssStat's size must already be the
+ * member's for aggregate members, as that is what was recorded. Only
+ * checked when $HPSS_DSI_UDA_FRESHNESS is set.
+ */
+static bool
+cksm_uda_is_fresh(char *             Pathname,
+                  const hpss_stat_t *HpssStat,
+                  char *             FileSize,
+                  char *             LastUpdate)
+{
+    globus_off_t file_size   = cksm_uda_to_offset(FileSize);
+    globus_off_t last_update = cksm_uda_to_offset(LastUpdate);
+    globus_off_t skew        = config_get_env_int(
+        "HPSS_DSI_UDA_FRESHNESS_SKEW", CKSM_DEFAULT_FRESHNESS_SKEW);
+
+    if (file_size != HpssStat->st_size || last_update < 0 ||
+        last_update + skew < (globus_off_t)HpssStat->hpss_st_mtime)
+    {
+        DEBUG("Ignoring stale UDA checksum of %s: stored size %lld at %lld, "
+              "file size %lld modified at %lld",
+              Pathname,
+              (long long)file_size,
+              (long long)last_update,
+              (long long)HpssStat->st_size,
+              (long long)HpssStat->hpss_st_mtime);
+        return false;
+    }
+    return true;
+}
+
+/* *Checksum is NULL if there is no valid prefix digest. */
+globus_result_t
+cksm_get_uda_prefix(char *        Pathname,
+                    globus_off_t *Offset,
+                    globus_off_t *FileSize,
+                    char **       Checksum)
+{
+    int                  retval = 0;
+    char                 offset[HPSS_XML_SIZE];
+    char                 filesize[HPSS_XML_SIZE];
+    char                 checksum[HPSS_XML_SIZE];
+    hpss_userattr_t      user_attrs[3];
+    hpss_userattr_list_t attr_list;
+
+    *Checksum = NULL;
+
+    memset(offset, 0, sizeof(offset));
+    memset(filesize, 0, sizeof(filesize));
+    memset(checksum, 0, sizeof(checksum));
+
+    attr_list.len  = sizeof(user_attrs) / sizeof(*user_attrs);
+    attr_list.Pair = user_attrs;
+
+    attr_list.Pair[0].Key   = "/hpss/user/cksum/prefix/offset";
+    attr_list.Pair[0].Value = offset;
+    attr_list.Pair[1].Key   = "/hpss/user/cksum/prefix/filesize";
+    attr_list.Pair[1].Value = filesize;
+    attr_list.Pair[2].Key   = "/hpss/user/cksum/prefix/md5";
+    attr_list.Pair[2].Value = checksum;
+
+#if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4)
+    retval = Hpss_UserAttrGetAttrs(Pathname, &attr_list, UDA_API_VALUE);
+#else
+    retval = Hpss_UserAttrGetAttrs(Pathname,
+                                   &attr_list,
+                                   UDA_API_VALUE,
+                                   HPSS_XML_SIZE - 1);
+#endif
+
+    if (retval != HPSS_E_NOERROR)
+    {
+        if (hpss_error_status(retval) == -ENOENT)
+            return GLOBUS_SUCCESS;
+        return hpss_error_to_globus_result(retval);
+    }
+
+    *Offset   = cksm_uda_to_offset(offset);
+    *FileSize = cksm_uda_to_offset(filesize);
+    if (*Offset < 0 || *FileSize < 0)
+        return GLOBUS_SUCCESS;
+
+    *Checksum = Hpss_ChompXMLHeader(checksum, NULL);
+    return GLOBUS_SUCCESS;
+}
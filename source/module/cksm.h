@@ -5,6 +5,7 @@
  * System includes
  */
 #include <openssl/md5.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 /*
@@ -21,6 +22,7 @@
  * Local includes
  */
 #include "commands.h"
+#include "digest.h"
 
 typedef struct
 {
@@ -30,21 +32,77 @@ typedef struct
     globus_callback_handle_t CallbackHandle;
 } cksm_marker_t;
 
+/* Checksum is NULL when Result is set. */
+typedef void (*cksm_done_callback)(globus_result_t Result,
+                                   char *          Checksum,
+                                   void *          UserArg);
+
+/*
+ * Blocks are copied out of the PIO callout into a ring of buffers and hashed
+ * on a separate thread so that the mover does not wait on the hash unless
+ * every buffer is full. MoverWaitMS is how long PIO waited for a free
+ * buffer, HashWaitMS how long hashing waited for data.
+ */
+typedef struct
+{
+    char *   Buffer;
+    uint32_t Length;
+} cksm_block_t;
+
 typedef struct
 {
-    globus_gfs_operation_t     Operation;
-    globus_gfs_command_info_t *CommandInfo;
-    bool                       UseUDAChecksums;
-    char *                     Pathname;
-    commands_callback          Callback;
-    MD5_CTX                    MD5Context;
-    globus_result_t            Result;
-    int                        FileFD;
-    globus_size_t              BlockSize;
-    globus_off_t               RangeLength;
-    cksm_marker_t *            Marker;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Cond;
+    cksm_block_t *  Blocks;
+    int             BlockCount;
+    int             Head;   // Next block to hash
+    int             Filled; // Blocks waiting to be hashed
+    bool            Finished;
+    bool            Started;
+    pthread_t       Thread;
+    double          MoverWaitMS;
+    double          HashWaitMS;
+} cksm_pipeline_t;
+
+typedef struct cksm_blocks cksm_blocks_t;
+
+typedef struct
+{
+    globus_gfs_operation_t Operation;
+    cksm_done_callback     Done;
+    void *                 DoneArg;
+    digest_t               Digest;
+    globus_result_t        Result;
+    int                    FileFD;
+    globus_size_t          BlockSize;
+    globus_off_t           RangeLength;
+    cksm_marker_t *        Marker;
+    cksm_pipeline_t        Pipeline; // Unused if BlockCount is 0
+    cksm_blocks_t *        Blocks;   // Block digest cache, may be NULL
 } cksm_info_t;
 
+/* Finalizes Context and converts the digest to a hex string. */
+globus_result_t
+cksm_md5_final(MD5_CTX *Context, char ChecksumString[2 * MD5_DIGEST_LENGTH + 1]);
+
+/*
+ * Computes the Engine checksum of Length bytes of Pathname starting at Offset (-1 for
+ * the rest of the file) and passes it to Done. Done is not called if an
+ * error is returned.
+ */
+#define CKSM_FLAG_CACHE_BLOCKS 0x1 // Save block checksums of whole files
+#define CKSM_FLAG_NO_MARKERS   0x2 // No intermediate progress replies
+
+globus_result_t
+cksm_compute(globus_gfs_operation_t Operation,
+             char *                 Pathname,
+             globus_off_t           Offset,
+             globus_off_t           Length,
+             const digest_engine_t *Engine,
+             int                    Flags,
+             cksm_done_callback     Done,
+             void *                 DoneArg);
+
 void
 cksm(globus_gfs_operation_t     Operation,
      globus_gfs_command_info_t *CommandInfo,
@@ -52,12 +110,25 @@ cksm(globus_gfs_operation_t     Operation,
      commands_callback          Callback);
 
 globus_result_t
-cksm_set_uda_checksum(char *Pathname, char *Checksum);
+cksm_set_uda_checksum(char *Pathname, const char *Algorithm, char *Checksum);
 
+/* *ChecksumString is NULL unless a valid Algorithm checksum is stored. */
 globus_result_t
-cksm_get_uda_checksum(char *  Pathname, char ** ChecksumString);
+cksm_get_uda_checksum(char *       Pathname,
+                      const char * Algorithm,
+                      char **      ChecksumString);
 
+/* Also invalidates the prefix digest and the block checksums. */
 globus_result_t
 cksm_clear_uda_checksum(char *Pathname);
 
+globus_result_t
+cksm_set_uda_prefix(char *Pathname, globus_off_t Offset, char *Checksum);
+
+globus_result_t
+cksm_get_uda_prefix(char *        Pathname,
+                    globus_off_t *Offset,
+                    globus_off_t *FileSize,
+                    char **       Checksum);
+
 #endif /* HPSS_DSI_CKSM_H */
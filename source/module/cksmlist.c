@@ -0,0 +1,309 @@
+/*
+ * System includes
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Local includes
+ */
+#include "cksm.h"
+#include "cksmlist.h"
+#include "config.h"
+#include "digest.h"
+#include "logging.h"
+
+#define CKSMLIST_DEFAULT_CONCURRENCY 4
+
+struct cksmlist;
+
+typedef struct
+{
+    struct cksmlist *List;
+    char *           Name;     // As sent by the client
+    char *           Pathname; // Decoded and joined to the directory
+    bool             Cached;   // Answered from UDA before any reads
+} cksmlist_entry_t;
+
+/*
+ * Only the thread that set Launching starts reads or finishes the list.
+ * Completions that arrive meanwhile set Kick so that it looks again.
+ */
+typedef struct cksmlist
+{
+    globus_gfs_operation_t Operation;
+    commands_callback      Callback;
+    const digest_engine_t *Engine;
+    bool                   UseUDAChecksums;
+
+    cksmlist_entry_t *Entries;
+    int               Count;
+
+    pthread_mutex_t Lock;
+    int             Next; // Next entry to start
+    int             Active;
+    int             MaxActive;
+    int             Finished;
+    int             Errors;
+    bool            Launching;
+    bool            Kick;
+} cksmlist_t;
+
+static void
+cksmlist_destroy(cksmlist_t *List)
+{
+    for (int i = 0; i < List->Count; i++)
+    {
+        free(List->Entries[i].Name);
+        free(List->Entries[i].Pathname);
+    }
+    free(List->Entries);
+    pthread_mutex_destroy(&List->Lock);
+    free(List);
+}
+
+static globus_result_t
+cksmlist_parse(cksmlist_t *List, const char *Names, const char *Directory)
+{
+    const char *name = Names;
+
+    List->Count = 1;
+    for (const char *c = Names; *c; c++)
+    {
+        if (*c == ',')
+            List->Count++;
+    }
+
+    List->Entries = calloc(List->Count, sizeof(cksmlist_entry_t));
+    if (!List->Entries)
+        return GlobusGFSErrorMemory("cksmlist_entry_t");
+
+    for (int i = 0; i < List->Count; i++)
+    {
+        cksmlist_entry_t *entry  = &List->Entries[i];
+        size_t            length = strcspn(name, ",");
+        globus_result_t   result = GLOBUS_SUCCESS;
+
+        entry->List = List;
+        entry->Name = strndup(name, length);
+        if (!entry->Name)
+            return GlobusGFSErrorMemory("name");
+
+        result = commands_list_pathname(
+            Directory, name, length, &entry->Pathname);
+        if (result)
+            return result;
+
+        name += length + 1;
+    }
+
+    return GLOBUS_SUCCESS;
+}
+
+static void
+cksmlist_report(cksmlist_entry_t *Entry, globus_result_t Result, char *Checksum)
+{
+    char *reply = NULL;
+
+    if (Result)
+        reply = globus_common_create_string("ERROR %s", Entry->Name);
+    else
+        reply = globus_common_create_string("%s %s", Checksum, Entry->Name);
+
+    if (reply)
+    {
+        globus_gridftp_server_intermediate_command(
+            Entry->List->Operation, GLOBUS_SUCCESS, reply);
+        globus_free(reply);
+    }
+}
+
+static void
+cksmlist_finish(cksmlist_t *List)
+{
+    char *output = globus_common_create_string("250 %d checksums, %d failed.\r\n",
+                                               List->Count - List->Errors,
+                                               List->Errors);
+
+    List->Callback(List->Operation, GLOBUS_SUCCESS, output);
+    if (output)
+        globus_free(output);
+    cksmlist_destroy(List);
+}
+
+static void
+cksmlist_run_locked(cksmlist_t *List);
+
+static void
+cksmlist_done(globus_result_t Result, char *Checksum, void *UserArg)
+{
+    cksmlist_entry_t *entry = UserArg;
+    cksmlist_t *      list  = entry->List;
+
+    cksmlist_report(entry, Result, Checksum);
+
+    if (!Result && list->UseUDAChecksums)
+        cksm_set_uda_checksum(
+            entry->Pathname, digest_name(list->Engine), Checksum);
+
+    /* The list may be finished as soon as the lock is dropped. */
+    pthread_mutex_lock(&list->Lock);
+    list->Active--;
+    list->Finished++;
+    if (Result)
+        list->Errors++;
+    cksmlist_run_locked(list);
+}
+
+/* Returns true if the UDA checksum answered it. */
+static bool
+cksmlist_from_uda(cksmlist_entry_t *Entry)
+{
+    char *checksum = NULL;
+
+    if (!Entry->List->UseUDAChecksums)
+        return false;
+
+    cksm_get_uda_checksum(
+        Entry->Pathname, digest_name(Entry->List->Engine), &checksum);
+    if (!checksum)
+        return false;
+
+    cksmlist_report(Entry, GLOBUS_SUCCESS, checksum);
+    free(checksum);
+    return true;
+}
+
+/* Called locked, returns unlocked. */
+static void
+cksmlist_run_locked(cksmlist_t *List)
+{
+    bool finished = false;
+    int  flags    = CKSM_FLAG_NO_MARKERS;
+
+    if (List->UseUDAChecksums)
+        flags |= CKSM_FLAG_CACHE_BLOCKS;
+
+    List->Kick = true;
+    if (List->Launching)
+    {
+        pthread_mutex_unlock(&List->Lock);
+        return;
+    }
+    List->Launching = true;
+
+    while (List->Kick)
+    {
+        List->Kick = false;
+
+        while (List->Next < List->Count && List->Active < List->MaxActive)
+        {
+            cksmlist_entry_t *entry = &List->Entries[List->Next++];
+            if (entry->Cached)
+                continue;
+            List->Active++;
+
+            pthread_mutex_unlock(&List->Lock);
+            globus_result_t result = cksm_compute(List->Operation,
+                                                  entry->Pathname,
+                                                  0,
+                                                  -1,
+                                                  List->Engine,
+                                                  flags,
+                                                  cksmlist_done,
+                                                  entry);
+            if (result)
+                cksmlist_report(entry, result, NULL);
+            pthread_mutex_lock(&List->Lock);
+
+            if (result)
+            {
+                List->Active--;
+                List->Finished++;
+                List->Errors++;
+            }
+        }
+    }
+
+    List->Launching = false;
+    finished        = (List->Finished == List->Count);
+    pthread_mutex_unlock(&List->Lock);
+
+    if (finished)
+        cksmlist_finish(List);
+}
+
+static void
+cksmlist_run(cksmlist_t *List)
+{
+    pthread_mutex_lock(&List->Lock);
+    cksmlist_run_locked(List);
+}
+
+void
+cksmlist(globus_gfs_operation_t      Operation,
+         globus_gfs_command_info_t * CommandInfo,
+         bool                        UseUDAChecksums,
+         commands_callback           Callback)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    cksmlist_t *    list   = NULL;
+    char **         argv   = NULL;
+    int             argc   = 0;
+
+    result = globus_gridftp_server_query_op_info(Operation,
+                                                 CommandInfo->op_info,
+                                                 GLOBUS_GFS_OP_INFO_CMD_ARGS,
+                                                 &argv,
+                                                 &argc);
+    if (result)
+    {
+        result = GlobusGFSErrorWrapFailed("Unable to get command args", result);
+        goto cleanup;
+    }
+
+    list = calloc(1, sizeof(cksmlist_t));
+    if (!list)
+    {
+        result = GlobusGFSErrorMemory("cksmlist_t");
+        goto cleanup;
+    }
+    pthread_mutex_init(&list->Lock, NULL);
+    list->Operation       = Operation;
+    list->Callback        = Callback;
+    list->UseUDAChecksums = UseUDAChecksums;
+    list->MaxActive       = config_get_env_int("HPSS_DSI_CKSMLIST_CONCURRENCY",
+                                         CKSMLIST_DEFAULT_CONCURRENCY);
+    if (list->MaxActive <= 0)
+        list->MaxActive = 1;
+
+    list->Engine = digest_lookup(argv[2]);
+    if (!list->Engine)
+    {
+        result = GlobusGFSErrorGeneric("Unsupported checksum algorithm");
+        goto cleanup;
+    }
+
+    result = cksmlist_parse(list, argv[3], CommandInfo->pathname);
+    if (result)
+        goto cleanup;
+
+    DEBUG("Checksumming %d files in %s", list->Count, CommandInfo->pathname);
+
+    /* Nothing is read yet, so cached checksums go out before any are computed. */
+    for (int i = 0; i < list->Count; i++)
+    {
+        list->Entries[i].Cached = cksmlist_from_uda(&list->Entries[i]);
+        if (list->Entries[i].Cached)
+            list->Finished++;
+    }
+
+    cksmlist_run(list);
+    return;
+
+cleanup:
+    if (list)
+        cksmlist_destroy(list);
+    Callback(Operation, result, NULL);
+}
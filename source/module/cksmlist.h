@@ -0,0 +1,36 @@
+#ifndef HPSS_DSI_CKSMLIST_H
+#define HPSS_DSI_CKSMLIST_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * Local includes
+ */
+#include "commands.h"
+
+/*
+ * SITE CKSMLIST <sp> algorithm <sp> name[,name...] <sp> directory
+ *
+ * Checksums several files in 'directory' with one command. Names are
+ * percent encoded (at least '%', ',' and ' ') and may not contain '/'.
+ * Each result is sent as an intermediate reply of the form
+ * '<checksum> <name>', or 'ERROR <name>', in completion order. Every
+ * file's UDA is checked first and the checksums cached there are answered
+ * before any file is read; the rest are then computed in list order with
+ * at most $HPSS_DSI_CKSMLIST_CONCURRENCY files read at once.
+ */
+void
+cksmlist(globus_gfs_operation_t      Operation,
+         globus_gfs_command_info_t * CommandInfo,
+         bool                        UseUDAChecksums,
+         commands_callback           Callback);
+
+#endif /* HPSS_DSI_CKSMLIST_H */
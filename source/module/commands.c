@@ -3,6 +3,7 @@
  */
 #include <grp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 
@@ -38,6 +39,62 @@ commands_init(globus_gfs_operation_t Operation)
         return GlobusGFSErrorWrapFailed(
             "Failed to add custom 'SITE STAGE' command", result);
 
+    result = globus_gridftp_server_add_command(
+        Operation,
+        "SITE STAGERANGE",
+        GLOBUS_GFS_HPSS_CMD_SITE_STAGERANGE,
+        6,
+        6,
+        "SITE STAGERANGE <sp> timeout <sp> offset <sp> length <sp> path",
+        GLOBUS_TRUE,
+        GFS_ACL_ACTION_READ);
+
+    if (result != GLOBUS_SUCCESS)
+        return GlobusGFSErrorWrapFailed(
+            "Failed to add custom 'SITE STAGERANGE' command", result);
+
+    result = globus_gridftp_server_add_command(
+        Operation,
+        "SITE VERIFYPREFIX",
+        GLOBUS_GFS_HPSS_CMD_SITE_VERIFYPREFIX,
+        5,
+        5,
+        "SITE VERIFYPREFIX <sp> offset <sp> md5 <sp> path",
+        GLOBUS_TRUE,
+        GFS_ACL_ACTION_READ);
+
+    if (result != GLOBUS_SUCCESS)
+        return GlobusGFSErrorWrapFailed(
+            "Failed to add custom 'SITE VERIFYPREFIX' command", result);
+
+    result = globus_gridftp_server_add_command(
+        Operation,
+        "SITE CKSMLIST",
+        GLOBUS_GFS_HPSS_CMD_SITE_CKSMLIST,
+        5,
+        5,
+        "SITE CKSMLIST <sp> algorithm <sp> name[,name...] <sp> directory",
+        GLOBUS_TRUE,
+        GFS_ACL_ACTION_READ);
+
+    if (result != GLOBUS_SUCCESS)
+        return GlobusGFSErrorWrapFailed(
+            "Failed to add custom 'SITE CKSMLIST' command", result);
+
+    result = globus_gridftp_server_add_command(
+        Operation,
+        "SITE BULKSTAGE",
+        GLOBUS_GFS_HPSS_CMD_SITE_BULKSTAGE,
+        5,
+        5,
+        "SITE BULKSTAGE <sp> timeout <sp> name[,name...] <sp> directory",
+        GLOBUS_TRUE,
+        GFS_ACL_ACTION_READ);
+
+    if (result != GLOBUS_SUCCESS)
+        return GlobusGFSErrorWrapFailed(
+            "Failed to add custom 'SITE BULKSTAGE' command", result);
+
     return GLOBUS_SUCCESS;
 }
 
@@ -119,3 +176,65 @@ commands_unlink(globus_gfs_command_info_t *CommandInfo)
         return hpss_error_to_globus_result(retval);
     return GLOBUS_SUCCESS;
 }
+
+static int
+commands_hex(char C)
+{
+    if (C >= '0' && C <= '9')
+        return C - '0';
+    if (C >= 'a' && C <= 'f')
+        return C - 'a' + 10;
+    if (C >= 'A' && C <= 'F')
+        return C - 'A' + 10;
+    return -1;
+}
+
+globus_result_t
+commands_list_pathname(const char *Directory,
+                       const char *Name,
+                       size_t      Length,
+                       char **     Pathname)
+{
+    size_t dir_length = strlen(Directory);
+    size_t used       = 0;
+    char * name       = NULL;
+
+    *Pathname = NULL;
+
+    if (dir_length > 0 && Directory[dir_length - 1] == '/')
+        dir_length--;
+
+    *Pathname = malloc(dir_length + Length + 2);
+    if (!*Pathname)
+        return GlobusGFSErrorMemory("pathname");
+
+    memcpy(*Pathname, Directory, dir_length);
+    (*Pathname)[dir_length] = '/';
+    name                    = *Pathname + dir_length + 1;
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        if (Name[i] == '%')
+        {
+            int hi = i + 2 < Length ? commands_hex(Name[i + 1]) : -1;
+            int lo = i + 2 < Length ? commands_hex(Name[i + 2]) : -1;
+            if (hi < 0 || lo < 0)
+                goto illegal;
+            name[used++] = (char)(hi << 4 | lo);
+            i += 2;
+        } else
+            name[used++] = Name[i];
+    }
+    name[used] = '\0';
+
+    if (used == 0 || used != strlen(name) || strchr(name, '/') ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        goto illegal;
+
+    return GLOBUS_SUCCESS;
+
+illegal:
+    free(*Pathname);
+    *Pathname = NULL;
+    return GlobusGFSErrorGeneric("Illegal file name in list");
+}
@@ -9,6 +9,10 @@
 enum
 {
     GLOBUS_GFS_HPSS_CMD_SITE_STAGE = GLOBUS_GFS_MIN_CUSTOM_CMD,
+    GLOBUS_GFS_HPSS_CMD_SITE_VERIFYPREFIX,
+    GLOBUS_GFS_HPSS_CMD_SITE_CKSMLIST,
+    GLOBUS_GFS_HPSS_CMD_SITE_BULKSTAGE,
+    GLOBUS_GFS_HPSS_CMD_SITE_STAGERANGE,
 };
 
 globus_result_t
@@ -42,4 +46,16 @@ commands_unlink(globus_gfs_command_info_t *CommandInfo);
 globus_result_t
 commands_utime(globus_gfs_command_info_t *CommandInfo);
 
+/*
+ * Commands that act on several files take a comma separated list of
+ * percent encoded names relative to the directory that is their last (and
+ * ACL checked) argument. Decodes the Length bytes at Name and joins them to
+ * Directory. Names containing '/', '.' and '..' are illegal.
+ */
+globus_result_t
+commands_list_pathname(const char *Directory,
+                       const char *Name,
+                       size_t      Length,
+                       char **     Pathname);
+
 #endif /* HPSS_DSI_COMMANDS_H */
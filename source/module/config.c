@@ -189,6 +189,26 @@ cleanup:
     return result;
 }
 
+long long
+config_get_env_int(const char *Name, long long Default)
+{
+    char *    end   = NULL;
+    long long value = 0;
+
+    const char * env_value = getenv(Name);
+    if (!env_value || *env_value == '\0')
+        return Default;
+
+    value = strtoll(env_value, &end, 0);
+    if (*end != '\0')
+    {
+        WARN("Ignoring illegal value for %s: %s", Name, env_value);
+        return Default;
+    }
+
+    return value;
+}
+
 void
 config_destroy(config_t *Config)
 {
@@ -20,4 +20,11 @@ config_init(globus_gfs_operation_t Operation, config_t **Config);
 void
 config_destroy(config_t *Config);
 
+/*
+ * Tuning options are passed in through the environment, usually set in
+ * /etc/gridftp.d/hpss. Returns Default if Name is not set or is not a number.
+ */
+long long
+config_get_env_int(const char *Name, long long Default);
+
 #endif /* HPSS_DSI_CONFIG_H */
@@ -0,0 +1,573 @@
+/*
+ * System includes
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Local includes
+ */
+#include "logging.h"
+#include "config.h"
+#include "hpss.h"
+#include "cos.h"
+
+/*
+ * Answering 'can we change the COS of this file' takes an
+ * Hpss_FileGetAttributes() to find the fileset and an
+ * Hpss_FilesetGetAttributes() to find out if the fileset has a COS. Tasks
+ * tend to write many files into the same few directories so we keep two small
+ * caches:
+ *
+ *  - directory -> fileset ID. A file always belongs to the fileset of its
+ *    parent directory; junctions are directories.
+ *  - fileset ID -> whether the fileset pins a COS.
+ *
+ * Both are shared by all threads in the process and expire after
+ * $HPSS_DSI_COS_CACHE_TTL seconds. A TTL of 0 disables caching.
+ */
+#define COS_CACHE_DEFAULT_TTL 300
+#define COS_CACHE_SIZE        64
+
+struct dir_entry
+{
+    char *   Directory;
+    uint64_t FilesetId;
+    time_t   Expires;
+};
+
+struct fileset_entry
+{
+    bool     Valid;
+    uint64_t FilesetId;
+    bool     CanChangeCOS;
+    time_t   Expires;
+};
+
+static struct
+{
+    pthread_mutex_t      Lock;
+    int                  TTL;
+    struct dir_entry     Directories[COS_CACHE_SIZE];
+    struct fileset_entry Filesets[COS_CACHE_SIZE];
+    cos_cache_stats_t    Stats;
+} CosCache = {.Lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Size prediction for uploads without ALLO. $HPSS_DSI_COS_SIZE_MAP is a comma
+ * separated list of <min size>:<cos id> pairs, ie. '0:1,1G:2,100G:3'. Sizes
+ * accept K, M, G and T suffixes (powers of 1024). The entry with the largest
+ * min size not greater than the predicted size wins.
+ */
+#define COS_SIZE_MAP_MAX 16
+
+struct dir_size_entry
+{
+    char *   Directory;
+    uint64_t Count;
+    uint64_t TotalBytes;
+    uint64_t MaxBytes;
+    time_t   LastUsed;
+};
+
+static struct
+{
+    pthread_mutex_t       Lock;
+    bool                  Enabled;
+    int                   MapCount;
+    struct
+    {
+        uint64_t MinSize;
+        uint32_t COSId;
+    } Map[COS_SIZE_MAP_MAX];
+    struct dir_size_entry Directories[COS_CACHE_SIZE];
+} CosPredict = {.Lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t CosInitialized = PTHREAD_ONCE_INIT;
+
+static bool
+cos_parse_size(const char *String, char **End, uint64_t *Size)
+{
+    *Size = strtoull(String, End, 10);
+    if (*End == String)
+        return false;
+
+    switch (toupper(**End))
+    {
+    case 'T':
+        *Size <<= 10;
+        /* Fall through */
+    case 'G':
+        *Size <<= 10;
+        /* Fall through */
+    case 'M':
+        *Size <<= 10;
+        /* Fall through */
+    case 'K':
+        *Size <<= 10;
+        (*End)++;
+    }
+    return true;
+}
+
+static void
+cos_parse_size_map(const char *SizeMap)
+{
+    char *   end = NULL;
+    uint64_t size;
+    unsigned long cos_id;
+
+    while (*SizeMap && CosPredict.MapCount < COS_SIZE_MAP_MAX)
+    {
+        if (!cos_parse_size(SizeMap, &end, &size) || *end != ':')
+            goto error;
+
+        SizeMap = end + 1;
+        cos_id  = strtoul(SizeMap, &end, 10);
+        if (end == SizeMap || (*end != ',' && *end != '\0'))
+            goto error;
+
+        CosPredict.Map[CosPredict.MapCount].MinSize = size;
+        CosPredict.Map[CosPredict.MapCount].COSId   = cos_id;
+        CosPredict.MapCount++;
+
+        SizeMap = (*end == ',') ? end + 1 : end;
+    }
+
+    if (*SizeMap)
+        WARN("HPSS_DSI_COS_SIZE_MAP has more than %d entries, ignoring '%s'",
+             COS_SIZE_MAP_MAX,
+             SizeMap);
+    return;
+
+error:
+    WARN("Ignoring illegal value for HPSS_DSI_COS_SIZE_MAP near '%s'", SizeMap);
+    CosPredict.MapCount = 0;
+}
+
+static void
+cos_init()
+{
+    CosCache.TTL = config_get_env_int("HPSS_DSI_COS_CACHE_TTL",
+                                      COS_CACHE_DEFAULT_TTL);
+    if (CosCache.TTL < 0)
+        CosCache.TTL = 0;
+
+    CosPredict.Enabled =
+        config_get_env_int("HPSS_DSI_COS_SIZE_PREDICTION", 0) != 0;
+
+    const char *size_map = getenv("HPSS_DSI_COS_SIZE_MAP");
+    if (CosPredict.Enabled && size_map)
+        cos_parse_size_map(size_map);
+}
+
+/* Copies the parent directory of Pathname into Directory. */
+static globus_result_t
+cos_parent_directory(const char *Pathname, char *Directory, size_t Length)
+{
+    /* The parent of '/x' is '/'. */
+    const char *slash = strrchr(Pathname, '/');
+    if (!slash)
+        return GlobusGFSErrorGeneric("Expected an absolute path");
+
+    size_t dir_len = (slash == Pathname) ? 1 : slash - Pathname;
+    if (dir_len >= Length)
+        return GlobusGFSErrorGeneric("Path is too long");
+
+    memcpy(Directory, Pathname, dir_len);
+    Directory[dir_len] = '\0';
+    return GLOBUS_SUCCESS;
+}
+
+/* Returns the slot to use for a new entry: first empty, else oldest. */
+static int
+cos_cache_victim(time_t *Expires, bool *InUse)
+{
+    int victim = 0;
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        if (!InUse[i])
+            return i;
+        if (Expires[i] < Expires[victim])
+            victim = i;
+    }
+    return victim;
+}
+
+/* Called locked. */
+static bool
+cos_cache_lookup_dir(const char *Directory, uint64_t *FilesetId)
+{
+    time_t now = time(NULL);
+
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        struct dir_entry *entry = &CosCache.Directories[i];
+        if (entry->Directory && entry->Expires > now &&
+            strcmp(entry->Directory, Directory) == 0)
+        {
+            *FilesetId = entry->FilesetId;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called locked. */
+static void
+cos_cache_insert_dir(const char *Directory, uint64_t FilesetId)
+{
+    time_t expires[COS_CACHE_SIZE];
+    bool   in_use[COS_CACHE_SIZE];
+
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        expires[i] = CosCache.Directories[i].Expires;
+        in_use[i]  = CosCache.Directories[i].Directory != NULL;
+    }
+
+    struct dir_entry *entry =
+        &CosCache.Directories[cos_cache_victim(expires, in_use)];
+
+    char *directory = strdup(Directory);
+    if (!directory)
+        return;
+
+    free(entry->Directory);
+    entry->Directory = directory;
+    entry->FilesetId = FilesetId;
+    entry->Expires   = time(NULL) + CosCache.TTL;
+}
+
+/* Called locked. */
+static bool
+cos_cache_lookup_fileset(uint64_t FilesetId, bool *CanChangeCOS)
+{
+    time_t now = time(NULL);
+
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        struct fileset_entry *entry = &CosCache.Filesets[i];
+        if (entry->Valid && entry->Expires > now &&
+            entry->FilesetId == FilesetId)
+        {
+            *CanChangeCOS = entry->CanChangeCOS;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called locked. */
+static void
+cos_cache_insert_fileset(uint64_t FilesetId, bool CanChangeCOS)
+{
+    time_t expires[COS_CACHE_SIZE];
+    bool   in_use[COS_CACHE_SIZE];
+
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        expires[i] = CosCache.Filesets[i].Expires;
+        in_use[i]  = CosCache.Filesets[i].Valid;
+    }
+
+    struct fileset_entry *entry =
+        &CosCache.Filesets[cos_cache_victim(expires, in_use)];
+
+    entry->Valid        = true;
+    entry->FilesetId    = FilesetId;
+    entry->CanChangeCOS = CanChangeCOS;
+    entry->Expires      = time(NULL) + CosCache.TTL;
+}
+
+static globus_result_t
+cos_get_fileset_id(const char *Directory, uint64_t *FilesetId)
+{
+    hpss_fileattr_t fileattr;
+
+    int retval = Hpss_FileGetAttributes(Directory, &fileattr);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    *FilesetId = fileattr.Attrs.FilesetId;
+    return GLOBUS_SUCCESS;
+}
+
+static globus_result_t
+cos_get_fileset_can_change(uint64_t FilesetId, bool *CanChangeCOS)
+{
+    ns_FilesetAttrBits_t fileset_attr_bits;
+    ns_FilesetAttrs_t    fileset_attr;
+
+    fileset_attr_bits = orbit64m(0, NS_FS_ATTRINDEX_COS);
+    int retval = Hpss_FilesetGetAttributes(NULL,
+                                           &FilesetId,
+                                           NULL,
+                                           NULL,
+                                           fileset_attr_bits,
+                                           &fileset_attr);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    *CanChangeCOS = !fileset_attr.ClassOfService;
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+cos_can_change(const char *Pathname, bool *CanChangeCOS)
+{
+    bool              found_dir     = false;
+    bool              found_fileset = false;
+    uint64_t          fileset_id    = 0;
+    cos_cache_stats_t stats;
+    globus_result_t   result        = GLOBUS_SUCCESS;
+
+    pthread_once(&CosInitialized, cos_init);
+
+    char directory[strlen(Pathname) + 2];
+    result = cos_parent_directory(Pathname, directory, sizeof(directory));
+    if (result)
+        return result;
+
+    pthread_mutex_lock(&CosCache.Lock);
+    {
+        if (CosCache.TTL > 0)
+            found_dir = cos_cache_lookup_dir(directory, &fileset_id);
+
+        if (found_dir)
+            CosCache.Stats.DirectoryHits++;
+        else
+            CosCache.Stats.DirectoryMisses++;
+    }
+    pthread_mutex_unlock(&CosCache.Lock);
+
+    if (!found_dir)
+    {
+        result = cos_get_fileset_id(directory, &fileset_id);
+        if (result)
+            return result;
+    }
+
+    pthread_mutex_lock(&CosCache.Lock);
+    {
+        if (CosCache.TTL > 0 && !found_dir)
+            cos_cache_insert_dir(directory, fileset_id);
+        if (CosCache.TTL > 0)
+            found_fileset = cos_cache_lookup_fileset(fileset_id, CanChangeCOS);
+
+        if (found_fileset)
+            CosCache.Stats.FilesetHits++;
+        else
+            CosCache.Stats.FilesetMisses++;
+    }
+    pthread_mutex_unlock(&CosCache.Lock);
+
+    if (!found_fileset)
+    {
+        result = cos_get_fileset_can_change(fileset_id, CanChangeCOS);
+        if (result)
+            return result;
+
+        pthread_mutex_lock(&CosCache.Lock);
+        {
+            if (CosCache.TTL > 0)
+                cos_cache_insert_fileset(fileset_id, *CanChangeCOS);
+        }
+        pthread_mutex_unlock(&CosCache.Lock);
+    }
+
+    cos_get_cache_stats(&stats);
+    DEBUG("Fileset %lu %s change COS (directory cache %s, fileset cache %s). "
+          "Directory hits/misses: %lu/%lu Fileset hits/misses: %lu/%lu",
+          fileset_id,
+          *CanChangeCOS ? "can" : "can not",
+          found_dir ? "hit" : "miss",
+          found_fileset ? "hit" : "miss",
+          stats.DirectoryHits,
+          stats.DirectoryMisses,
+          stats.FilesetHits,
+          stats.FilesetMisses);
+
+    return GLOBUS_SUCCESS;
+}
+
+void
+cos_get_cache_stats(cos_cache_stats_t *Stats)
+{
+    pthread_mutex_lock(&CosCache.Lock);
+    {
+        *Stats = CosCache.Stats;
+    }
+    pthread_mutex_unlock(&CosCache.Lock);
+}
+
+/* Called locked. Returns NULL if Directory has no statistics. */
+static struct dir_size_entry *
+cos_find_dir_sizes(const char *Directory)
+{
+    for (int i = 0; i < COS_CACHE_SIZE; i++)
+    {
+        struct dir_size_entry *entry = &CosPredict.Directories[i];
+        if (entry->Directory && strcmp(entry->Directory, Directory) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static bool
+cos_map_size(uint64_t Size, uint32_t *COSId)
+{
+    bool     found    = false;
+    uint64_t min_size = 0;
+
+    for (int i = 0; i < CosPredict.MapCount; i++)
+    {
+        if (CosPredict.Map[i].MinSize <= Size &&
+            (!found || CosPredict.Map[i].MinSize >= min_size))
+        {
+            found    = true;
+            min_size = CosPredict.Map[i].MinSize;
+            *COSId   = CosPredict.Map[i].COSId;
+        }
+    }
+    return found;
+}
+
+bool
+cos_predict_hints(const char *            Pathname,
+                  hpss_cos_hints_t *      HintsIn,
+                  hpss_cos_priorities_t * Priorities)
+{
+    uint64_t    predicted_size = 0;
+    uint32_t    cos_id         = 0;
+    const char *source         = NULL;
+    hpss_stat_t hpss_stat_buf;
+
+    pthread_once(&CosInitialized, cos_init);
+
+    if (!CosPredict.Enabled)
+        return false;
+
+    /* An overwrite is likely to be about the same size as the original. */
+    int retval = Hpss_Stat(Pathname, &hpss_stat_buf);
+    if (retval == HPSS_E_NOERROR && S_ISREG(hpss_stat_buf.st_mode) &&
+        hpss_stat_buf.st_size > 0)
+    {
+        predicted_size = hpss_stat_buf.st_size;
+        source         = "existing file";
+    }
+
+    char directory[strlen(Pathname) + 2];
+    if (!source &&
+        cos_parent_directory(Pathname, directory, sizeof(directory)) == 0)
+    {
+        pthread_mutex_lock(&CosPredict.Lock);
+        {
+            struct dir_size_entry *entry = cos_find_dir_sizes(directory);
+            if (entry)
+            {
+                predicted_size = entry->MaxBytes;
+                source         = "directory statistics";
+                DEBUG("Directory %s: %lu files, average %lu bytes, "
+                      "largest %lu bytes",
+                      directory,
+                      entry->Count,
+                      entry->TotalBytes / entry->Count,
+                      entry->MaxBytes);
+            }
+        }
+        pthread_mutex_unlock(&CosPredict.Lock);
+    }
+
+    if (!source || predicted_size == 0)
+    {
+        INFO("No size prediction for %s", Pathname);
+        return false;
+    }
+
+    /*
+     * This is only a guess so, unlike ALLO, do not make the size hints
+     * required.
+     */
+    CONVERT_LONGLONG_TO_U64(predicted_size, HintsIn->MinFileSize);
+    CONVERT_LONGLONG_TO_U64(predicted_size, HintsIn->MaxFileSize);
+    Priorities->MinFileSizePriority = HIGHLY_DESIRED_PRIORITY;
+    Priorities->MaxFileSizePriority = HIGHLY_DESIRED_PRIORITY;
+
+    if (cos_map_size(predicted_size, &cos_id))
+    {
+        HintsIn->COSId           = cos_id;
+        Priorities->COSIdPriority = REQUIRED_PRIORITY;
+        INFO("Predicted size of %s is %lu bytes from %s, using COS %u",
+             Pathname,
+             predicted_size,
+             source,
+             cos_id);
+    } else
+    {
+        INFO("Predicted size of %s is %lu bytes from %s",
+             Pathname,
+             predicted_size,
+             source);
+    }
+
+    return true;
+}
+
+void
+cos_record_size(const char *Pathname, uint64_t Size)
+{
+    pthread_once(&CosInitialized, cos_init);
+
+    if (!CosPredict.Enabled)
+        return;
+
+    char directory[strlen(Pathname) + 2];
+    if (cos_parent_directory(Pathname, directory, sizeof(directory)))
+        return;
+
+    pthread_mutex_lock(&CosPredict.Lock);
+    {
+        struct dir_size_entry *entry = cos_find_dir_sizes(directory);
+        if (!entry)
+        {
+            /* Replace the least recently used directory. */
+            entry = &CosPredict.Directories[0];
+            for (int i = 0; i < COS_CACHE_SIZE; i++)
+            {
+                if (!CosPredict.Directories[i].Directory)
+                {
+                    entry = &CosPredict.Directories[i];
+                    break;
+                }
+                if (CosPredict.Directories[i].LastUsed < entry->LastUsed)
+                    entry = &CosPredict.Directories[i];
+            }
+
+            char *copy = strdup(directory);
+            if (copy)
+            {
+                free(entry->Directory);
+                memset(entry, 0, sizeof(*entry));
+                entry->Directory = copy;
+            } else
+            {
+                entry = NULL;
+            }
+        }
+
+        if (entry)
+        {
+            entry->Count++;
+            entry->TotalBytes += Size;
+            if (Size > entry->MaxBytes)
+                entry->MaxBytes = Size;
+            entry->LastUsed = time(NULL);
+        }
+    }
+    pthread_mutex_unlock(&CosPredict.Lock);
+}
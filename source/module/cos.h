@@ -0,0 +1,59 @@
+#ifndef HPSS_DSI_COS_H
+#define HPSS_DSI_COS_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * Local includes
+ */
+#include "hpss.h"
+
+/*
+ * Determines if the class of service of Pathname can be changed, that is,
+ * the fileset containing Pathname does not pin a class of service. Results
+ * are cached for the life of the process for $HPSS_DSI_COS_CACHE_TTL seconds.
+ */
+globus_result_t
+cos_can_change(const char *Pathname, bool *CanChangeCOS);
+
+typedef struct
+{
+    uint64_t DirectoryHits;
+    uint64_t DirectoryMisses;
+    uint64_t FilesetHits;
+    uint64_t FilesetMisses;
+} cos_cache_stats_t;
+
+void
+cos_get_cache_stats(cos_cache_stats_t *Stats);
+
+/*
+ * When $HPSS_DSI_COS_SIZE_PREDICTION is enabled, predicts the size of an
+ * upload that did not send ALLO and fills in HintsIn and Priorities
+ * accordingly. Sources, in order of preference:
+ *
+ *  1) the size of the file being overwritten
+ *  2) the largest file this process has written into the same directory
+ *
+ * If $HPSS_DSI_COS_SIZE_MAP is set, the predicted size also selects the COS.
+ * Every prediction is logged at INFO. Returns true if hints were set.
+ */
+bool
+cos_predict_hints(const char *            Pathname,
+                  hpss_cos_hints_t *      HintsIn,
+                  hpss_cos_priorities_t * Priorities);
+
+/* Records the final size of a completed upload for future predictions. */
+void
+cos_record_size(const char *Pathname, uint64_t Size);
+
+#endif /* HPSS_DSI_COS_H */
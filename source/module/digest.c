@@ -0,0 +1,464 @@
+/*
+ * System includes
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*
+ * Local includes
+ */
+#include "digest.h"
+#include "logging.h"
+#include "treehash.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new  EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+struct digest_engine
+{
+    const char *Name;
+
+    /* EVP algorithms */
+    const EVP_MD *(*EVPType)(void);
+
+    /* 32 bit checksums */
+    uint32_t InitialSum;
+    uint32_t FinalXor;
+    uint32_t (*Update)(uint32_t Sum, const unsigned char *Buffer, size_t Length);
+    uint32_t (*Combine)(uint32_t A, uint32_t B, uint64_t LengthB);
+
+    bool Tree; // sha256tree
+};
+
+/*
+ * Adler-32 (RFC 1950). Sums are reduced once every ADLER_NMAX bytes, the most
+ * that can be added without overflowing 32 bits.
+ */
+#define ADLER_BASE 65521U
+#define ADLER_NMAX 5552
+
+static uint32_t
+digest_adler32_update(uint32_t Sum, const unsigned char *Buffer, size_t Length)
+{
+    uint32_t a = Sum & 0xFFFF;
+    uint32_t b = Sum >> 16;
+
+    while (Length > 0)
+    {
+        size_t n = Length < ADLER_NMAX ? Length : ADLER_NMAX;
+        Length -= n;
+
+        for (; n >= 8; n -= 8, Buffer += 8)
+        {
+            a += Buffer[0]; b += a;
+            a += Buffer[1]; b += a;
+            a += Buffer[2]; b += a;
+            a += Buffer[3]; b += a;
+            a += Buffer[4]; b += a;
+            a += Buffer[5]; b += a;
+            a += Buffer[6]; b += a;
+            a += Buffer[7]; b += a;
+        }
+        for (; n > 0; n--, Buffer++)
+        {
+            a += *Buffer;
+            b += a;
+        }
+
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return (b << 16) | a;
+}
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82F63B78). The software version
+ * uses slicing by 8.
+ */
+#define CRC32C_POLY 0x82F63B78U
+
+static uint32_t        crc32c_table[8][256];
+static pthread_once_t  crc32c_once = PTHREAD_ONCE_INIT;
+static bool            crc32c_have_sse42 = false;
+
+static void
+digest_crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^
+                                 crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+    DEBUG("CRC32C using %s", crc32c_have_sse42 ? "SSE4.2" : "tables");
+}
+
+static uint32_t
+digest_crc32c_sw(uint32_t Crc, const unsigned char *Buffer, size_t Length)
+{
+    for (; Length > 0 && ((uintptr_t)Buffer & 7); Length--, Buffer++)
+        Crc = (Crc >> 8) ^ crc32c_table[0][(Crc ^ *Buffer) & 0xFF];
+
+    for (; Length >= 8; Length -= 8, Buffer += 8)
+    {
+        uint32_t lo = Crc ^ ((uint32_t)Buffer[0] | (uint32_t)Buffer[1] << 8 |
+                             (uint32_t)Buffer[2] << 16 |
+                             (uint32_t)Buffer[3] << 24);
+        uint32_t hi = (uint32_t)Buffer[4] | (uint32_t)Buffer[5] << 8 |
+                      (uint32_t)Buffer[6] << 16 | (uint32_t)Buffer[7] << 24;
+
+        Crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+
+    for (; Length > 0; Length--, Buffer++)
+        Crc = (Crc >> 8) ^ crc32c_table[0][(Crc ^ *Buffer) & 0xFF];
+
+    return Crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+digest_crc32c_sse42(uint32_t Crc, const unsigned char *Buffer, size_t Length)
+{
+    uint64_t crc = Crc;
+
+    for (; Length > 0 && ((uintptr_t)Buffer & 7); Length--, Buffer++)
+        crc = _mm_crc32_u8((uint32_t)crc, *Buffer);
+
+    for (; Length >= 8; Length -= 8, Buffer += 8)
+    {
+        uint64_t word;
+        memcpy(&word, Buffer, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+
+    for (; Length > 0; Length--, Buffer++)
+        crc = _mm_crc32_u8((uint32_t)crc, *Buffer);
+
+    return (uint32_t)crc;
+}
+#endif
+
+static uint32_t
+digest_crc32c_update(uint32_t Crc, const unsigned char *Buffer, size_t Length)
+{
+#if defined(__x86_64__)
+    if (crc32c_have_sse42)
+        return digest_crc32c_sse42(Crc, Buffer, Length);
+#endif
+    return digest_crc32c_sw(Crc, Buffer, Length);
+}
+
+/*
+ * Combining returns the checksum of A followed by B given only their
+ * checksums and the length of B, as in zlib's adler32_combine() and
+ * crc32_combine().
+ */
+static uint32_t
+digest_adler32_combine(uint32_t A, uint32_t B, uint64_t LengthB)
+{
+    uint32_t rem  = LengthB % ADLER_BASE;
+    uint32_t sum1 = A & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % ADLER_BASE);
+
+    sum1 += (B & 0xFFFF) + ADLER_BASE - 1;
+    sum2 += ((A >> 16) & 0xFFFF) + ((B >> 16) & 0xFFFF) + ADLER_BASE - rem;
+    if (sum1 >= ADLER_BASE)
+        sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE)
+        sum1 -= ADLER_BASE;
+    if (sum2 >= (ADLER_BASE << 1))
+        sum2 -= (ADLER_BASE << 1);
+    if (sum2 >= ADLER_BASE)
+        sum2 -= ADLER_BASE;
+    return sum1 | (sum2 << 16);
+}
+
+static uint32_t
+digest_gf2_matrix_times(const uint32_t *Matrix, uint32_t Vector)
+{
+    uint32_t sum = 0;
+    for (; Vector; Vector >>= 1, Matrix++)
+    {
+        if (Vector & 1)
+            sum ^= *Matrix;
+    }
+    return sum;
+}
+
+static void
+digest_gf2_matrix_square(uint32_t *Square, const uint32_t *Matrix)
+{
+    for (int n = 0; n < 32; n++)
+        Square[n] = digest_gf2_matrix_times(Matrix, Matrix[n]);
+}
+
+static uint32_t
+digest_crc32c_combine(uint32_t A, uint32_t B, uint64_t LengthB)
+{
+    uint32_t even[32]; // Operator for an even power of two zero bits
+    uint32_t odd[32];  // Operator for an odd power of two zero bits
+
+    if (LengthB == 0)
+        return A;
+
+    /* Operator for one zero bit. */
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++)
+        odd[n] = 1U << (n - 1);
+
+    digest_gf2_matrix_square(even, odd); // Two zero bits
+    digest_gf2_matrix_square(odd, even); // Four zero bits
+
+    /* Apply LengthB zero bytes to A. */
+    do
+    {
+        digest_gf2_matrix_square(even, odd);
+        if (LengthB & 1)
+            A = digest_gf2_matrix_times(even, A);
+        LengthB >>= 1;
+        if (LengthB == 0)
+            break;
+
+        digest_gf2_matrix_square(odd, even);
+        if (LengthB & 1)
+            A = digest_gf2_matrix_times(odd, A);
+        LengthB >>= 1;
+    } while (LengthB != 0);
+
+    return A ^ B;
+}
+
+static const digest_engine_t digest_engines[] = {
+    {"md5", EVP_md5, 0, 0, NULL, NULL, false},
+    {"sha1", EVP_sha1, 0, 0, NULL, NULL, false},
+    {"sha256", EVP_sha256, 0, 0, NULL, NULL, false},
+    {"adler32", NULL, 1, 0, digest_adler32_update, digest_adler32_combine, false},
+    {"crc32c",
+     NULL,
+     0xFFFFFFFF,
+     0xFFFFFFFF,
+     digest_crc32c_update,
+     digest_crc32c_combine,
+     false},
+    {"sha256tree", NULL, 0, 0, NULL, NULL, true},
+};
+
+/* Compares ignoring case and dashes. */
+static bool
+digest_name_matches(const char *Name, const char *Algorithm)
+{
+    while (*Name || *Algorithm)
+    {
+        if (*Algorithm == '-')
+        {
+            Algorithm++;
+            continue;
+        }
+        if (tolower((unsigned char)*Algorithm) != *Name)
+            return false;
+        Name++;
+        Algorithm++;
+    }
+    return true;
+}
+
+const digest_engine_t *
+digest_lookup(const char *Algorithm)
+{
+    if (!Algorithm)
+        return NULL;
+
+    for (size_t i = 0; i < sizeof(digest_engines) / sizeof(*digest_engines); i++)
+    {
+        if (digest_name_matches(digest_engines[i].Name, Algorithm))
+            return &digest_engines[i];
+    }
+    return NULL;
+}
+
+const char *
+digest_name(const digest_engine_t *Engine)
+{
+    return Engine->Name;
+}
+
+size_t
+digest_string_length(const digest_engine_t *Engine)
+{
+    if (Engine->Tree)
+        return 2 * SHA256_DIGEST_LENGTH;
+    if (!Engine->EVPType)
+        return 8;
+    return 2 * EVP_MD_size(Engine->EVPType());
+}
+
+bool
+digest_is_tree(const digest_engine_t *Engine)
+{
+    return Engine->Tree;
+}
+
+bool
+digest_can_combine(const digest_engine_t *Engine)
+{
+    return Engine->Combine != NULL;
+}
+
+bool
+digest_combine(const digest_engine_t *Engine,
+               const char *           First,
+               const char *           Second,
+               uint64_t               SecondLength,
+               char                   Result[DIGEST_MAX_STRING])
+{
+    unsigned int a = 0;
+    unsigned int b = 0;
+
+    if (!Engine->Combine)
+        return false;
+
+    if (sscanf(First, "%8x", &a) != 1 || sscanf(Second, "%8x", &b) != 1)
+        return false;
+
+    snprintf(Result,
+             DIGEST_MAX_STRING,
+             "%08x",
+             Engine->Combine(a, b, SecondLength));
+    return true;
+}
+
+globus_result_t
+digest_init(digest_t *Digest, const digest_engine_t *Engine)
+{
+    memset(Digest, 0, sizeof(*Digest));
+    Digest->Engine = Engine;
+
+    if (Engine->Tree)
+        return treehash_create(&Digest->Tree);
+
+    if (!Engine->EVPType)
+    {
+        pthread_once(&crc32c_once, digest_crc32c_init);
+        Digest->Sum = Engine->InitialSum;
+        return GLOBUS_SUCCESS;
+    }
+
+    Digest->EVPContext = EVP_MD_CTX_new();
+    if (!Digest->EVPContext)
+        return GlobusGFSErrorMemory("EVP_MD_CTX");
+
+    if (EVP_DigestInit_ex(Digest->EVPContext, Engine->EVPType(), NULL) != 1)
+    {
+        digest_destroy(Digest);
+        return GlobusGFSErrorGeneric("EVP_DigestInit_ex() failed");
+    }
+
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+digest_update(digest_t *Digest, const void *Buffer, size_t Length)
+{
+    if (Digest->Engine->Tree)
+        return treehash_update(Digest->Tree, Buffer, Length);
+
+    if (!Digest->Engine->EVPType)
+    {
+        Digest->Sum = Digest->Engine->Update(Digest->Sum, Buffer, Length);
+        return GLOBUS_SUCCESS;
+    }
+
+    if (EVP_DigestUpdate(Digest->EVPContext, Buffer, Length) != 1)
+        return GlobusGFSErrorGeneric("EVP_DigestUpdate() failed");
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+digest_copy(digest_t *Dest, const digest_t *Source)
+{
+    if (Source->Tree)
+        return GlobusGFSErrorGeneric("Tree hashes can not be copied");
+
+    *Dest = *Source;
+    if (!Source->EVPContext)
+        return GLOBUS_SUCCESS;
+
+    Dest->EVPContext = EVP_MD_CTX_new();
+    if (!Dest->EVPContext)
+        return GlobusGFSErrorMemory("EVP_MD_CTX");
+
+    if (EVP_MD_CTX_copy_ex(Dest->EVPContext, Source->EVPContext) != 1)
+    {
+        digest_destroy(Dest);
+        return GlobusGFSErrorGeneric("EVP_MD_CTX_copy_ex() failed");
+    }
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+digest_final(digest_t *Digest, char String[DIGEST_MAX_STRING])
+{
+    unsigned char   md[EVP_MAX_MD_SIZE];
+    unsigned int    md_length = 0;
+    globus_result_t result    = GLOBUS_SUCCESS;
+
+    if (Digest->Engine->Tree)
+    {
+        result       = treehash_final(Digest->Tree, md);
+        Digest->Tree = NULL;
+        md_length    = SHA256_DIGEST_LENGTH;
+    } else if (!Digest->Engine->EVPType)
+    {
+        snprintf(String,
+                 DIGEST_MAX_STRING,
+                 "%08x",
+                 Digest->Sum ^ Digest->Engine->FinalXor);
+        return GLOBUS_SUCCESS;
+    } else if (EVP_DigestFinal_ex(Digest->EVPContext, md, &md_length) != 1)
+        result = GlobusGFSErrorGeneric("EVP_DigestFinal_ex() failed");
+
+    for (unsigned int i = 0; !result && i < md_length; i++)
+        sprintf(&String[i * 2], "%02x", (unsigned int)md[i]);
+
+    digest_destroy(Digest);
+    return result;
+}
+
+void
+digest_destroy(digest_t *Digest)
+{
+    if (Digest->EVPContext)
+        EVP_MD_CTX_free(Digest->EVPContext);
+    Digest->EVPContext = NULL;
+
+    if (Digest->Tree)
+        treehash_destroy(Digest->Tree);
+    Digest->Tree = NULL;
+}
@@ -0,0 +1,89 @@
+#ifndef HPSS_DSI_DIGEST_H
+#define HPSS_DSI_DIGEST_H
+
+/*
+ * System includes
+ */
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * Checksum algorithms supported by CKSM. Names are matched without regard to
+ * case or dashes so 'SHA-256' and 'sha256' are the same. digest_name()
+ * returns the form saved in UDA.
+ *
+ *   md5, sha1, sha256 - OpenSSL EVP, which uses SHA-NI/AVX when available
+ *   adler32           - Native
+ *   crc32c            - SSE4.2 when the CPU supports it, otherwise tables
+ *   sha256tree        - Chunks hashed in parallel, see treehash.h
+ */
+#define DIGEST_MAX_STRING (2 * EVP_MAX_MD_SIZE + 1)
+
+typedef struct digest_engine digest_engine_t;
+
+typedef struct
+{
+    const digest_engine_t *Engine;
+    EVP_MD_CTX *           EVPContext; // md5, sha1, sha256
+    uint32_t               Sum;        // adler32, crc32c
+    struct treehash *      Tree;       // sha256tree
+} digest_t;
+
+/* Returns NULL if Algorithm is not supported. */
+const digest_engine_t *
+digest_lookup(const char *Algorithm);
+
+const char *
+digest_name(const digest_engine_t *Engine);
+
+/* Length of the hex string digest_final() writes. */
+size_t
+digest_string_length(const digest_engine_t *Engine);
+
+bool
+digest_is_tree(const digest_engine_t *Engine);
+
+bool
+digest_can_combine(const digest_engine_t *Engine);
+
+/*
+ * Computes the checksum of two consecutive pieces of data from their
+ * checksums. Only adler32 and crc32c can be combined; returns false for
+ * the others.
+ */
+bool
+digest_combine(const digest_engine_t *Engine,
+               const char *           First,
+               const char *           Second,
+               uint64_t               SecondLength,
+               char                   Result[DIGEST_MAX_STRING]);
+
+globus_result_t
+digest_init(digest_t *Digest, const digest_engine_t *Engine);
+
+globus_result_t
+digest_update(digest_t *Digest, const void *Buffer, size_t Length);
+
+/*
+ * Copies the state of Source into Dest which must not be initialized. Not
+ * supported for sha256tree.
+ */
+globus_result_t
+digest_copy(digest_t *Dest, const digest_t *Source);
+
+/* Writes the lowercase hex digest. Digest is destroyed. */
+globus_result_t
+digest_final(digest_t *Digest, char String[DIGEST_MAX_STRING]);
+
+/* Safe to call after digest_final() or a failed digest_init(). */
+void
+digest_destroy(digest_t *Digest);
+
+#endif /* HPSS_DSI_DIGEST_H */
@@ -12,17 +12,21 @@
 /*
  * Local includes
  */
+#include "aggregate.h"
+#include "async_close.h"
 #include "authenticate.h"
 #include "commands.h"
 #include "logging.h"
 #include "config.h"
 #include "fixups.h"
 #include "stage.h"
+#include "restart.h"
 #include "retr.h"
 #include "stat.h"
 #include "stor.h"
 #include "hpss.h"
 #include "cksm.h"
+#include "cksmlist.h"
 
 static void
 set_logging_task_id(globus_gfs_operation_t Operation)
@@ -142,6 +146,8 @@ cleanup:
 void
 dsi_destroy(void *Arg)
 {
+    async_close_drain();
+    aggregate_shutdown();
     if (Arg)
         config_destroy(Arg);
 }
@@ -240,9 +246,23 @@ dsi_command(globus_gfs_operation_t     Operation,
         cksm(Operation, CommandInfo, config->UDAChecksumSupport, Callback);
         break;
     case GLOBUS_GFS_HPSS_CMD_SITE_STAGE:
+    case GLOBUS_GFS_HPSS_CMD_SITE_STAGERANGE:
         INFO("Staging %s", CommandInfo->pathname);
         stage(Operation, CommandInfo, Callback);
         break;
+    case GLOBUS_GFS_HPSS_CMD_SITE_VERIFYPREFIX:
+        INFO("Verifying restart prefix of %s", CommandInfo->pathname);
+        restart_verify_prefix(
+            Operation, CommandInfo, config->UDAChecksumSupport, Callback);
+        break;
+    case GLOBUS_GFS_HPSS_CMD_SITE_CKSMLIST:
+        INFO("Get checksums of files in %s", CommandInfo->pathname);
+        cksmlist(Operation, CommandInfo, config->UDAChecksumSupport, Callback);
+        break;
+    case GLOBUS_GFS_HPSS_CMD_SITE_BULKSTAGE:
+        INFO("Staging files in %s", CommandInfo->pathname);
+        stage_bulk(Operation, CommandInfo, Callback);
+        break;
     case GLOBUS_GFS_CMD_TRNC:
         // TODO: I don't think Transfer uses this command
         INFO("Truncating %s", CommandInfo->pathname);
@@ -118,6 +118,33 @@ Hpss_Chmod(
     return HPSS_ERROR(rv, errno_state);
 }
 
+int
+Hpss_Chown(
+    const char                  *  Path,
+    uid_t                          Owner,
+    gid_t                          Group)
+{
+    API_ENTER("hpss_Chown",
+              "Path=%s Owner=%s Group=%s",
+              CHAR_PTR(Path),
+              UID_T(Owner),
+              UID_T(Group));
+
+    Hpss_ClearLastHPSSErrno();
+#if HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4
+    int rv = hpss_Chown((char *)Path, Owner, Group);
+#else
+    int rv = hpss_Chown(Path, Owner, Group);
+#endif
+    hpss_errno_state_t errno_state = Hpss_GetLastHPSSErrno();
+
+    API_EXIT("hpss_Chown",
+             "return_value=%s last_hpss_errno=%s",
+             INT(rv),
+             HPSS_ERRNO_STATE_T(errno_state));
+    return HPSS_ERROR(rv, errno_state);
+}
+
 char *
 Hpss_ChompXMLHeader(
     char                        * XML,
@@ -1059,6 +1086,33 @@ Hpss_Rmdir(
     return HPSS_ERROR(rv, errno_state);
 }
 
+int
+Hpss_SetFileOffset(
+    int                            Fildes,
+    uint64_t                       Offset)
+{
+    API_ENTER("hpss_SetFileOffset",
+              "Fildes=%s Offset=%s",
+              INT(Fildes),
+              UNSIGNED64(Offset));
+
+    Hpss_ClearLastHPSSErrno();
+#if HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4
+    u_signed64 offset_out;
+#else
+    uint64_t offset_out;
+#endif
+    int rv = hpss_SetFileOffset(
+        Fildes, Offset, SEEK_SET, HPSS_SET_OFFSET_FORWARD, &offset_out);
+    hpss_errno_state_t errno_state = Hpss_GetLastHPSSErrno();
+
+    API_EXIT("hpss_SetFileOffset",
+             "return_value=%s last_hpss_errno=%s",
+             INT(rv),
+             HPSS_ERRNO_STATE_T(errno_state));
+    return HPSS_ERROR(rv, errno_state);
+}
+
 int
 Hpss_SetConfiguration(
     const api_config_t          * ConfigIn)
@@ -1497,3 +1551,30 @@ Hpss_Utime(
              HPSS_ERRNO_STATE_T(errno_state));
     return HPSS_ERROR(rv, errno_state);
 }
+
+ssize_t
+Hpss_Write(
+    int                            Fildes,
+    const void                  *  Buf,
+    size_t                         Nbyte)
+{
+    API_ENTER("hpss_Write",
+              "Fildes=%s Buf=%s Nbyte=%s",
+              INT(Fildes),
+              PTR(Buf),
+              UNSIGNED64(Nbyte));
+
+    Hpss_ClearLastHPSSErrno();
+#if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION <= 4)
+    ssize_t rv = hpss_Write(Fildes, (void *)Buf, Nbyte);
+#else
+    ssize_t rv = hpss_Write(Fildes, Buf, Nbyte);
+#endif
+    hpss_errno_state_t errno_state = Hpss_GetLastHPSSErrno();
+
+    API_EXIT("hpss_Write",
+             "return_value=%s last_hpss_errno=%s",
+             INT(rv),
+             HPSS_ERRNO_STATE_T(errno_state));
+    return HPSS_ERROR(rv, errno_state);
+}
@@ -49,6 +49,12 @@ Hpss_Chmod(
     const char                  *  Path,
     mode_t                         Mode);
 
+int
+Hpss_Chown(
+    const char                  *  Path,
+    uid_t                          Owner,
+    gid_t                          Group);
+
 char *
 Hpss_ChompXMLHeader(
     char                        *  XML,
@@ -245,6 +251,12 @@ int
 Hpss_Rmdir(
     const char                  *  Path);
 
+/* Seeks Fildes to Offset from the start of the file. */
+int
+Hpss_SetFileOffset(
+    int                            Fildes,
+    uint64_t                       Offset);
+
 int
 Hpss_SetConfiguration(
     const api_config_t          *  ConfigIn);
@@ -334,4 +346,10 @@ Hpss_Utime(
     const char                  *  Path,
     const struct utimbuf        *  Times);
 
+ssize_t
+Hpss_Write(
+    int                            Fildes,
+    const void                  *  Buf,
+    size_t                         Nbyte);
+
 #endif /* _HPSS_H_ */
@@ -60,6 +60,16 @@ typedef struct
     hpss_pio_grp_t  ParticipantSG;
 } pio_t;
 
+/* Launches ThreadEntry on a detached thread. */
+globus_result_t
+pio_launch_detached(void *(*ThreadEntry)(void *Arg), void *Arg);
+
+/* Launches ThreadEntry on a joinable thread. */
+globus_result_t
+pio_launch_attached(void *(*ThreadEntry)(void *Arg),
+                    void *     Arg,
+                    pthread_t *ThreadID);
+
 /* Don't call for zero-length transfers. */
 globus_result_t
 pio_start(hpss_pio_operation_t           PioOpType,
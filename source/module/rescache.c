@@ -0,0 +1,349 @@
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "rescache.h"
+
+#define RESCACHE_MAGIC 0x48445243 // 'HDRC'
+
+/* A key lives in one of the RESCACHE_WAYS entries following its hash. */
+#define RESCACHE_WAYS 4
+
+/*
+ * Each entry is its own seqlock. The low half of Sequence counts updates;
+ * while it is odd, the high half holds the time() the writer took the
+ * entry. A writer moves Sequence from even to odd with a compare and swap,
+ * fills in the entry and swaps it to the next even value. Readers copy the
+ * entry and only trust the copy if Sequence was the same even, non zero
+ * value before and after; they never wait. A writer that loses a swap drops
+ * its store.
+ *
+ * A writer that died holding an entry would leave it odd forever, so once
+ * it has been held for RESCACHE_STALE_SECONDS the next writer takes it
+ * over.
+ */
+#define RESCACHE_STALE_SECONDS 30
+
+#define SEQUENCE_COUNT(s) ((uint32_t)(s))
+#define SEQUENCE_TIME(s)  ((int64_t)((s) >> 32))
+#define SEQUENCE_HELD(s)  (SEQUENCE_COUNT(s) & 1)
+
+struct rescache_entry
+{
+    uint64_t      Sequence;
+    uint32_t      Length;
+    uint32_t      Reserved;
+    int64_t       Expires; // time(), 0 when never written
+    unsigned char Key[RESCACHE_KEY_SIZE];
+    unsigned char Value[RESCACHE_VALUE_SIZE];
+};
+
+struct rescache_header
+{
+    uint32_t              Magic;
+    uint32_t              EntrySize; // Catches mixed DSI versions
+    uint32_t              EntryCount;
+    uint32_t              Reserved;
+    struct rescache_entry Entries[];
+};
+
+/*
+ * Taken from the header once it is validated; every process that can
+ * write the file is trusted not to corrupt it, but a bad header must not
+ * send lookups out of bounds.
+ */
+struct rescache
+{
+    struct rescache_header *Header;
+    size_t                  Size;
+    uint32_t                EntryCount;
+    bool                    Writable;
+};
+
+static size_t
+rescache_size(uint32_t Entries)
+{
+    return sizeof(struct rescache_header) +
+           (size_t)Entries * sizeof(struct rescache_entry);
+}
+
+/*
+ * Anyone who can write the file can forge residency for every process on
+ * the node, so it must be owned by root or by us and not writable by
+ * others.
+ */
+static bool
+rescache_trusted(const struct stat *St)
+{
+    return (St->st_uid == 0 || St->st_uid == geteuid()) &&
+           !(St->st_mode & S_IWOTH);
+}
+
+globus_result_t
+rescache_open(const char *Pathname, int Entries, rescache_t **Cache)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    int             fd     = -1;
+    bool            locked = false;
+    struct stat     st;
+    rescache_t *    cache  = NULL;
+
+    *Cache = NULL;
+
+    if (Entries < RESCACHE_WAYS)
+        return GlobusGFSErrorGeneric("Illegal residency cache size");
+
+    cache = calloc(1, sizeof(rescache_t));
+    if (!cache)
+        return GlobusGFSErrorMemory("rescache_t");
+
+    /*
+     * A file we create is only writable by us. To share one between the
+     * users GridFTP runs as, create it beforehand as root, writable by a
+     * group of those users; everyone else maps it read only.
+     */
+    cache->Writable = true;
+    fd = open(Pathname, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd == -1 && errno == EEXIST)
+        fd = open(Pathname, O_RDWR | O_NOFOLLOW);
+    if (fd == -1 && errno == EACCES)
+    {
+        cache->Writable = false;
+        fd = open(Pathname, O_RDONLY | O_NOFOLLOW);
+    }
+    if (fd == -1)
+    {
+        result = GlobusGFSErrorSystemError("open", errno);
+        goto cleanup;
+    }
+
+    /* Only held while the first process sizes the file. */
+    if (flock(fd, cache->Writable ? LOCK_EX : LOCK_SH))
+    {
+        result = GlobusGFSErrorSystemError("flock", errno);
+        goto cleanup;
+    }
+    locked = true;
+
+    if (fstat(fd, &st))
+    {
+        result = GlobusGFSErrorSystemError("fstat", errno);
+        goto cleanup;
+    }
+
+    if (!S_ISREG(st.st_mode) || !rescache_trusted(&st))
+    {
+        result = GlobusGFSErrorGeneric(
+            "Residency cache must be a file owned by root or this user and "
+            "not writable by others");
+        goto cleanup;
+    }
+
+    cache->Size = st.st_size;
+    if (cache->Size == 0 && cache->Writable)
+    {
+        cache->Size = rescache_size(Entries);
+        if (ftruncate(fd, cache->Size))
+        {
+            result = GlobusGFSErrorSystemError("ftruncate", errno);
+            goto cleanup;
+        }
+    }
+
+    if (cache->Size < sizeof(struct rescache_header))
+    {
+        result = GlobusGFSErrorGeneric("Residency cache is too small");
+        goto cleanup;
+    }
+
+    cache->Header = mmap(NULL,
+                         cache->Size,
+                         cache->Writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                         MAP_SHARED,
+                         fd,
+                         0);
+    if (cache->Header == MAP_FAILED)
+    {
+        cache->Header = NULL;
+        result        = GlobusGFSErrorSystemError("mmap", errno);
+        goto cleanup;
+    }
+
+    if (cache->Header->Magic == 0 && cache->Writable)
+    {
+        /* ftruncate() zeroed the entries. */
+        cache->Header->EntrySize  = sizeof(struct rescache_entry);
+        cache->Header->EntryCount =
+            (cache->Size - sizeof(struct rescache_header)) /
+            sizeof(struct rescache_entry);
+        __atomic_store_n(&cache->Header->Magic, RESCACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    /* Checked once; lookups only use our copy. */
+    cache->EntryCount = cache->Header->EntryCount;
+    if (cache->Header->Magic != RESCACHE_MAGIC ||
+        cache->Header->EntrySize != sizeof(struct rescache_entry) ||
+        cache->EntryCount < RESCACHE_WAYS ||
+        cache->Size < rescache_size(cache->EntryCount))
+    {
+        result = GlobusGFSErrorGeneric("Residency cache is not valid");
+        goto cleanup;
+    }
+
+    *Cache = cache;
+
+cleanup:
+    /* The mapping keeps the open file, and its lock, alive after close(). */
+    if (locked)
+        flock(fd, LOCK_UN);
+    if (fd != -1)
+        close(fd);
+    if (result)
+        rescache_close(cache);
+    return result;
+}
+
+/* FNV-1a */
+static uint64_t
+rescache_hash(const unsigned char Key[RESCACHE_KEY_SIZE])
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < RESCACHE_KEY_SIZE; i++)
+    {
+        hash ^= Key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static struct rescache_entry *
+rescache_entry(rescache_t *Cache, uint64_t Hash, int Way)
+{
+    return &Cache->Header->Entries[(Hash + Way) % Cache->EntryCount];
+}
+
+bool
+rescache_lookup(rescache_t *        Cache,
+                const unsigned char Key[RESCACHE_KEY_SIZE],
+                void *              Value,
+                size_t              Length)
+{
+    uint64_t              hash = rescache_hash(Key);
+    struct rescache_entry copy;
+
+    if (Length > RESCACHE_VALUE_SIZE)
+        return false;
+
+    for (int way = 0; way < RESCACHE_WAYS; way++)
+    {
+        struct rescache_entry *entry = rescache_entry(Cache, hash, way);
+
+        uint64_t sequence = __atomic_load_n(&entry->Sequence, __ATOMIC_ACQUIRE);
+        if (sequence == 0 || SEQUENCE_HELD(sequence))
+            continue;
+
+        memcpy(&copy, entry, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->Sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+        if (memcmp(copy.Key, Key, RESCACHE_KEY_SIZE))
+            continue;
+
+        if (copy.Expires <= time(NULL) || copy.Length != Length)
+            return false;
+
+        memcpy(Value, copy.Value, Length);
+        return true;
+    }
+    return false;
+}
+
+void
+rescache_store(rescache_t *        Cache,
+               const unsigned char Key[RESCACHE_KEY_SIZE],
+               const void *        Value,
+               size_t              Length,
+               int                 TTL)
+{
+    uint64_t               hash   = rescache_hash(Key);
+    int64_t                now    = time(NULL);
+    struct rescache_entry *victim = NULL;
+
+    if (!Cache->Writable || Length > RESCACHE_VALUE_SIZE || TTL <= 0)
+        return;
+
+    /*
+     * Replace this key's entry, otherwise the one that expires first. These
+     * reads race with other writers; the worst outcome is a poor choice.
+     */
+    for (int way = 0; way < RESCACHE_WAYS; way++)
+    {
+        struct rescache_entry *entry = rescache_entry(Cache, hash, way);
+
+        if (memcmp(entry->Key, Key, RESCACHE_KEY_SIZE) == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if (!victim || entry->Expires < victim->Expires)
+            victim = entry;
+    }
+
+    /* Stays odd when taking over from a dead writer. */
+    uint64_t sequence = __atomic_load_n(&victim->Sequence, __ATOMIC_RELAXED);
+    uint32_t count    = SEQUENCE_COUNT(sequence) + 1;
+    if (SEQUENCE_HELD(sequence))
+    {
+        if (now - SEQUENCE_TIME(sequence) < RESCACHE_STALE_SECONDS)
+            return;
+        count++;
+    }
+
+    uint64_t held = ((uint64_t)now << 32) | count;
+    if (!__atomic_compare_exchange_n(&victim->Sequence,
+                                     &sequence,
+                                     held,
+                                     false,
+                                     __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return;
+
+    memcpy(victim->Key, Key, RESCACHE_KEY_SIZE);
+    memcpy(victim->Value, Value, Length);
+    victim->Length  = Length;
+    victim->Expires = now + TTL;
+
+    /* Fails if we were so slow that someone took the entry over. */
+    __atomic_compare_exchange_n(&victim->Sequence,
+                                &held,
+                                (uint64_t)(count + 1),
+                                false,
+                                __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+}
+
+void
+rescache_close(rescache_t *Cache)
+{
+    if (Cache)
+    {
+        if (Cache->Header)
+            munmap(Cache->Header, Cache->Size);
+        free(Cache);
+    }
+}
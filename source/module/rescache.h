@@ -0,0 +1,54 @@
+#ifndef HPSS_DSI_RESCACHE_H
+#define HPSS_DSI_RESCACHE_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * A node local cache of file residency shared by every GridFTP process,
+ * held in a memory mapped file and keyed by bitfile ID. Any process may
+ * store; lookups take no locks. Each entry carries its own expiration so
+ * that the caller decides how long a value can be trusted. It is only a
+ * cache: stores may be dropped and lookups may miss at any time.
+ *
+ * The value is opaque to the cache; stage.c defines what it records.
+ */
+#define RESCACHE_KEY_SIZE   16
+#define RESCACHE_VALUE_SIZE 112
+
+typedef struct rescache rescache_t;
+
+/*
+ * Maps Pathname, creating it with room for Entries entries if it does not
+ * exist or is empty. The file must be owned by root or by this user and not
+ * be writable by others. Processes that can not write it only look up.
+ */
+globus_result_t
+rescache_open(const char *Pathname, int Entries, rescache_t **Cache);
+
+/* Returns true and copies out the value if Key has an unexpired entry. */
+bool
+rescache_lookup(rescache_t *        Cache,
+                const unsigned char Key[RESCACHE_KEY_SIZE],
+                void *              Value,
+                size_t              Length);
+
+void
+rescache_store(rescache_t *        Cache,
+               const unsigned char Key[RESCACHE_KEY_SIZE],
+               const void *        Value,
+               size_t              Length,
+               int                 TTL); // Seconds
+
+void
+rescache_close(rescache_t *Cache);
+
+#endif /* HPSS_DSI_RESCACHE_H */
@@ -0,0 +1,233 @@
+/*
+ * System includes
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Local includes
+ */
+#include "cksm.h"
+#include "hpss.h"
+#include "logging.h"
+#include "restart.h"
+
+/* The MD5 of no data; an empty prefix always has it. */
+#define RESTART_EMPTY_MD5 "d41d8cd98f00b204e9800998ecf8427e"
+
+typedef struct
+{
+    globus_gfs_operation_t Operation;
+    commands_callback      Callback;
+    char *                 Pathname;
+    globus_off_t           Offset;
+    char                   Checksum[DIGEST_MAX_STRING];
+} restart_verify_t;
+
+static globus_result_t
+restart_get_args(globus_gfs_operation_t     Operation,
+                 globus_gfs_command_info_t *CommandInfo,
+                 globus_off_t *             Offset,
+                 char                       Checksum[DIGEST_MAX_STRING])
+{
+    globus_result_t result;
+    char **         argv = NULL;
+    int             argc = 0;
+    char *          end  = NULL;
+
+    /* Get the command arguments. */
+    result = globus_gridftp_server_query_op_info(Operation,
+                                                 CommandInfo->op_info,
+                                                 GLOBUS_GFS_OP_INFO_CMD_ARGS,
+                                                 &argv,
+                                                 &argc);
+    if (result)
+        return GlobusGFSErrorWrapFailed("Unable to get command args", result);
+
+    *Offset = strtoll(argv[2], &end, 10);
+    if (end == argv[2] || *end != '\0' || *Offset < 0)
+        return GlobusGFSErrorGeneric("Illegal offset value");
+
+    if (strlen(argv[3]) != 2 * MD5_DIGEST_LENGTH ||
+        strspn(argv[3], "0123456789abcdefABCDEF") != 2 * MD5_DIGEST_LENGTH)
+        return GlobusGFSErrorGeneric("Illegal MD5 digest");
+
+    strcpy(Checksum, argv[3]);
+    return GLOBUS_SUCCESS;
+}
+
+static void
+restart_respond(globus_gfs_operation_t Operation,
+                commands_callback      Callback,
+                const char *           Pathname,
+                globus_off_t           Offset,
+                const char *           Expected,
+                const char *           Actual)
+{
+    char *output = NULL;
+
+    if (strcasecmp(Expected, Actual) != 0)
+    {
+        INFO("Prefix digest mismatch for %s at offset %lld",
+             Pathname,
+             (long long)Offset);
+        Callback(Operation,
+                 GlobusGFSErrorGeneric("Prefix digest does not match"),
+                 NULL);
+        return;
+    }
+
+    output = globus_common_create_string(
+        "250 Prefix of %s matches up to offset %" GLOBUS_OFF_T_FORMAT ".\r\n",
+        Pathname,
+        Offset);
+    Callback(Operation, GLOBUS_SUCCESS, output);
+    if (output)
+        globus_free(output);
+}
+
+static void
+restart_cksm_done(globus_result_t Result, char *Checksum, void *UserArg)
+{
+    restart_verify_t *verify = UserArg;
+
+    if (Result)
+        verify->Callback(verify->Operation, Result, NULL);
+    else
+        restart_respond(verify->Operation,
+                        verify->Callback,
+                        verify->Pathname,
+                        verify->Offset,
+                        verify->Checksum,
+                        Checksum);
+
+    free(verify->Pathname);
+    free(verify);
+}
+
+/*
+ * Returns true if the digest recorded by a failed STOR answered the request.
+ * The record is only trusted if the file has not changed size since.
+ */
+static bool
+restart_verify_from_uda(globus_gfs_operation_t Operation,
+                        commands_callback      Callback,
+                        char *                 Pathname,
+                        globus_off_t           Offset,
+                        globus_off_t           FileSize,
+                        const char *           Checksum)
+{
+    globus_off_t    uda_offset   = -1;
+    globus_off_t    uda_filesize = -1;
+    char *          uda_checksum = NULL;
+    globus_result_t result;
+
+    result = cksm_get_uda_prefix(
+        Pathname, &uda_offset, &uda_filesize, &uda_checksum);
+    if (result || !uda_checksum)
+        return false;
+
+    if (uda_offset != Offset || uda_filesize != FileSize)
+    {
+        free(uda_checksum);
+        return false;
+    }
+
+    DEBUG("Verifying the prefix of %s with its recorded digest", Pathname);
+    restart_respond(Operation, Callback, Pathname, Offset, Checksum, uda_checksum);
+    free(uda_checksum);
+    return true;
+}
+
+void
+restart_verify_prefix(globus_gfs_operation_t      Operation,
+                      globus_gfs_command_info_t * CommandInfo,
+                      bool                        UseUDAChecksums,
+                      commands_callback           Callback)
+{
+    int               retval = 0;
+    globus_result_t   result = GLOBUS_SUCCESS;
+    restart_verify_t *verify = NULL;
+    hpss_stat_t       hpss_stat_buf;
+
+    verify = malloc(sizeof(restart_verify_t));
+    if (!verify)
+    {
+        result = GlobusGFSErrorMemory("restart_verify_t");
+        goto cleanup;
+    }
+    memset(verify, 0, sizeof(restart_verify_t));
+    verify->Operation = Operation;
+    verify->Callback  = Callback;
+
+    result = restart_get_args(
+        Operation, CommandInfo, &verify->Offset, verify->Checksum);
+    if (result)
+        goto cleanup;
+
+    retval = Hpss_Stat(CommandInfo->pathname, &hpss_stat_buf);
+    if (retval)
+    {
+        result = hpss_error_to_globus_result(retval);
+        goto cleanup;
+    }
+
+    if (hpss_stat_buf.st_size < verify->Offset)
+    {
+        result = GlobusGFSErrorGeneric("Offset is beyond the end of the file");
+        goto cleanup;
+    }
+
+    /* Nothing to read; PIO does not do zero length transfers. */
+    if (verify->Offset == 0)
+    {
+        restart_respond(Operation,
+                        Callback,
+                        CommandInfo->pathname,
+                        0,
+                        verify->Checksum,
+                        RESTART_EMPTY_MD5);
+        free(verify);
+        return;
+    }
+
+    if (UseUDAChecksums && restart_verify_from_uda(Operation,
+                                                   Callback,
+                                                   CommandInfo->pathname,
+                                                   verify->Offset,
+                                                   hpss_stat_buf.st_size,
+                                                   verify->Checksum))
+    {
+        free(verify);
+        return;
+    }
+
+    verify->Pathname = strdup(CommandInfo->pathname);
+    if (!verify->Pathname)
+    {
+        result = GlobusGFSErrorMemory("pathname");
+        goto cleanup;
+    }
+
+    result = cksm_compute(Operation,
+                          CommandInfo->pathname,
+                          0,
+                          verify->Offset,
+                          digest_lookup("md5"),
+                          0,
+                          restart_cksm_done,
+                          verify);
+
+cleanup:
+    if (result)
+    {
+        if (verify)
+        {
+            if (verify->Pathname)
+                free(verify->Pathname);
+            free(verify);
+        }
+        Callback(Operation, result, NULL);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef HPSS_DSI_RESTART_H
+#define HPSS_DSI_RESTART_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * Local includes
+ */
+#include "commands.h"
+
+/*
+ * SITE VERIFYPREFIX <sp> offset <sp> md5 <sp> path
+ *
+ * Confirms that the first 'offset' bytes of path have the given MD5 so that
+ * a client can restart an upload without resending them. The digest saved
+ * by a failed STOR is used when it covers exactly 'offset' bytes, otherwise
+ * the prefix is read back from HPSS.
+ */
+void
+restart_verify_prefix(globus_gfs_operation_t      Operation,
+                      globus_gfs_command_info_t * CommandInfo,
+                      bool                        UseUDAChecksums,
+                      commands_callback           Callback);
+
+#endif /* HPSS_DSI_RESTART_H */
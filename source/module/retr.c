@@ -7,11 +7,18 @@
  * Local includes
  */
 #include "logging.h"
+#include "aggregate.h"
+#include "async_close.h"
+#include "config.h"
 #include "retr.h"
+#include "stage.h"
 #include "pio.h"
 
 globus_result_t
-retr_open_for_reading(char *Pathname, int *FileFD, int *FileStripeWidth)
+retr_open_for_reading(char *Pathname,
+                      int   Oflag,
+                      int * FileFD,
+                      int * FileStripeWidth)
 {
     hpss_cos_hints_t      hints_in;
     hpss_cos_hints_t      hints_out;
@@ -30,7 +37,7 @@ retr_open_for_reading(char *Pathname, int *FileFD, int *FileStripeWidth)
 
     /* Open the HPSS file. */
     *FileFD = Hpss_Open(Pathname,
-                        O_RDONLY,
+                        O_RDONLY | Oflag,
                         S_IRUSR | S_IWUSR,
                         &hints_in,
                         &priorities,
@@ -160,7 +167,7 @@ retr_pio_callout(char *    ReadyBuffer,
             retr_info->Operation,
             (globus_byte_t *)free_buffer->Buffer,
             *Length,
-            Offset,
+            Offset - retr_info->BaseOffset,
             -1,
             retr_gridftp_callout,
             free_buffer);
@@ -242,6 +249,7 @@ retr_range_complete_callback(globus_off_t *Offset,
             *Eot = 1;
         if (*Length == -1)
             *Length = retr_info->FileSize - *Offset;
+        *Offset += retr_info->BaseOffset;
         retr_info->RangeLength   = *Length;
         retr_info->CurrentOffset = *Offset;
     }
@@ -267,9 +275,18 @@ retr_transfer_complete_callback(globus_result_t Result, void *UserArg)
     if (retr_info->Result)
         result = retr_info->Result;
 
-    rc = Hpss_Close(retr_info->FileFD);
-    if (rc && !result)
-        result = hpss_error_to_globus_result(rc);
+    /* The file was only read so there is nothing to wait for. */
+    bool close_async = async_close_enabled();
+    if (!close_async)
+    {
+        rc = Hpss_Close(retr_info->FileFD);
+        if (rc && !result)
+            result = hpss_error_to_globus_result(rc);
+    }
+
+    /* Queue it before TransferInfo goes away. */
+    if (close_async)
+        async_close(retr_info->FileFD, retr_info->TransferInfo->pathname, NULL);
 
     globus_gridftp_server_finished_transfer(retr_info->Operation, result);
 
@@ -290,14 +307,76 @@ retr_transfer_complete_callback(globus_result_t Result, void *UserArg)
     free(retr_info);
 }
 
+/*
+ * With $HPSS_DSI_RETR_RANGE_STAGE set, a RETR of part of an archived file
+ * stages only that part, waiting up to that many seconds. Once the range is
+ * on disk the file is opened without staging so that HPSS does not recall
+ * the rest of it; otherwise it is opened as usual and HPSS stages it. Only
+ * the first range of a restarted transfer is staged; reads of later ranges
+ * that are not on disk come from tape. Returns the flags to open with.
+ */
+static int
+retr_stage_range(globus_gfs_operation_t Operation,
+                 const char *           Pathname,
+                 globus_off_t           Offset,
+                 globus_off_t           Length,
+                 globus_off_t           FileSize)
+{
+    int             timeout = config_get_env_int("HPSS_DSI_RETR_RANGE_STAGE", 0);
+    char *          task_id = NULL;
+    hpss_reqid_t    request_id;
+    residency_t     residency;
+    globus_result_t result;
+
+    if (timeout <= 0)
+        return 0;
+
+    if (Offset == 0 && (Length == -1 || Length >= FileSize))
+        return 0;
+
+    globus_gridftp_server_get_task_id(Operation, &task_id);
+
+    result = stage_range_ex(Pathname,
+                            Offset,
+                            Length,
+                            timeout,
+                            task_id,
+                            &request_id,
+                            &residency);
+    if (task_id)
+        free(task_id);
+
+    // Let the open stage it as it always has
+    if (result)
+    {
+        WARN("Failed to stage the requested range of %s", Pathname);
+        return 0;
+    }
+    if (residency != RESIDENCY_RESIDENT)
+    {
+        INFO("Requested range of %s is not on disk yet", Pathname);
+        return 0;
+    }
+
+#ifdef HPSS_O_STAGE_NONE
+    return HPSS_O_STAGE_NONE;
+#else
+    return 0;
+#endif
+}
+
 void
 retr(globus_gfs_operation_t Operation, globus_gfs_transfer_info_t *TransferInfo)
 {
     int             rc                = 0;
-    int             file_stripe_width = 0;
-    retr_info_t *   retr_info         = NULL;
-    globus_result_t result            = GLOBUS_SUCCESS;
-    hpss_stat_t     hpss_stat_buf;
+    int                oflag             = 0;
+    int                file_stripe_width = 0;
+    retr_info_t *      retr_info         = NULL;
+    globus_result_t    result            = GLOBUS_SUCCESS;
+    hpss_stat_t        hpss_stat_buf;
+    aggregate_member_t member;
+
+    memset(&member, 0, sizeof(member));
 
     rc = Hpss_Stat(TransferInfo->pathname, &hpss_stat_buf);
     if (rc)
@@ -306,6 +385,13 @@ retr(globus_gfs_operation_t Operation, globus_gfs_transfer_info_t *TransferInfo)
         goto cleanup;
     }
 
+    /* Members are served from their container. */
+    result = aggregate_lookup(TransferInfo->pathname, &hpss_stat_buf, &member);
+    if (!result && member.Container)
+        result = aggregate_check_extent(&member);
+    if (result)
+        goto cleanup;
+
     /*
      * Create our structure.
      */
@@ -320,22 +406,38 @@ retr(globus_gfs_operation_t Operation, globus_gfs_transfer_info_t *TransferInfo)
     retr_info->TransferInfo = TransferInfo;
     retr_info->FileFD       = -1;
     retr_info->FileSize     = hpss_stat_buf.st_size;
+    if (member.Container)
+    {
+        retr_info->FileSize   = member.Length;
+        retr_info->BaseOffset = member.Offset;
+    }
     pthread_mutex_init(&retr_info->Mutex, NULL);
     pthread_cond_init(&retr_info->Cond, NULL);
 
     globus_gridftp_server_get_block_size(Operation, &retr_info->BlockSize);
 
+    globus_gridftp_server_get_read_range(
+        Operation, &retr_info->CurrentOffset, &retr_info->RangeLength);
+
+    /* Containers are staged whole, like every other file. */
+    if (!member.Container)
+        oflag = retr_stage_range(Operation,
+                                 TransferInfo->pathname,
+                                 retr_info->CurrentOffset,
+                                 retr_info->RangeLength,
+                                 retr_info->FileSize);
+
     /*
      * Open the file.
      */
     result = retr_open_for_reading(
-        TransferInfo->pathname, &retr_info->FileFD, &file_stripe_width);
+        member.Container ? member.Container : TransferInfo->pathname,
+        oflag,
+        &retr_info->FileFD,
+        &file_stripe_width);
     if (result)
         goto cleanup;
 
-    globus_gridftp_server_get_read_range(
-        Operation, &retr_info->CurrentOffset, &retr_info->RangeLength);
-
     globus_gridftp_server_begin_transfer(Operation, GLOBUS_GFS_EVENT_TRANSFER_ABORT, NULL);
 
     INFO("Sending %s: Offset:%lld Filesize:%lld",
@@ -346,6 +448,9 @@ retr(globus_gfs_operation_t Operation, globus_gfs_transfer_info_t *TransferInfo)
     if (retr_info->RangeLength == -1)
         retr_info->RangeLength = retr_info->FileSize - retr_info->CurrentOffset;
 
+    /* PIO works in container offsets. */
+    retr_info->CurrentOffset += retr_info->BaseOffset;
+
     /*
      * Setup PIO
      */
@@ -373,4 +478,5 @@ cleanup:
             free(retr_info);
         }
     }
+    aggregate_member_destroy(&member);
 }
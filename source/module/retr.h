@@ -35,6 +35,7 @@ typedef struct retr_info
 
     int      FileFD;
     uint64_t FileSize;
+    uint64_t BaseOffset; // Of an aggregate member within its container
 
     globus_result_t Result;
     globus_size_t   BlockSize;
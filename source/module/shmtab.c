@@ -0,0 +1,225 @@
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "shmtab.h"
+
+#define SHMTAB_MAGIC 0x48445354 // 'HDST'
+
+/*
+ * Slot n (1 based) of the publish order lives at Slots[(n - 1) % SlotCount].
+ * A slot's Sequence is 0 while its key is being written and n once it is
+ * valid, so readers check it before and after copying the key.
+ */
+struct shmtab_slot
+{
+    uint64_t      Sequence;
+    unsigned char Key[SHMTAB_KEY_SIZE];
+};
+
+struct shmtab_header
+{
+    uint32_t           Magic;
+    uint32_t           SlotCount;
+    uint64_t           Sequence; // Last published
+    struct shmtab_slot Slots[];
+};
+
+/* SlotCount is copied at open; the writer could replace the header. */
+struct shmtab
+{
+    struct shmtab_header *Header;
+    size_t                Size;
+    uint32_t              SlotCount;
+};
+
+static globus_result_t
+shmtab_map(const char *Name,
+           int         Flags,
+           uint32_t    Slots,
+           shmtab_t ** Table)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    int             fd     = -1;
+    int             prot   = PROT_READ;
+    struct stat     st;
+    shmtab_t *      table  = NULL;
+
+    *Table = NULL;
+
+    table = calloc(1, sizeof(shmtab_t));
+    if (!table)
+        return GlobusGFSErrorMemory("shmtab_t");
+
+    fd = shm_open(Name, Flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1)
+    {
+        result = GlobusGFSErrorSystemError("shm_open", errno);
+        goto cleanup;
+    }
+
+    if (fstat(fd, &st))
+    {
+        result = GlobusGFSErrorSystemError("fstat", errno);
+        goto cleanup;
+    }
+
+    /* Anyone can create a segment by this name before the listener does. */
+    if (st.st_uid != 0 && st.st_uid != geteuid())
+    {
+        result = GlobusGFSErrorGeneric("Stage callback table has an untrusted owner");
+        goto cleanup;
+    }
+
+    if (Flags & O_CREAT)
+    {
+        prot |= PROT_WRITE;
+        table->Size = sizeof(struct shmtab_header) +
+                      Slots * sizeof(struct shmtab_slot);
+        if (ftruncate(fd, table->Size))
+        {
+            result = GlobusGFSErrorSystemError("ftruncate", errno);
+            goto cleanup;
+        }
+    } else
+    {
+        table->Size = st.st_size;
+    }
+
+    if (table->Size < sizeof(struct shmtab_header))
+    {
+        result = GlobusGFSErrorGeneric("Stage callback table is too small");
+        goto cleanup;
+    }
+
+    table->Header = mmap(NULL, table->Size, prot, MAP_SHARED, fd, 0);
+    if (table->Header == MAP_FAILED)
+    {
+        table->Header = NULL;
+        result        = GlobusGFSErrorSystemError("mmap", errno);
+        goto cleanup;
+    }
+
+    if (Flags & O_CREAT)
+    {
+        table->Header->SlotCount = Slots;
+        __atomic_store_n(&table->Header->Magic, SHMTAB_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&table->Header->Magic, __ATOMIC_ACQUIRE) !=
+               SHMTAB_MAGIC)
+    {
+        result = GlobusGFSErrorGeneric("Stage callback table is not valid");
+        goto cleanup;
+    }
+
+    table->SlotCount = table->Header->SlotCount;
+    if (table->SlotCount == 0 ||
+        (table->Size - sizeof(struct shmtab_header)) / sizeof(struct shmtab_slot) <
+            table->SlotCount)
+    {
+        result = GlobusGFSErrorGeneric("Stage callback table is not valid");
+        goto cleanup;
+    }
+
+    *Table = table;
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    if (result)
+        shmtab_close(table);
+    return result;
+}
+
+globus_result_t
+shmtab_create(const char *Name, uint32_t Slots, shmtab_t **Table)
+{
+    if (Slots == 0)
+        return GlobusGFSErrorGeneric("Illegal stage callback table size");
+
+    /*
+     * Never resize a segment that readers have mapped; they keep the old one
+     * and fall back to polling HPSS until they open the new one.
+     */
+    if (shm_unlink(Name) && errno != ENOENT)
+        return GlobusGFSErrorSystemError("shm_unlink", errno);
+    return shmtab_map(Name, O_RDWR | O_CREAT | O_EXCL, Slots, Table);
+}
+
+globus_result_t
+shmtab_open(const char *Name, shmtab_t **Table)
+{
+    return shmtab_map(Name, O_RDONLY, 0, Table);
+}
+
+void
+shmtab_publish(shmtab_t *Table, const unsigned char Key[SHMTAB_KEY_SIZE])
+{
+    struct shmtab_header *header   = Table->Header;
+    uint64_t              sequence = header->Sequence + 1;
+    struct shmtab_slot *  slot =
+        &header->Slots[(sequence - 1) % Table->SlotCount];
+
+    __atomic_store_n(&slot->Sequence, 0, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot->Key, Key, SHMTAB_KEY_SIZE);
+    __atomic_store_n(&slot->Sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->Sequence, sequence, __ATOMIC_RELEASE);
+}
+
+uint64_t
+shmtab_sequence(shmtab_t *Table)
+{
+    return __atomic_load_n(&Table->Header->Sequence, __ATOMIC_ACQUIRE);
+}
+
+bool
+shmtab_find(shmtab_t *          Table,
+            uint64_t            Since,
+            const unsigned char Key[SHMTAB_KEY_SIZE])
+{
+    struct shmtab_header *header  = Table->Header;
+    uint64_t              current = shmtab_sequence(Table);
+    unsigned char         key[SHMTAB_KEY_SIZE];
+
+    /* Unknown slots were overwritten; let the caller check for itself. */
+    if (current - Since > Table->SlotCount)
+        return true;
+
+    for (uint64_t sequence = Since + 1; sequence <= current; sequence++)
+    {
+        struct shmtab_slot *slot =
+            &header->Slots[(sequence - 1) % Table->SlotCount];
+
+        if (__atomic_load_n(&slot->Sequence, __ATOMIC_ACQUIRE) != sequence)
+            return true; // Overwritten while we looked
+        memcpy(key, slot->Key, SHMTAB_KEY_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->Sequence, __ATOMIC_ACQUIRE) != sequence)
+            return true;
+
+        if (memcmp(key, Key, SHMTAB_KEY_SIZE) == 0)
+            return true;
+    }
+    return false;
+}
+
+void
+shmtab_close(shmtab_t *Table)
+{
+    if (Table)
+    {
+        if (Table->Header)
+            munmap(Table->Header, Table->Size);
+        free(Table);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef HPSS_DSI_SHMTAB_H
+#define HPSS_DSI_SHMTAB_H
+
+/*
+ * System includes
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * A ring of recently published keys in POSIX shared memory, written by a
+ * single process and read by any number of others without locks. The stage
+ * callback listener publishes the request ID of each completed stage and
+ * stage_ex() looks for its own request ID instead of polling HPSS.
+ *
+ * Readers remember shmtab_sequence() and later ask whether a key was
+ * published since. If the ring wrapped in between, shmtab_find() answers
+ * true so that the reader falls back to asking HPSS.
+ */
+#define SHMTAB_KEY_SIZE 16
+
+typedef struct shmtab shmtab_t;
+
+/*
+ * Creates the table Name (ie. "/hpss_dsi_stage") for writing, replacing any
+ * table of that name.
+ */
+globus_result_t
+shmtab_create(const char *Name, uint32_t Slots, shmtab_t **Table);
+
+/* Maps an existing table read only. It must be owned by root or by us. */
+globus_result_t
+shmtab_open(const char *Name, shmtab_t **Table);
+
+/* Only one process may publish to a table. */
+void
+shmtab_publish(shmtab_t *Table, const unsigned char Key[SHMTAB_KEY_SIZE]);
+
+uint64_t
+shmtab_sequence(shmtab_t *Table);
+
+bool
+shmtab_find(shmtab_t *          Table,
+            uint64_t            Since,
+            const unsigned char Key[SHMTAB_KEY_SIZE]);
+
+void
+shmtab_close(shmtab_t *Table);
+
+#endif /* HPSS_DSI_SHMTAB_H */
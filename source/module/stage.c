@@ -2,7 +2,9 @@
  * System includes
  */
 #include <sys/select.h>
+#include <pthread.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -10,9 +12,14 @@
 /*
  * Local includes
  */
+#include "config.h"
 #include "hpss_log.h"
 #include "logging.h"
+#include "pio.h"
+#include "rescache.h"
+#include "shmtab.h"
 #include "stage.h"
+#include "stagemgr.h"
 #include "utils.h"
 #include "hpss.h"
 
@@ -95,6 +102,21 @@
  *
  * For what it's worth, there is a design (pending funding) to improve this which includes
  * having Transfer keep some state between requests.
+ *
+ * Sites that run stage_listener (source/utils) on each node at ASYNC_CALLBACK_ADDR
+ * finally have someone receiving the callbacks. It publishes the request ID of
+ * each completed stage to a shared memory table named by $HPSS_DSI_STAGE_CALLBACK_SHM
+ * and stage_ex() waits on that table, polling HPSS early when its request shows up
+ * and otherwise on its usual schedule.
+ *
+ * Sites can also run stage_manager (source/utils), a long lived process that
+ * finally keeps the state Transfer does not. When $HPSS_DSI_STAGE_MANAGER names its
+ * socket, sessions still check residency themselves, as the user, but hand archived
+ * files to the manager instead of submitting them. It keeps one request per bitfile
+ * across all tasks, submits them in tape order under global and per volume limits
+ * and builds request IDs from its own task ID, which it returns so that sessions
+ * can still find their stage callbacks. If the manager can not be reached, the
+ * session submits the request itself as before.
  */
 
 #if (HPSS_MAJOR_VERSION == 7 && HPSS_MINOR_VERSION > 4) || HPSS_MAJOR_VERSION >= 8
@@ -138,8 +160,17 @@ _bytes_to_request_id(const unsigned char Bytes[UUID_BYTE_COUNT], hpss_reqid_t *
 #endif
 }
 
+/*
+ * Length is non zero for a request that stages part of the file. Ranges get
+ * their own request IDs so that they are not mistaken for a request to stage
+ * the whole file, or another range.
+ */
 static void
-_generate_request_id(const char * TaskID, bitfile_id_t * BitfileID, hpss_reqid_t * RequestID)
+_generate_request_id(const char *   TaskID,
+                     bitfile_id_t * BitfileID,
+                     uint64_t       Offset,
+                     uint64_t       Length,
+                     hpss_reqid_t * RequestID)
 {
     // If we do not have a Task ID, log a warning and return the default.
     if (!is_valid_uuid(TaskID))
@@ -164,6 +195,15 @@ _generate_request_id(const char * TaskID, bitfile_id_t * BitfileID, hpss_reqid_t
         request_id_bytes[i] = task_id_bytes[i] ^ bitfile_id_bytes[i];
     }
 
+    if (Length)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            request_id_bytes[i] ^= (Offset >> (i * 8)) & 0xff;
+            request_id_bytes[i + 8] ^= (Length >> (i * 8)) & 0xff;
+        }
+    }
+
     // Convert our bytes array into a request ID.
     _bytes_to_request_id(request_id_bytes, RequestID);
 
@@ -217,13 +257,15 @@ min(size_t x, size_t y)
     return y;
 }
 
+/* Stages the whole file unless Flags is 0, then only Offset to Length. */
 static globus_result_t
-submit_stage_request(const char *Pathname, hpss_reqid_t RequestID)
+submit_stage_request(const char * Pathname,
+                     hpss_reqid_t RequestID,
+                     u_signed64   Offset,
+                     u_signed64   Length,
+                     uint32_t     Flags)
 {
-    hpss_fileattr_t fattrs;
-    int retval = Hpss_FileGetAttributes((char *)Pathname, &fattrs);
-    if (retval)
-        return hpss_error_to_globus_result(retval);
+    int retval = 0;
 
     bfs_callback_addr_t callback_addr;
     memset(&callback_addr, 0, sizeof(callback_addr));
@@ -271,7 +313,16 @@ submit_stage_request(const char *Pathname, hpss_reqid_t RequestID)
 
     callback_addr.id = RequestID;
 
-    DEBUG("Requesting stage for %s", Pathname);
+    if (Flags & BFS_STAGE_ALL)
+    {
+        DEBUG("Requesting stage for %s", Pathname);
+    } else
+    {
+        DEBUG("Requesting stage of %llu bytes at %llu for %s",
+              (unsigned long long)Length,
+              (unsigned long long)Offset,
+              Pathname);
+    }
 
     /*
      * We use hpss_StageCallBack() so that we do not block while the
@@ -280,11 +331,11 @@ submit_stage_request(const char *Pathname, hpss_reqid_t RequestID)
      */
     bitfile_id_t bitfile_id;
     retval = Hpss_StageCallBack((char *)Pathname,
-                                cast64m(0),
-                                fattrs.Attrs.DataLength,
+                                Offset,
+                                Length,
                                 0,
                                 &callback_addr,
-                                BFS_STAGE_ALL,
+                                Flags,
                                 &RequestID,
                                 &bitfile_id);
     if (retval)
@@ -343,6 +394,24 @@ check_xattr_residency(hpss_xfileattr_t *XFileAttr)
     return RESIDENCY_RESIDENT;
 }
 
+/*
+ * The most bytes held by any disk level. HPSS does not say which bytes
+ * those are, only how many.
+ */
+static u_signed64
+get_disk_bytes(hpss_xfileattr_t *XFileAttr)
+{
+    u_signed64 max_bytes = 0;
+
+    for (int level = 0; level < HPSS_MAX_STORAGE_LEVELS; level++)
+    {
+        if ((XFileAttr->SCAttrib[level].Flags & BFS_BFATTRS_LEVEL_IS_DISK) &&
+            gt64(XFileAttr->SCAttrib[level].BytesAtLevel, max_bytes))
+            max_bytes = XFileAttr->SCAttrib[level].BytesAtLevel;
+    }
+    return max_bytes;
+}
+
 static void
 free_xfileattr(hpss_xfileattr_t *XFileAttr)
 {
@@ -363,12 +432,214 @@ free_xfileattr(hpss_xfileattr_t *XFileAttr)
     }
 }
 
+/*
+ * Where an archived file's data starts on tape, used to order stage
+ * requests. Only the first PV of the first VV of the first tape level that
+ * holds data is considered.
+ */
+typedef struct
+{
+    bool     Valid;
+    char     Volume[64];
+    int64_t  Position; // Relative position (section) on the VV
+    uint64_t Offset;   // Offset within that section
+} tape_location_t;
+
+/*
+ * Everything staging needs to know about a file, from a single
+ * Hpss_FileGetXAttributes().
+ */
+typedef struct
+{
+    residency_t     Residency;
+    bitfile_id_t    BitfileID;
+    u_signed64      DataLength;
+    u_signed64      DiskBytes; // See get_disk_bytes()
+    tape_location_t Location;  // Archived files only
+} stage_file_t;
+
+static void
+get_tape_location(hpss_xfileattr_t *XFileAttr, tape_location_t *Location)
+{
+    memset(Location, 0, sizeof(*Location));
+
+    for (int level = 0; level < HPSS_MAX_STORAGE_LEVELS; level++)
+    {
+        bf_sc_attrib_t *sc = &XFileAttr->SCAttrib[level];
+
+        if (!(sc->Flags & BFS_BFATTRS_LEVEL_IS_TAPE) || sc->NumberOfVVs == 0 ||
+            eqz64m(sc->BytesAtLevel))
+            continue;
+
+        pv_list_t *pv_list = sc->VVAttrib[0].PVList;
+        if (!pv_list || pv_list->List.List_len == 0)
+            return;
+
+        snprintf(Location->Volume,
+                 sizeof(Location->Volume),
+                 "%.*s",
+                 (int)sizeof(pv_list->List.List_val[0].Name),
+                 pv_list->List.List_val[0].Name);
+        Location->Position = sc->VVAttrib[0].RelPosition;
+        Location->Offset   = sc->VVAttrib[0].RelPositionOffset;
+        Location->Valid    = true;
+        return;
+    }
+}
+
+/*
+ * Every GridFTP session asks HPSS for the residency of the same files, so
+ * results are shared between processes on the node through a cache at
+ * $HPSS_DSI_RESIDENCY_CACHE keyed by bitfile ID. ARCHIVED files change
+ * once their stage completes so they are only kept for
+ * $HPSS_DSI_RESIDENCY_CACHE_ARCHIVED_TTL seconds; everything else is kept
+ * for $HPSS_DSI_RESIDENCY_CACHE_TTL.
+ */
+#define RESIDENCY_CACHE_DEFAULT_ENTRIES      65536
+#define RESIDENCY_CACHE_DEFAULT_TTL          60
+#define RESIDENCY_CACHE_DEFAULT_ARCHIVED_TTL 5
+
+/* What the cache records for a bitfile. */
+typedef struct
+{
+    int32_t         Residency;
+    u_signed64      DataLength;
+    u_signed64      DiskBytes;
+    tape_location_t Location;
+} residency_cache_record_t;
+
+static pthread_once_t ResidencyCacheOnce = PTHREAD_ONCE_INIT;
+static rescache_t *   ResidencyCache     = NULL;
+
+static void
+residency_cache_init()
+{
+    const char *pathname = getenv("HPSS_DSI_RESIDENCY_CACHE");
+
+    if (!pathname || *pathname == '\0')
+        return;
+
+    int entries = config_get_env_int("HPSS_DSI_RESIDENCY_CACHE_ENTRIES",
+                                     RESIDENCY_CACHE_DEFAULT_ENTRIES);
+
+    if (rescache_open(pathname, entries, &ResidencyCache))
+    {
+        WARN("Can not open the residency cache %s, not caching", pathname);
+        ResidencyCache = NULL;
+    }
+}
+
+/* Returns NULL unless $HPSS_DSI_RESIDENCY_CACHE is usable. */
+static rescache_t *
+residency_cache()
+{
+    pthread_once(&ResidencyCacheOnce, residency_cache_init);
+    return ResidencyCache;
+}
+
+static void
+residency_cache_key(bitfile_id_t *BitfileID, unsigned char Key[RESCACHE_KEY_SIZE])
+{
+    unsigned char bytes[UUID_BYTE_COUNT];
+
+    _bitfile_id_to_bytes(BitfileID, bytes);
+    memset(Key, 0, RESCACHE_KEY_SIZE);
+    memcpy(Key,
+           bytes,
+           UUID_BYTE_COUNT < RESCACHE_KEY_SIZE ? UUID_BYTE_COUNT
+                                               : RESCACHE_KEY_SIZE);
+}
+
+/*
+ * The bitfile ID comes from the name server alone, which is much cheaper
+ * than the per level statistics of Hpss_FileGetXAttributes().
+ */
+static bool
+residency_cache_lookup(rescache_t *Cache, const char *Pathname, stage_file_t *File)
+{
+    hpss_fileattr_t          fileattr;
+    residency_cache_record_t record;
+    unsigned char            key[RESCACHE_KEY_SIZE];
+
+    memset(&fileattr, 0, sizeof(fileattr));
+    if (Hpss_FileGetAttributes(Pathname, &fileattr))
+        return false;
+
+    /* Only files have bitfiles; let the full check sort out the rest. */
+    if (fileattr.Attrs.Type != NS_OBJECT_TYPE_FILE &&
+        fileattr.Attrs.Type != NS_OBJECT_TYPE_HARD_LINK)
+        return false;
+
+    memset(File, 0, sizeof(*File));
+    memcpy(&File->BitfileID, &ATTR_TO_BFID(fileattr), sizeof(bitfile_id_t));
+
+    residency_cache_key(&File->BitfileID, key);
+    if (!rescache_lookup(Cache, key, &record, sizeof(record)))
+        return false;
+
+    File->Residency  = record.Residency;
+    File->DataLength = record.DataLength;
+    File->DiskBytes  = record.DiskBytes;
+    File->Location   = record.Location;
+    return true;
+}
+
+static void
+residency_cache_store(rescache_t *Cache, stage_file_t *File)
+{
+    residency_cache_record_t record;
+    unsigned char            key[RESCACHE_KEY_SIZE];
+    int                      ttl = 0;
+
+    if (File->Residency == RESIDENCY_ARCHIVED)
+        ttl = config_get_env_int("HPSS_DSI_RESIDENCY_CACHE_ARCHIVED_TTL",
+                                 RESIDENCY_CACHE_DEFAULT_ARCHIVED_TTL);
+    else
+        ttl = config_get_env_int("HPSS_DSI_RESIDENCY_CACHE_TTL",
+                                 RESIDENCY_CACHE_DEFAULT_TTL);
+
+    memset(&record, 0, sizeof(record));
+    record.Residency  = File->Residency;
+    record.DataLength = File->DataLength;
+    record.DiskBytes  = File->DiskBytes;
+    record.Location   = File->Location;
+
+    residency_cache_key(&File->BitfileID, key);
+    rescache_store(Cache, key, &record, sizeof(record), ttl);
+}
+
+static const char *
+residency_name(residency_t Residency)
+{
+    switch (Residency)
+    {
+    case RESIDENCY_ARCHIVED:
+        return "ARCHIVED";
+    case RESIDENCY_RESIDENT:
+        return "RESIDENT";
+    case RESIDENCY_TAPE_ONLY:
+        return "TAPE_ONLY";
+    }
+    return "UNKNOWN";
+}
+
+/*
+ * With UseCache, a cached result is returned if there is one. Results from
+ * HPSS are always cached.
+ */
 static globus_result_t
-check_file_residency(const char *Pathname, residency_t *Residency)
+check_file_residency(const char *Pathname, stage_file_t *File, bool UseCache)
 {
     int              retval = 0;
+    rescache_t *     cache  = residency_cache();
     hpss_xfileattr_t xattr;
 
+    if (cache && UseCache && residency_cache_lookup(cache, Pathname, File))
+    {
+        DEBUG("File is %s (cached): %s", residency_name(File->Residency), Pathname);
+        return GLOBUS_SUCCESS;
+    }
+
     memset(&xattr, 0, sizeof(hpss_xfileattr_t));
 
     /*
@@ -384,23 +655,23 @@ check_file_residency(const char *Pathname, residency_t *Residency)
     if (retval)
         return hpss_error_to_globus_result(retval);
 
-    *Residency = check_xattr_residency(&xattr);
+    memset(File, 0, sizeof(*File));
+    File->Residency  = check_xattr_residency(&xattr);
+    File->DataLength = xattr.Attrs.DataLength;
+    File->DiskBytes  = get_disk_bytes(&xattr);
+    memcpy(&File->BitfileID, &ATTR_TO_BFID(xattr), sizeof(bitfile_id_t));
+    if (File->Residency == RESIDENCY_ARCHIVED)
+        get_tape_location(&xattr, &File->Location);
 
     /* Release the hpss_xfileattr_t */
     free_xfileattr(&xattr);
 
-    switch (*Residency)
-    {
-    case RESIDENCY_ARCHIVED:
-        DEBUG("File is ARCHIVED: %s", Pathname);
-        break;
-    case RESIDENCY_RESIDENT:
-        DEBUG("File is RESIDENT: %s", Pathname);
-        break;
-    case RESIDENCY_TAPE_ONLY:
-        DEBUG("File is TAPE_ONLY: %s", Pathname);
-        break;
-    }
+    DEBUG("File is %s: %s", residency_name(File->Residency), Pathname);
+
+    /* Directories and such have no bitfile to key on. */
+    if (cache && (xattr.Attrs.Type == NS_OBJECT_TYPE_FILE ||
+                  xattr.Attrs.Type == NS_OBJECT_TYPE_HARD_LINK))
+        residency_cache_store(cache, File);
 
     return GLOBUS_SUCCESS;
 }
@@ -433,15 +704,44 @@ stage_get_timeout(globus_gfs_operation_t     Operation,
     return GLOBUS_SUCCESS;
 }
 
+/*
+ * The offset and length of SITE STAGERANGE; SITE STAGE stages the whole
+ * file. A length of -1 stages to the end of the file.
+ */
 static globus_result_t
-get_bitfile_id(const char *Pathname, bitfile_id_t *bitfile_id)
+stage_get_range(globus_gfs_operation_t     Operation,
+                globus_gfs_command_info_t *CommandInfo,
+                uint64_t *                 Offset,
+                uint64_t *                 Length)
 {
-    hpss_fileattr_t attrs;
-    int retval = Hpss_FileGetAttributes((char *)Pathname, &attrs);
-    if (retval)
-        return hpss_error_to_globus_result(retval);
+    globus_result_t result;
+    char **         argv = NULL;
+    int             argc = 0;
+    long long       length;
+
+    *Offset = 0;
+    *Length = -1;
+
+    result = globus_gridftp_server_query_op_info(Operation,
+                                                 CommandInfo->op_info,
+                                                 GLOBUS_GFS_OP_INFO_CMD_ARGS,
+                                                 &argv,
+                                                 &argc);
+
+    if (result)
+        return GlobusGFSErrorWrapFailed("Unable to get command args", result);
 
-    memcpy(bitfile_id, &ATTR_TO_BFID(attrs), sizeof(bitfile_id_t));
+    if (CommandInfo->command == GLOBUS_GFS_HPSS_CMD_SITE_STAGE)
+        return GLOBUS_SUCCESS;
+
+    if (argc != 6 ||
+        sscanf(argv[3], "%" SCNu64, Offset) != 1 ||
+        sscanf(argv[4], "%lld", &length) != 1 ||
+        length == 0 || length < -1)
+        return GlobusGFSErrorGeneric("Illegal range");
+
+    if (length != -1)
+        *Length = length;
     return GLOBUS_SUCCESS;
 }
 
@@ -460,20 +760,346 @@ generate_output(const char *Pathname, residency_t Residency)
         "450 %s: is being retrieved from the archive...\r\n", Pathname);
 }
 
-/* Returns 1 if Timeout has elapsed, 0 otherwise. */
-static int
-pause_1_second(time_t StartTime, int Timeout)
+/*
+ * Recalls take minutes, so polls of an archived file back off from
+ * $HPSS_DSI_STAGE_POLL_MIN_MS, doubling while the request is queued up to
+ * $HPSS_DSI_STAGE_POLL_MAX_MS. Once the request is active the data is
+ * moving, so the delay is held at a quarter of the maximum. Each delay is
+ * jittered by up to +/-25% so that sessions polling the same files spread
+ * out.
+ */
+#define STAGE_POLL_DEFAULT_MIN_MS 1000
+#define STAGE_POLL_DEFAULT_MAX_MS 30000
+
+/*
+ * With stage callbacks, the completion callback is what wakes a waiting
+ * stage and HPSS is only polled every $HPSS_DSI_STAGE_CALLBACK_POLL_MS in
+ * case a callback was lost, so that metadata calls no longer grow with the
+ * time spent waiting.
+ */
+#define STAGE_CALLBACK_DEFAULT_POLL_MS 300000
+
+static long
+stage_elapsed_ms(const struct timespec *Start)
 {
-    if ((time(NULL) - StartTime) > Timeout)
-        return 1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - Start->tv_sec) * 1000 +
+           (now.tv_nsec - Start->tv_nsec) / 1000000;
+}
+
+/* Up to +/-25% */
+static long
+stage_jitter_ms(long Delay, unsigned int *Seed)
+{
+    return Delay - Delay / 4 + (long)(rand_r(Seed) % (Delay / 2 + 1));
+}
+
+static long
+stage_callback_delay_ms(unsigned int *Seed)
+{
+    long delay_ms = config_get_env_int("HPSS_DSI_STAGE_CALLBACK_POLL_MS",
+                                       STAGE_CALLBACK_DEFAULT_POLL_MS);
+    if (delay_ms < 1)
+        delay_ms = 1;
+    return stage_jitter_ms(delay_ms, Seed);
+}
+
+static long
+stage_next_delay_ms(long Delay, int Status, unsigned int *Seed)
+{
+    long min_ms = config_get_env_int("HPSS_DSI_STAGE_POLL_MIN_MS",
+                                     STAGE_POLL_DEFAULT_MIN_MS);
+    long max_ms = config_get_env_int("HPSS_DSI_STAGE_POLL_MAX_MS",
+                                     STAGE_POLL_DEFAULT_MAX_MS);
+
+    if (min_ms < 1)
+        min_ms = 1;
+    if (max_ms < min_ms)
+        max_ms = min_ms;
+
+    switch (Status)
+    {
+    case HPSS_STAGE_STATUS_UNKNOWN: // Just submitted
+        Delay = min_ms;
+        break;
+    case HPSS_STAGE_STATUS_ACTIVE:
+        Delay = Delay * 2;
+        if (Delay > max_ms / 4)
+            Delay = max_ms / 4;
+        break;
+    default:
+        Delay = Delay * 2;
+        break;
+    }
+
+    if (Delay > max_ms)
+        Delay = max_ms;
+    if (Delay < min_ms)
+        Delay = min_ms;
 
-    // Sleep for 1.0 seconds
+    return stage_jitter_ms(Delay, Seed);
+}
+
+static void
+stage_sleep_ms(long Milliseconds)
+{
     struct timeval tv;
-    tv.tv_sec  = 1;
-    tv.tv_usec = 0;
+    tv.tv_sec  = Milliseconds / 1000;
+    tv.tv_usec = (Milliseconds % 1000) * 1000;
     select(0, NULL, NULL, NULL, &tv);
+}
 
-    return 0;
+/* How often stage_ex() looks in the callback table. */
+#define STAGE_CALLBACK_TICK_MS 100
+
+static pthread_once_t StageCallbacksOnce = PTHREAD_ONCE_INIT;
+static shmtab_t *     StageCallbacks     = NULL;
+
+static void
+stage_callbacks_init()
+{
+    const char *name = getenv("HPSS_DSI_STAGE_CALLBACK_SHM");
+
+    if (!name || *name == '\0')
+        return;
+
+    if (shmtab_open(name, &StageCallbacks))
+    {
+        WARN("Can not open the stage callback table %s, polling instead", name);
+        StageCallbacks = NULL;
+    }
+}
+
+/* Returns NULL unless stage_listener is publishing completed stages. */
+static shmtab_t *
+stage_callbacks()
+{
+    pthread_once(&StageCallbacksOnce, stage_callbacks_init);
+    return StageCallbacks;
+}
+
+void
+stage_request_key(const hpss_reqid_t *RequestID,
+                  unsigned char       Key[SHMTAB_KEY_SIZE])
+{
+    memset(Key, 0, SHMTAB_KEY_SIZE);
+    memcpy(Key,
+           RequestID,
+           sizeof(*RequestID) < SHMTAB_KEY_SIZE ? sizeof(*RequestID)
+                                                : SHMTAB_KEY_SIZE);
+}
+
+/*
+ * Sleeps up to Milliseconds or until Key is published after *Since.
+ * Returns true if it was.
+ */
+static bool
+stage_wait_for_callback(shmtab_t *          Callbacks,
+                        uint64_t *          Since,
+                        const unsigned char Key[SHMTAB_KEY_SIZE],
+                        long                Milliseconds)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1)
+    {
+        uint64_t sequence = shmtab_sequence(Callbacks);
+        bool     found    = shmtab_find(Callbacks, *Since, Key);
+
+        *Since = sequence;
+        if (found)
+            return true;
+
+        long remaining = Milliseconds - stage_elapsed_ms(&start);
+        if (remaining <= 0)
+            return false;
+
+        stage_sleep_ms(remaining < STAGE_CALLBACK_TICK_MS
+                           ? remaining
+                           : STAGE_CALLBACK_TICK_MS);
+    }
+}
+
+/* The stage manager merges requests by bitfile. */
+static void
+stage_manager_key(bitfile_id_t *BitfileID, unsigned char Key[STAGEMGR_KEY_SIZE])
+{
+    unsigned char bytes[UUID_BYTE_COUNT];
+
+    _bitfile_id_to_bytes(BitfileID, bytes);
+    memset(Key, 0, STAGEMGR_KEY_SIZE);
+    memcpy(Key,
+           bytes,
+           UUID_BYTE_COUNT < STAGEMGR_KEY_SIZE ? UUID_BYTE_COUNT
+                                               : STAGEMGR_KEY_SIZE);
+}
+
+// Utils entry point
+globus_result_t
+stage_authorize(const char *  Path,
+                uid_t         UID,
+                const gid_t * Groups,
+                int           GroupCount,
+                unsigned char Key[STAGEMGR_KEY_SIZE])
+{
+    hpss_fileattr_t fileattr;
+    bitfile_id_t    bitfile_id;
+    unsigned32      perms = 0;
+    int             retval;
+
+    memset(&fileattr, 0, sizeof(fileattr));
+    retval = Hpss_FileGetAttributes(Path, &fileattr);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    if (fileattr.Attrs.Type != NS_OBJECT_TYPE_FILE &&
+        fileattr.Attrs.Type != NS_OBJECT_TYPE_HARD_LINK)
+        return GlobusGFSErrorGeneric("Not a regular file");
+
+    perms = fileattr.Attrs.OtherPerms;
+    if (fileattr.Attrs.UID == UID)
+    {
+        perms = fileattr.Attrs.UserPerms;
+    } else
+    {
+        for (int i = 0; i < GroupCount; i++)
+        {
+            if (fileattr.Attrs.GID == Groups[i])
+            {
+                perms = fileattr.Attrs.GroupPerms;
+                break;
+            }
+        }
+    }
+
+    if (UID != 0 && !(perms & NS_PERMS_RD))
+        return GlobusGFSErrorGeneric("Permission denied");
+
+    memcpy(&bitfile_id, &ATTR_TO_BFID(fileattr), sizeof(bitfile_id_t));
+    stage_manager_key(&bitfile_id, Key);
+    return GLOBUS_SUCCESS;
+}
+
+/*
+ * Hands the file to the stage manager. RequestID is the one the manager
+ * submits with.
+ */
+static globus_result_t
+request_stage_from_manager(const char *   Socket,
+                           const char *   Path,
+                           stage_file_t * File,
+                           hpss_reqid_t * RequestID,
+                           int *          Status)
+{
+    globus_result_t    result = GLOBUS_SUCCESS;
+    stagemgr_request_t request;
+    stagemgr_state_t   state;
+    char               task_id[STAGEMGR_TASK_ID_LEN];
+
+    memset(&request, 0, sizeof(request));
+    stage_manager_key(&File->BitfileID, request.Key);
+    request.Pathname = (char *)Path;
+    if (File->Location.Valid)
+    {
+        snprintf(request.Volume, sizeof(request.Volume), "%s", File->Location.Volume);
+        request.Position = File->Location.Position;
+        request.Offset   = File->Location.Offset;
+    }
+
+    result = stagemgr_client_stage(Socket, &request, &state, task_id);
+    if (result)
+        return result;
+
+    DEBUG("Stage manager request for %s is %s", Path, stagemgr_state_name(state));
+
+    if (state == STAGEMGR_FAILED)
+        return GlobusGFSErrorGeneric("The stage manager failed to stage the file");
+
+    _generate_request_id(task_id, &File->BitfileID, 0, 0, RequestID);
+
+    /* Pending or submitted, HPSS has not started on it yet as far as we know. */
+    *Status = HPSS_STAGE_STATUS_QUEUED;
+    return GLOBUS_SUCCESS;
+}
+
+/* Submits a stage request unless this task already has one for the file. */
+static globus_result_t
+request_stage(const char *   Path,
+              const char *   TaskID,
+              stage_file_t * File,
+              hpss_reqid_t * RequestID,
+              int *          Status)
+{
+    globus_result_t result  = GLOBUS_SUCCESS;
+    const char *    manager = getenv("HPSS_DSI_STAGE_MANAGER");
+
+    if (manager && *manager != '\0')
+    {
+        result = request_stage_from_manager(manager, Path, File, RequestID, Status);
+        if (!result)
+            return GLOBUS_SUCCESS;
+
+        WARN("Stage manager %s could not take %s, staging it directly",
+             manager,
+             Path);
+    }
+
+    // Generate request ID
+    _generate_request_id(TaskID, &File->BitfileID, 0, 0, RequestID);
+
+    result = check_request_status(*RequestID, &File->BitfileID, Status);
+    if (result)
+        return result;
+
+    if (*Status == HPSS_STAGE_STATUS_UNKNOWN)
+        return submit_stage_request(
+            Path, *RequestID, 0, File->DataLength, BFS_STAGE_ALL);
+
+    return GLOBUS_SUCCESS;
+}
+
+/*
+ * Submits a stage request for Offset to Offset + Length unless this task
+ * already has one. Partial stages leave the file archived, so the range is
+ * taken to be on disk once a request we submitted is gone and the disk
+ * levels hold at least Length bytes. HPSS does not tell us which bytes
+ * those are. Ranges do not go through the stage manager; it merges
+ * requests per bitfile.
+ */
+static globus_result_t
+request_range_stage(const char *   Path,
+                    const char *   TaskID,
+                    stage_file_t * File,
+                    u_signed64     Offset,
+                    u_signed64     Length,
+                    bool           Submitted,
+                    hpss_reqid_t * RequestID,
+                    int *          Status,
+                    bool *         Staged)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+
+    *Staged = false;
+
+    _generate_request_id(TaskID, &File->BitfileID, Offset, Length, RequestID);
+
+    result = check_request_status(*RequestID, &File->BitfileID, Status);
+    if (result)
+        return result;
+
+    if (*Status != HPSS_STAGE_STATUS_UNKNOWN)
+        return GLOBUS_SUCCESS;
+
+    if (Submitted && ge64(File->DiskBytes, Length))
+    {
+        *Staged = true;
+        return GLOBUS_SUCCESS;
+    }
+
+    return submit_stage_request(Path, *RequestID, Offset, Length, 0);
 }
 
 // Utils entry point
@@ -485,44 +1111,126 @@ stage_ex(
     hpss_reqid_t * RequestID,
     residency_t  * Residency)
 {
-    int             time_elapsed = 0;
-    time_t          start_time   = time(NULL);
-    bitfile_id_t    bitfile_id;
+    return stage_range_ex(Path, 0, -1, Timeout, TaskID, RequestID, Residency);
+}
+
+globus_result_t
+stage_range_ex(
+    const char   * Path,
+    uint64_t       Offset,
+    uint64_t       Length,
+    int            Timeout,
+    const char   * TaskID,
+    hpss_reqid_t * RequestID,
+    residency_t  * Residency)
+{
+    int             polls     = 0;
+    int             callbacks = 0;
+    int             status    = HPSS_STAGE_STATUS_UNKNOWN;
+    long            delay     = 0;
+    long            remaining = 0;
+    bool            ranged    = false;
+    bool            submitted = false;
+    bool            staged    = false;
+    unsigned int    seed      = time(NULL) ^ (uintptr_t)pthread_self();
+    shmtab_t *      table     = stage_callbacks();
+    uint64_t        since     = 0;
+    unsigned char   key[SHMTAB_KEY_SIZE];
+    stage_file_t    file;
+    struct timespec start_time;
     globus_result_t result;
 
-    *Residency = RESIDENCY_ARCHIVED;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-    result = get_bitfile_id(Path, &bitfile_id);
-    if (result)
-        goto cleanup;
+    /* Before the first poll so that no completion is missed. */
+    if (table)
+        since = shmtab_sequence(table);
+
+    *Residency = RESIDENCY_ARCHIVED;
 
-    while (*Residency == RESIDENCY_ARCHIVED && !time_elapsed)
+    /*
+     * One metadata call per poll; it also returns the bitfile ID and the
+     * length needed to submit the request. The last poll is at the timeout.
+     * Only the first poll may be answered from the residency cache; the
+     * rest are waiting for a change.
+     */
+    while (1)
     {
-        result = check_file_residency(Path, Residency);
+        polls++;
+        result = check_file_residency(Path, &file, polls == 1);
         if (result)
             goto cleanup;
+        *Residency = file.Residency;
         if (*Residency != RESIDENCY_ARCHIVED)
             break;
 
-        // Generate request ID
-        _generate_request_id(TaskID, &bitfile_id, RequestID);
-
-        int status;
-        result = check_request_status(*RequestID, &bitfile_id, &status);
-        if (result)
-            goto cleanup;
+        if (polls == 1)
+        {
+            // Clip the range to the file; a range covering it all is a whole file stage
+            if (Offset != 0 && Offset >= file.DataLength)
+            {
+                result = GlobusGFSErrorGeneric("Range starts past the end of the file");
+                goto cleanup;
+            }
+            if (Length > file.DataLength - Offset)
+                Length = file.DataLength - Offset;
+            ranged = Offset != 0 || Length != file.DataLength;
+        }
 
-        if (status == HPSS_STAGE_STATUS_UNKNOWN)
+        if (ranged)
+        {
+            result = request_range_stage(Path,
+                                         TaskID,
+                                         &file,
+                                         Offset,
+                                         Length,
+                                         submitted,
+                                         RequestID,
+                                         &status,
+                                         &staged);
+            if (result)
+                goto cleanup;
+            if (staged)
+            {
+                *Residency = RESIDENCY_RESIDENT;
+                break;
+            }
+            submitted = true;
+        } else
         {
-            result = submit_stage_request(Path, *RequestID);
+            result = request_stage(Path, TaskID, &file, RequestID, &status);
             if (result)
                 goto cleanup;
         }
 
-        time_elapsed = pause_1_second(start_time, Timeout);
+        remaining = Timeout * 1000L - stage_elapsed_ms(&start_time);
+        if (remaining <= 0)
+            break;
+
+        if (table)
+            delay = stage_callback_delay_ms(&seed);
+        else
+            delay = stage_next_delay_ms(delay, status, &seed);
+        if (delay > remaining)
+            delay = remaining;
+
+        if (!table)
+        {
+            stage_sleep_ms(delay);
+            continue;
+        }
+
+        stage_request_key(RequestID, key);
+        if (stage_wait_for_callback(table, &since, key, delay))
+            callbacks++;
     }
 
 cleanup:
+    INFO("Stage of %s took %d polls (%d on callback) in %ld ms",
+         Path,
+         polls,
+         callbacks,
+         stage_elapsed_ms(&start_time));
     return result;
 }
 
@@ -536,16 +1244,28 @@ stage(globus_gfs_operation_t     Operation,
     char *          command_output = NULL;
     globus_result_t result;
 
+    char * task_id = NULL;
+
     result = stage_get_timeout(Operation, CommandInfo, &timeout);
     if (result)
         goto cleanup;
 
-    char * task_id = NULL;
+    uint64_t offset, length;
+    result = stage_get_range(Operation, CommandInfo, &offset, &length);
+    if (result)
+        goto cleanup;
+
     globus_gridftp_server_get_task_id(Operation, &task_id);
 
     hpss_reqid_t request_id;
     residency_t residency;
-    result = stage_ex(CommandInfo->pathname, timeout, task_id, &request_id, &residency);
+    result = stage_range_ex(CommandInfo->pathname,
+                            offset,
+                            length,
+                            timeout,
+                            task_id,
+                            &request_id,
+                            &residency);
     if (result)
         goto cleanup;
 
@@ -558,3 +1278,380 @@ cleanup:
     if (task_id)
         free(task_id);
 }
+
+/*
+ * $HPSS_DSI_BULKSTAGE_CONCURRENCY files of a SITE BULKSTAGE are checked and
+ * staged at once.
+ */
+#define BULKSTAGE_DEFAULT_CONCURRENCY 16
+
+typedef struct
+{
+    char *          Name;     // As sent by the client
+    char *          Pathname; // Decoded and joined to the directory
+    globus_result_t Result;
+    stage_file_t    File;
+} bulk_stage_entry_t;
+
+typedef struct
+{
+    int             Timeout; // For the whole command
+    struct timespec Start;
+    char *          TaskID;
+
+    bulk_stage_entry_t *Entries;
+    int                 Count;
+
+    pthread_mutex_t Lock;
+    int             Next; // Next entry for the workers
+    int             Workers;
+} bulk_stage_t;
+
+static void
+bulk_stage_destroy(bulk_stage_t *Bulk)
+{
+    for (int i = 0; i < Bulk->Count; i++)
+    {
+        free(Bulk->Entries[i].Name);
+        free(Bulk->Entries[i].Pathname);
+    }
+    free(Bulk->Entries);
+    if (Bulk->TaskID)
+        free(Bulk->TaskID);
+    pthread_mutex_destroy(&Bulk->Lock);
+    free(Bulk);
+}
+
+static globus_result_t
+bulk_stage_parse(bulk_stage_t *Bulk, const char *Names, const char *Directory)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    const char *    name   = Names;
+
+    Bulk->Count = 1;
+    for (const char *c = Names; *c; c++)
+    {
+        if (*c == ',')
+            Bulk->Count++;
+    }
+
+    Bulk->Entries = calloc(Bulk->Count, sizeof(bulk_stage_entry_t));
+    if (!Bulk->Entries)
+        return GlobusGFSErrorMemory("bulk_stage_entry_t");
+
+    for (int i = 0; i < Bulk->Count; i++)
+    {
+        size_t length = strcspn(name, ",");
+
+        Bulk->Entries[i].Name = strndup(name, length);
+        if (!Bulk->Entries[i].Name)
+            return GlobusGFSErrorMemory("name");
+
+        result = commands_list_pathname(
+            Directory, name, length, &Bulk->Entries[i].Pathname);
+        if (result)
+            return result;
+
+        name += length + 1;
+    }
+    return GLOBUS_SUCCESS;
+}
+
+static char *
+bulk_stage_output(bulk_stage_t *Bulk)
+{
+    const char *status    = NULL;
+    size_t      length    = 128;
+    int         counts[4] = {0};
+    char *      output    = NULL;
+    char *      next      = NULL;
+
+    for (int i = 0; i < Bulk->Count; i++)
+        length += strlen(Bulk->Entries[i].Name) + 16;
+
+    output = globus_malloc(length);
+    if (!output)
+        return NULL;
+
+    next = output + sprintf(output, "250-Staged %d files\r\n", Bulk->Count);
+
+    for (int i = 0; i < Bulk->Count; i++)
+    {
+        bulk_stage_entry_t *entry = &Bulk->Entries[i];
+
+        if (entry->Result)
+        {
+            status = "ERROR";
+            counts[3]++;
+        } else if (entry->File.Residency == RESIDENCY_RESIDENT)
+        {
+            status = "RESIDENT";
+            counts[0]++;
+        } else if (entry->File.Residency == RESIDENCY_TAPE_ONLY)
+        {
+            status = "TAPE_ONLY";
+            counts[1]++;
+        } else
+        {
+            status = "ARCHIVED";
+            counts[2]++;
+        }
+
+        next += sprintf(next, " %s %s\r\n", status, entry->Name);
+    }
+
+    sprintf(next,
+            "250 %d resident, %d tape only, %d archived, %d failed.\r\n",
+            counts[0],
+            counts[1],
+            counts[2],
+            counts[3]);
+    return output;
+}
+
+/* Returns the next entry without an error or NULL when there are none. */
+static bulk_stage_entry_t *
+bulk_stage_next(bulk_stage_t *Bulk)
+{
+    bulk_stage_entry_t *entry = NULL;
+
+    pthread_mutex_lock(&Bulk->Lock);
+    {
+        while (!entry && Bulk->Next < Bulk->Count)
+        {
+            entry = &Bulk->Entries[Bulk->Next++];
+            if (entry->Result)
+                entry = NULL;
+        }
+    }
+    pthread_mutex_unlock(&Bulk->Lock);
+    return entry;
+}
+
+static void *
+bulk_stage_locate_worker(void *Arg)
+{
+    bulk_stage_t *      bulk  = Arg;
+    bulk_stage_entry_t *entry = NULL;
+
+    while ((entry = bulk_stage_next(bulk)))
+    {
+        entry->Result =
+            check_file_residency(entry->Pathname, &entry->File, true);
+    }
+    return NULL;
+}
+
+static void *
+bulk_stage_poll_worker(void *Arg)
+{
+    bulk_stage_t *      bulk  = Arg;
+    bulk_stage_entry_t *entry = NULL;
+    hpss_reqid_t        request_id;
+
+    while ((entry = bulk_stage_next(bulk)))
+    {
+        /* Past the deadline, files are still checked once. */
+        long remaining = bulk->Timeout - stage_elapsed_ms(&bulk->Start) / 1000;
+        if (remaining < 0)
+            remaining = 0;
+
+        entry->Result = stage_ex(entry->Pathname,
+                                 remaining,
+                                 bulk->TaskID,
+                                 &request_id,
+                                 &entry->File.Residency);
+    }
+    return NULL;
+}
+
+/*
+ * Runs Worker over every entry without an error on Bulk->Workers threads,
+ * this one included, and waits for them.
+ */
+static void
+bulk_stage_run(bulk_stage_t *Bulk, void *(*Worker)(void *Arg))
+{
+    pthread_t threads[Bulk->Workers];
+    int       launched = 0;
+
+    Bulk->Next = 0;
+
+    for (launched = 0; launched < Bulk->Workers - 1; launched++)
+    {
+        if (pio_launch_attached(Worker, Bulk, &threads[launched]))
+            break;
+    }
+
+    Worker(Bulk);
+
+    for (int i = 0; i < launched; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static int
+bulk_stage_compare(const void *A, const void *B)
+{
+    const tape_location_t *a =
+        &(*(bulk_stage_entry_t *const *)A)->File.Location;
+    const tape_location_t *b =
+        &(*(bulk_stage_entry_t *const *)B)->File.Location;
+    int                    rc = 0;
+
+    /* Files without a known location go last. */
+    if (a->Valid != b->Valid)
+        return a->Valid ? -1 : 1;
+
+    if ((rc = strcmp(a->Volume, b->Volume)))
+        return rc;
+    if (a->Position != b->Position)
+        return a->Position < b->Position ? -1 : 1;
+    if (a->Offset != b->Offset)
+        return a->Offset < b->Offset ? -1 : 1;
+    return 0;
+}
+
+/* Mounts needed to read the files in this order, one per change of volume. */
+static int
+bulk_stage_count_mounts(bulk_stage_entry_t **Files, int Count)
+{
+    int mounts = 0;
+
+    for (int i = 0; i < Count; i++)
+    {
+        if (!Files[i]->File.Location.Valid)
+            continue;
+        if (i == 0 || !Files[i - 1]->File.Location.Valid ||
+            strcmp(Files[i]->File.Location.Volume, Files[i - 1]->File.Location.Volume))
+            mounts++;
+    }
+    return mounts;
+}
+
+/*
+ * Submits the stage requests of all archived files before any are waited
+ * on. With TapeOrder, they are grouped by volume and in order of position
+ * on each volume, rather than in the order that they were asked for, so
+ * that each cartridge is mounted once and read forward. stage_ex() then
+ * finds these requests already queued.
+ */
+static void
+bulk_stage_submit(bulk_stage_t *Bulk, bool TapeOrder)
+{
+    bulk_stage_entry_t **files    = NULL;
+    int                  count    = 0;
+    int                  unsorted = 0;
+    int                  sorted   = 0;
+    int                  status   = 0;
+    hpss_reqid_t         request_id;
+
+    files = malloc(Bulk->Count * sizeof(*files));
+    if (!files)
+        return;
+
+    for (int i = 0; i < Bulk->Count; i++)
+    {
+        bulk_stage_entry_t *entry = &Bulk->Entries[i];
+        if (!entry->Result && entry->File.Residency == RESIDENCY_ARCHIVED)
+            files[count++] = entry;
+    }
+
+    unsorted = bulk_stage_count_mounts(files, count);
+    if (TapeOrder)
+        qsort(files, count, sizeof(*files), bulk_stage_compare);
+    sorted = bulk_stage_count_mounts(files, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        files[i]->Result = request_stage(files[i]->Pathname,
+                                         Bulk->TaskID,
+                                         &files[i]->File,
+                                         &request_id,
+                                         &status);
+    }
+
+    if (count > 0 && TapeOrder)
+        INFO("Submitted %d stage requests on %d volumes in tape order, "
+             "saving up to %d mounts",
+             count,
+             sorted,
+             unsorted - sorted);
+    else if (count > 0)
+        INFO("Submitted %d stage requests", count);
+
+    free(files);
+}
+
+// DSI entry point
+void
+stage_bulk(globus_gfs_operation_t     Operation,
+           globus_gfs_command_info_t *CommandInfo,
+           commands_callback          Callback)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    bulk_stage_t *  bulk   = NULL;
+    char *          output = NULL;
+    char **         argv   = NULL;
+    int             argc   = 0;
+
+    result = globus_gridftp_server_query_op_info(Operation,
+                                                 CommandInfo->op_info,
+                                                 GLOBUS_GFS_OP_INFO_CMD_ARGS,
+                                                 &argv,
+                                                 &argc);
+    if (result)
+    {
+        result = GlobusGFSErrorWrapFailed("Unable to get command args", result);
+        goto cleanup;
+    }
+
+    bulk = calloc(1, sizeof(bulk_stage_t));
+    if (!bulk)
+    {
+        result = GlobusGFSErrorMemory("bulk_stage_t");
+        goto cleanup;
+    }
+    pthread_mutex_init(&bulk->Lock, NULL);
+
+    if (sscanf(argv[2], "%d", &bulk->Timeout) != 1)
+    {
+        result = GlobusGFSErrorGeneric("Illegal timeout value");
+        goto cleanup;
+    }
+
+    result = bulk_stage_parse(bulk, argv[3], CommandInfo->pathname);
+    if (result)
+        goto cleanup;
+
+    globus_gridftp_server_get_task_id(Operation, &bulk->TaskID);
+
+    bulk->Workers = config_get_env_int("HPSS_DSI_BULKSTAGE_CONCURRENCY",
+                                       BULKSTAGE_DEFAULT_CONCURRENCY);
+    if (bulk->Workers > bulk->Count)
+        bulk->Workers = bulk->Count;
+    if (bulk->Workers < 1)
+        bulk->Workers = 1;
+
+    DEBUG("Staging %d files in %s with %d workers",
+          bulk->Count,
+          CommandInfo->pathname,
+          bulk->Workers);
+
+    /* One deadline for all files, not one per file. */
+    clock_gettime(CLOCK_MONOTONIC, &bulk->Start);
+
+    bulk_stage_run(bulk, bulk_stage_locate_worker);
+    bulk_stage_submit(bulk, config_get_env_int("HPSS_DSI_STAGE_TAPE_ORDER", 1));
+    bulk_stage_run(bulk, bulk_stage_poll_worker);
+
+    output = bulk_stage_output(bulk);
+    if (!output)
+        result = GlobusGFSErrorMemory("bulk stage output");
+
+cleanup:
+    Callback(Operation, result, output);
+    if (output)
+        globus_free(output);
+    if (bulk)
+        bulk_stage_destroy(bulk);
+}
@@ -11,6 +11,8 @@
  */
 #include "hpss.h"
 #include "commands.h"
+#include "shmtab.h"
+#include "stagemgr.h"
 
 typedef enum
 {
@@ -25,6 +27,27 @@ stage(globus_gfs_operation_t      Operation,
       globus_gfs_command_info_t * CommandInfo,
       commands_callback           Callback);
 
+/*
+ * SITE BULKSTAGE <sp> timeout <sp> name[,name...] <sp> directory
+ *
+ * Stages several files in 'directory' at once; see commands_list_pathname()
+ * for the name list. The stage requests of all archived files are submitted
+ * in tape order first, then up to $HPSS_DSI_BULKSTAGE_CONCURRENCY files are
+ * waited on at a time, each as SITE STAGE would, until 'timeout' seconds
+ * after the command started. Replies with one line per file, in the order
+ * given, of RESIDENT, TAPE_ONLY, ARCHIVED (still being retrieved) or ERROR
+ * followed by the name as it was sent.
+ */
+void
+stage_bulk(globus_gfs_operation_t      Operation,
+           globus_gfs_command_info_t * CommandInfo,
+           commands_callback           Callback);
+
+/* The stage callback table key of a request. */
+void
+stage_request_key(const hpss_reqid_t *RequestID,
+                  unsigned char       Key[SHMTAB_KEY_SIZE]);
+
 // Utils entry point
 globus_result_t
 stage_ex(
@@ -34,4 +57,34 @@ stage_ex(
     hpss_reqid_t * RequestID,
     residency_t  * Residency);
 
+/*
+ * For the stage manager. Fills Key with the key the manager merges requests
+ * for Path by if the local account UID, a member of Groups, may read the
+ * file. Only the file's own permission bits are checked, not ACLs or the
+ * directories above it.
+ */
+globus_result_t
+stage_authorize(const char *  Path,
+                uid_t         UID,
+                const gid_t * Groups,
+                int           GroupCount,
+                unsigned char Key[STAGEMGR_KEY_SIZE]);
+
+/*
+ * Like stage_ex() but only stages Length bytes at Offset; Length -1 stages
+ * to the end of the file. Reports RESIDENCY_RESIDENT once the range is
+ * thought to be on disk even though the rest of the file may not be; see
+ * request_range_stage(). Ranges covering the whole file are staged as
+ * stage_ex() does; ranges starting past its end are an error.
+ */
+globus_result_t
+stage_range_ex(
+    const char   * Path,
+    uint64_t       Offset,
+    uint64_t       Length,
+    int            Timeout,
+    const char   * TaskID,
+    hpss_reqid_t * RequestID,
+    residency_t  * Residency);
+
 #endif /* HPSS_DSI_STAGE_H */
@@ -0,0 +1,536 @@
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "stagemgr.h"
+
+#define STAGEMGR_BUCKETS 4096
+
+struct stagemgr
+{
+    stagemgr_config_t   Config;
+    stagemgr_request_t *Buckets[STAGEMGR_BUCKETS];
+    int                 Counts[STAGEMGR_STATE_COUNT];
+
+    /* Submitted requests; never more than Config.GlobalLimit. */
+    stagemgr_request_t **Active;
+    int                  ActiveCount;
+};
+
+static const char *StateNames[] = {"PENDING", "SUBMITTED", "DONE", "FAILED"};
+
+const char *
+stagemgr_state_name(stagemgr_state_t State)
+{
+    if (State < 0 || State >= STAGEMGR_STATE_COUNT)
+        return "UNKNOWN";
+    return StateNames[State];
+}
+
+globus_result_t
+stagemgr_create(const stagemgr_config_t *Config, stagemgr_t **Manager)
+{
+    stagemgr_t *manager = NULL;
+
+    *Manager = NULL;
+
+    if (Config->GlobalLimit < 1 || Config->VolumeLimit < 1 || !Config->Stage)
+        return GlobusGFSErrorGeneric("Illegal stage manager configuration");
+
+    manager = calloc(1, sizeof(stagemgr_t));
+    if (!manager)
+        return GlobusGFSErrorMemory("stagemgr_t");
+
+    manager->Config = *Config;
+    manager->Active = calloc(Config->GlobalLimit, sizeof(stagemgr_request_t *));
+    if (!manager->Active)
+    {
+        free(manager);
+        return GlobusGFSErrorMemory("stagemgr_t");
+    }
+
+    *Manager = manager;
+    return GLOBUS_SUCCESS;
+}
+
+static void
+stagemgr_free_request(stagemgr_request_t *Request)
+{
+    free(Request->Pathname);
+    free(Request);
+}
+
+void
+stagemgr_destroy(stagemgr_t *Manager)
+{
+    if (!Manager)
+        return;
+
+    for (int i = 0; i < STAGEMGR_BUCKETS; i++)
+    {
+        while (Manager->Buckets[i])
+        {
+            stagemgr_request_t *request = Manager->Buckets[i];
+            Manager->Buckets[i]         = request->Next;
+            stagemgr_free_request(request);
+        }
+    }
+    free(Manager->Active);
+    free(Manager);
+}
+
+/* FNV-1a */
+static stagemgr_request_t **
+stagemgr_bucket(stagemgr_t *Manager, const unsigned char Key[STAGEMGR_KEY_SIZE])
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < STAGEMGR_KEY_SIZE; i++)
+    {
+        hash ^= Key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return &Manager->Buckets[hash % STAGEMGR_BUCKETS];
+}
+
+static void
+stagemgr_set_state(stagemgr_t *         Manager,
+                   stagemgr_request_t * Request,
+                   stagemgr_state_t     State)
+{
+    Manager->Counts[Request->State]--;
+    Manager->Counts[State]++;
+    Request->State = State;
+}
+
+static void
+stagemgr_set_location(stagemgr_request_t *To, const stagemgr_request_t *From)
+{
+    memcpy(To->Volume, From->Volume, sizeof(To->Volume));
+    To->Volume[sizeof(To->Volume) - 1] = '\0';
+    To->Position                       = From->Position;
+    To->Offset                         = From->Offset;
+}
+
+globus_result_t
+stagemgr_add(stagemgr_t *               Manager,
+             const stagemgr_request_t * Request,
+             int64_t                    Now,
+             stagemgr_state_t *         State)
+{
+    stagemgr_request_t **bucket  = stagemgr_bucket(Manager, Request->Key);
+    stagemgr_request_t * request = NULL;
+
+    for (request = *bucket; request; request = request->Next)
+    {
+        if (memcmp(request->Key, Request->Key, STAGEMGR_KEY_SIZE) == 0)
+            break;
+    }
+
+    if (request)
+    {
+        /* The same bitfile may be reached through another link or name. */
+        if (strcmp(request->Pathname, Request->Pathname))
+        {
+            char *pathname = strdup(Request->Pathname);
+            if (!pathname)
+                return GlobusGFSErrorMemory("pathname");
+            free(request->Pathname);
+            request->Pathname = pathname;
+        }
+
+        /* Sessions only ask for archived files; it was purged again. */
+        if (request->State == STAGEMGR_DONE || request->State == STAGEMGR_FAILED)
+        {
+            stagemgr_set_state(Manager, request, STAGEMGR_PENDING);
+            stagemgr_set_location(request, Request);
+            request->Queued = Now;
+        }
+
+        request->Asks++;
+        request->LastUpdate = Now;
+        *State              = request->State;
+        return GLOBUS_SUCCESS;
+    }
+
+    request = calloc(1, sizeof(stagemgr_request_t));
+    if (!request)
+        return GlobusGFSErrorMemory("stagemgr_request_t");
+
+    request->Pathname = strdup(Request->Pathname);
+    if (!request->Pathname)
+    {
+        free(request);
+        return GlobusGFSErrorMemory("pathname");
+    }
+
+    memcpy(request->Key, Request->Key, STAGEMGR_KEY_SIZE);
+    stagemgr_set_location(request, Request);
+    request->State      = STAGEMGR_PENDING;
+    request->Asks       = 1;
+    request->Queued     = Now;
+    request->LastUpdate = Now;
+    request->Next       = *bucket;
+    *bucket             = request;
+
+    Manager->Counts[STAGEMGR_PENDING]++;
+    *State = STAGEMGR_PENDING;
+    return GLOBUS_SUCCESS;
+}
+
+static void
+stagemgr_check(stagemgr_t *Manager, int64_t Now)
+{
+    for (int i = 0; i < Manager->ActiveCount; i++)
+    {
+        stagemgr_request_t *request = Manager->Active[i];
+
+        if (request->NextCheck > Now)
+            continue;
+
+        stagemgr_state_t state =
+            Manager->Config.Stage(Manager->Config.Arg, request);
+
+        if (state == STAGEMGR_SUBMITTED)
+        {
+            request->NextCheck = Now + Manager->Config.CheckMS;
+            continue;
+        }
+
+        stagemgr_set_state(Manager, request, state);
+        request->LastUpdate = Now;
+        Manager->Active[i--] = Manager->Active[--Manager->ActiveCount];
+    }
+}
+
+/* Groups requests by volume in order of position; unknown locations last. */
+static int
+stagemgr_compare(const void *A, const void *B)
+{
+    const stagemgr_request_t *a  = *(stagemgr_request_t *const *)A;
+    const stagemgr_request_t *b  = *(stagemgr_request_t *const *)B;
+    int                       rc = 0;
+
+    if (!a->Volume[0] != !b->Volume[0])
+        return a->Volume[0] ? -1 : 1;
+    if ((rc = strcmp(a->Volume, b->Volume)))
+        return rc;
+    if (a->Position != b->Position)
+        return a->Position < b->Position ? -1 : 1;
+    if (a->Offset != b->Offset)
+        return a->Offset < b->Offset ? -1 : 1;
+    if (a->Queued != b->Queued)
+        return a->Queued < b->Queued ? -1 : 1;
+    return 0;
+}
+
+static int
+stagemgr_volume_active(stagemgr_t *Manager, const char *Volume)
+{
+    int count = 0;
+
+    for (int i = 0; i < Manager->ActiveCount; i++)
+    {
+        if (strcmp(Manager->Active[i]->Volume, Volume) == 0)
+            count++;
+    }
+    return count;
+}
+
+/*
+ * New requests wait up to BatchMS so that requests for the same volume
+ * arrive together and are submitted in order. A batch is cut short once
+ * there are enough pending requests to fill every free slot.
+ */
+static void
+stagemgr_schedule(stagemgr_t *Manager, int64_t Now)
+{
+    stagemgr_request_t **pending = NULL;
+    int                  count   = 0;
+    int64_t              oldest  = Now;
+    int                  slots   = Manager->Config.GlobalLimit - Manager->ActiveCount;
+
+    if (Manager->Counts[STAGEMGR_PENDING] == 0 || slots <= 0)
+        return;
+
+    pending = malloc(Manager->Counts[STAGEMGR_PENDING] * sizeof(*pending));
+    if (!pending)
+        return;
+
+    for (int i = 0; i < STAGEMGR_BUCKETS; i++)
+    {
+        for (stagemgr_request_t *r = Manager->Buckets[i]; r; r = r->Next)
+        {
+            if (r->State != STAGEMGR_PENDING)
+                continue;
+            pending[count++] = r;
+            if (r->Queued < oldest)
+                oldest = r->Queued;
+        }
+    }
+
+    if (oldest + Manager->Config.BatchMS > Now && count < slots)
+        goto cleanup;
+
+    qsort(pending, count, sizeof(*pending), stagemgr_compare);
+
+    for (int i = 0; i < count; i++)
+    {
+        stagemgr_request_t *request = pending[i];
+
+        if (Manager->ActiveCount >= Manager->Config.GlobalLimit)
+            break;
+
+        if (request->Volume[0] &&
+            stagemgr_volume_active(Manager, request->Volume) >=
+                Manager->Config.VolumeLimit)
+            continue;
+
+        request->Submitted  = Now;
+        request->LastUpdate = Now;
+
+        stagemgr_state_t state =
+            Manager->Config.Stage(Manager->Config.Arg, request);
+
+        stagemgr_set_state(Manager, request, state);
+        if (state == STAGEMGR_SUBMITTED)
+        {
+            request->NextCheck = Now + Manager->Config.CheckMS;
+            Manager->Active[Manager->ActiveCount++] = request;
+        }
+    }
+
+cleanup:
+    free(pending);
+}
+
+/* Submitted requests are kept until HPSS is done with them. */
+static void
+stagemgr_expire(stagemgr_t *Manager, int64_t Now)
+{
+    for (int i = 0; i < STAGEMGR_BUCKETS; i++)
+    {
+        stagemgr_request_t **next = &Manager->Buckets[i];
+
+        while (*next)
+        {
+            stagemgr_request_t *request = *next;
+
+            if (request->State == STAGEMGR_SUBMITTED ||
+                request->LastUpdate + Manager->Config.KeepMS > Now)
+            {
+                next = &request->Next;
+                continue;
+            }
+
+            *next = request->Next;
+            Manager->Counts[request->State]--;
+            stagemgr_free_request(request);
+        }
+    }
+}
+
+void
+stagemgr_tick(stagemgr_t *Manager, int64_t Now)
+{
+    /* Checks first so that finished stages free their slots. */
+    stagemgr_check(Manager, Now);
+    stagemgr_schedule(Manager, Now);
+    stagemgr_expire(Manager, Now);
+}
+
+void
+stagemgr_counts(stagemgr_t *Manager, int Counts[STAGEMGR_STATE_COUNT])
+{
+    memcpy(Counts, Manager->Counts, sizeof(Manager->Counts));
+}
+
+static int
+stagemgr_hex_value(char C)
+{
+    if (C >= '0' && C <= '9')
+        return C - '0';
+    if (C >= 'a' && C <= 'f')
+        return C - 'a' + 10;
+    if (C >= 'A' && C <= 'F')
+        return C - 'A' + 10;
+    return -1;
+}
+
+int
+stagemgr_parse_request(char *Line, stagemgr_request_t *Request)
+{
+    char *fields[4];
+    char *next = Line + strlen("STAGE ");
+    char *end  = NULL;
+
+    memset(Request, 0, sizeof(*Request));
+
+    if (strncmp(Line, "STAGE ", strlen("STAGE ")))
+        return -1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char *space = strchr(next, ' ');
+        if (!space)
+            return -1;
+        *space    = '\0';
+        fields[i] = next;
+        next      = space + 1;
+    }
+
+    Request->Pathname = next;
+    Request->Pathname[strcspn(Request->Pathname, "\r\n")] = '\0';
+    if (*Request->Pathname == '\0')
+        return -1;
+
+    if (strlen(fields[0]) != STAGEMGR_KEY_SIZE * 2)
+        return -1;
+    for (int i = 0; i < STAGEMGR_KEY_SIZE; i++)
+    {
+        int high = stagemgr_hex_value(fields[0][i * 2]);
+        int low  = stagemgr_hex_value(fields[0][i * 2 + 1]);
+        if (high < 0 || low < 0)
+            return -1;
+        Request->Key[i] = high << 4 | low;
+    }
+
+    if (strcmp(fields[1], "-"))
+    {
+        if (strlen(fields[1]) >= sizeof(Request->Volume))
+            return -1;
+        strcpy(Request->Volume, fields[1]);
+    }
+
+    Request->Position = strtoll(fields[2], &end, 10);
+    if (*end != '\0')
+        return -1;
+    Request->Offset = strtoull(fields[3], &end, 10);
+    if (*end != '\0')
+        return -1;
+
+    return 0;
+}
+
+/* Don't let a stuck manager hold up the session. */
+#define STAGEMGR_CLIENT_TIMEOUT_SECS 5
+
+globus_result_t
+stagemgr_client_stage(const char *               Socket,
+                      const stagemgr_request_t * Request,
+                      stagemgr_state_t *         State,
+                      char                       TaskID[STAGEMGR_TASK_ID_LEN])
+{
+    globus_result_t    result  = GLOBUS_SUCCESS;
+    int                fd      = -1;
+    char *             line    = NULL;
+    size_t             length  = 0;
+    char               reply[128];
+    char               state[16];
+    struct sockaddr_un address;
+    struct timeval     timeout = {.tv_sec = STAGEMGR_CLIENT_TIMEOUT_SECS};
+
+    if (strchr(Request->Pathname, '\n') ||
+        strlen(Socket) >= sizeof(address.sun_path))
+        return GlobusGFSErrorGeneric("Can not send this request to the stage manager");
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Socket);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return GlobusGFSErrorSystemError("socket", errno);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+    {
+        result = GlobusGFSErrorSystemError("connect", errno);
+        goto cleanup;
+    }
+
+    length = strlen(Request->Pathname) + sizeof(Request->Volume) + 128;
+    line   = malloc(length);
+    if (!line)
+    {
+        result = GlobusGFSErrorMemory("stage manager request");
+        goto cleanup;
+    }
+
+    length = sprintf(line, "STAGE ");
+    for (int i = 0; i < STAGEMGR_KEY_SIZE; i++)
+        length += sprintf(line + length, "%02x", Request->Key[i]);
+    length += sprintf(line + length,
+                      " %s %lld %llu %s\n",
+                      Request->Volume[0] && !strchr(Request->Volume, ' ')
+                          ? Request->Volume
+                          : "-",
+                      (long long)Request->Position,
+                      (unsigned long long)Request->Offset,
+                      Request->Pathname);
+
+    for (size_t sent = 0; sent < length;)
+    {
+        ssize_t rc = write(fd, line + sent, length - sent);
+        if (rc <= 0)
+        {
+            result = GlobusGFSErrorSystemError("write", errno);
+            goto cleanup;
+        }
+        sent += rc;
+    }
+
+    length = 0;
+    while (length < sizeof(reply) - 1 && !memchr(reply, '\n', length))
+    {
+        ssize_t rc = read(fd, reply + length, sizeof(reply) - 1 - length);
+        if (rc <= 0)
+        {
+            result = GlobusGFSErrorGeneric("No reply from the stage manager");
+            goto cleanup;
+        }
+        length += rc;
+    }
+    reply[length] = '\0';
+    reply[strcspn(reply, "\r\n")] = '\0';
+
+    if (strncmp(reply, "ERROR ", strlen("ERROR ")) == 0)
+    {
+        result = GlobusGFSErrorGeneric(reply + strlen("ERROR "));
+        goto cleanup;
+    }
+
+    if (sscanf(reply, "%15s %36s", state, TaskID) != 2 ||
+        strlen(TaskID) != STAGEMGR_TASK_ID_LEN - 1)
+    {
+        result = GlobusGFSErrorGeneric("Illegal reply from the stage manager");
+        goto cleanup;
+    }
+
+    for (*State = 0; *State < STAGEMGR_STATE_COUNT; (*State)++)
+    {
+        if (strcmp(state, StateNames[*State]) == 0)
+            break;
+    }
+    if (*State == STAGEMGR_STATE_COUNT)
+        result = GlobusGFSErrorGeneric("Illegal reply from the stage manager");
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    free(line);
+    return result;
+}
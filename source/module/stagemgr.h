@@ -0,0 +1,129 @@
+#ifndef HPSS_DSI_STAGEMGR_H
+#define HPSS_DSI_STAGEMGR_H
+
+/*
+ * System includes
+ */
+#include <stdint.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * The stage manager is a long lived process (source/utils/stage_manager)
+ * that submits stage requests on behalf of the GridFTP processes on a node.
+ * Sessions hand it their archived files over the Unix socket named by
+ * $HPSS_DSI_STAGE_MANAGER. It keeps one request per bitfile no matter how
+ * many sessions ask, collects new requests for a short while and submits
+ * them in tape order while holding the number of outstanding stages under
+ * a global and a per volume limit. Its state outlives the sessions.
+ *
+ * The scheduling lives here so that it can be tested without HPSS; the
+ * manager supplies the function that actually stages a file.
+ */
+#define STAGEMGR_KEY_SIZE    16
+#define STAGEMGR_TASK_ID_LEN 37 // UUID string and NUL
+
+typedef enum
+{
+    STAGEMGR_PENDING,   // Waiting for its batch or for a free slot
+    STAGEMGR_SUBMITTED, // Stage requested from HPSS
+    STAGEMGR_DONE,      // No longer archived
+    STAGEMGR_FAILED,
+    STAGEMGR_STATE_COUNT
+} stagemgr_state_t;
+
+typedef struct stagemgr_request
+{
+    unsigned char Key[STAGEMGR_KEY_SIZE]; // Bitfile ID
+    char *        Pathname;
+    char          Volume[64]; // Empty when unknown
+    int64_t       Position;
+    uint64_t      Offset;
+
+    /* Kept by the manager. Times are in milliseconds. */
+    stagemgr_state_t         State;
+    int                      Asks; // Times sessions asked for it
+    int64_t                  Queued;
+    int64_t                  Submitted;
+    int64_t                  NextCheck;
+    int64_t                  LastUpdate; // Last ask or state change
+    struct stagemgr_request *Next;
+} stagemgr_request_t;
+
+/*
+ * Called to submit a request and again every CheckMS while it is
+ * submitted. Returns the request's new state: STAGEMGR_SUBMITTED while the
+ * file is still archived, otherwise STAGEMGR_DONE or STAGEMGR_FAILED.
+ */
+typedef stagemgr_state_t (*stagemgr_stage_fn)(void *               Arg,
+                                              stagemgr_request_t * Request);
+
+typedef struct
+{
+    int     GlobalLimit; // Outstanding stages
+    int     VolumeLimit; // Outstanding stages per tape volume
+    int64_t BatchMS;     // How long new requests wait for company
+    int64_t CheckMS;     // Between checks of a submitted request
+    int64_t KeepMS;      // How long idle and finished requests are kept
+
+    stagemgr_stage_fn Stage;
+    void *            Arg;
+} stagemgr_config_t;
+
+typedef struct stagemgr stagemgr_t;
+
+globus_result_t
+stagemgr_create(const stagemgr_config_t *Config, stagemgr_t **Manager);
+
+/*
+ * Adds Request, or another ask for the same bitfile, and returns its
+ * state. Finished requests that are asked for again are queued again.
+ */
+globus_result_t
+stagemgr_add(stagemgr_t *               Manager,
+             const stagemgr_request_t * Request,
+             int64_t                    Now,
+             stagemgr_state_t *         State);
+
+/* Submits due batches, checks submitted requests and forgets old ones. */
+void
+stagemgr_tick(stagemgr_t *Manager, int64_t Now);
+
+void
+stagemgr_counts(stagemgr_t *Manager, int Counts[STAGEMGR_STATE_COUNT]);
+
+void
+stagemgr_destroy(stagemgr_t *Manager);
+
+const char *
+stagemgr_state_name(stagemgr_state_t State);
+
+/*
+ * Protocol: one request per connection. The client sends
+ *
+ *   STAGE <key as hex> <volume or -> <position> <offset> <pathname>\n
+ *
+ * and the manager answers with the request's state followed by the task ID
+ * it uses to build HPSS request IDs so that the client can compute them:
+ *
+ *   <PENDING|SUBMITTED|DONE|FAILED> <task id>\n
+ *
+ * or "ERROR <message>\n". "STATUS\n" returns the number of requests in
+ * each state. The manager looks up the key itself when it checks that the
+ * client may read the file; the client's key is only used in stand-in mode.
+ */
+
+/* Parses a STAGE line in place; Request->Pathname points into Line. */
+int
+stagemgr_parse_request(char *Line, stagemgr_request_t *Request);
+
+globus_result_t
+stagemgr_client_stage(const char *               Socket,
+                      const stagemgr_request_t * Request,
+                      stagemgr_state_t *         State,
+                      char                       TaskID[STAGEMGR_TASK_ID_LEN]);
+
+#endif /* HPSS_DSI_STAGEMGR_H */
@@ -6,9 +6,35 @@
 /*
  * Local includes
  */
+#include "aggregate.h"
+#include "logging.h"
 #include "stat.h"
 #include "hpss.h"
 
+/*
+ * Aggregate members report the size of their data, not the placeholder. A
+ * placeholder whose index can not be read, or is not believed, is listed
+ * as the empty file it is; reading it reports the error.
+ */
+static globus_result_t
+stat_member_size(char *Pathname, hpss_stat_t *HpssStat)
+{
+    aggregate_member_t member;
+
+    globus_result_t result = aggregate_lookup(Pathname, HpssStat, &member);
+    if (result)
+    {
+        DEBUG("Listing %s as an empty file, its aggregate index is unusable",
+              Pathname);
+        return GLOBUS_SUCCESS;
+    }
+
+    if (member.Container)
+        HpssStat->st_size = member.Length;
+    aggregate_member_destroy(&member);
+    return GLOBUS_SUCCESS;
+}
+
 globus_result_t
 stat_translate_stat(char *             Pathname,
                     hpss_stat_t *      HpssStat,
@@ -79,6 +105,10 @@ stat_object(char *Pathname, globus_gfs_stat_t *GFSStat)
     int retval = Hpss_Stat(Pathname, &hpss_stat_buf);
     if (retval)
         return hpss_error_to_globus_result(retval);
+
+    globus_result_t result = stat_member_size(Pathname, &hpss_stat_buf);
+    if (result)
+        return result;
     return stat_translate_stat(Pathname, &hpss_stat_buf, GFSStat);
 }
 
@@ -91,6 +121,10 @@ stat_link(char *Pathname, globus_gfs_stat_t *GFSStat)
     int         retval = Hpss_Lstat(Pathname, &hpss_stat_buf);
     if (retval)
         return hpss_error_to_globus_result(retval);
+
+    globus_result_t result = stat_member_size(Pathname, &hpss_stat_buf);
+    if (result)
+        return result;
     return stat_translate_stat(Pathname, &hpss_stat_buf, GFSStat);
 }
 
@@ -194,6 +228,27 @@ stat_translate_dir_entry(ns_ObjHandle_t *   ParentObjHandle,
     return GLOBUS_SUCCESS;
 }
 
+static globus_result_t
+stat_dir_entry_member_size(char *DirPathname, globus_gfs_stat_t *GFSStat)
+{
+    hpss_stat_t hpss_stat_buf;
+
+    size_t length = strlen(DirPathname) + strlen(GFSStat->name) + 2;
+    char   pathname[length];
+    snprintf(pathname, length, "%s/%s", DirPathname, GFSStat->name);
+
+    memset(&hpss_stat_buf, 0, sizeof(hpss_stat_buf));
+    hpss_stat_buf.st_mode = GFSStat->mode;
+    hpss_stat_buf.st_size = 0;
+
+    globus_result_t result = stat_member_size(pathname, &hpss_stat_buf);
+    if (result)
+        return result;
+
+    CONVERT_U64_TO_LONGLONG(hpss_stat_buf.st_size, GFSStat->size);
+    return GLOBUS_SUCCESS;
+}
+
 globus_result_t
 stat_directory(char      * Pathname,
                stat_dir_cb Callback,
@@ -265,6 +320,18 @@ stat_directory(char      * Pathname,
                 stat_destroy_array(gfs_stat_array, i);
                 goto cleanup;
             }
+
+            /* Any empty file may be a member, even moved out of the directory. */
+            if (S_ISREG(gfs_stat_array[i].mode) && gfs_stat_array[i].size == 0)
+            {
+                result = stat_dir_entry_member_size(Pathname,
+                                                    &gfs_stat_array[i]);
+                if (result)
+                {
+                    stat_destroy_array(gfs_stat_array, i + 1);
+                    goto cleanup;
+                }
+            }
         }
 
         result = Callback(gfs_stat_array, count, end, CallbackArg);
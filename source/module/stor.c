@@ -9,36 +9,66 @@
  * Local includes
  */
 #include "logging.h"
+#include "aggregate.h"
+#include "async_close.h"
+#include "config.h"
 #include "stor.h"
 #include "cksm.h"
+#include "cos.h"
 #include "pio.h"
 
-globus_result_t
-stor_can_change_cos(char *Pathname, int *can_change_cos)
+static double
+stor_elapsed_ms(const struct timespec *Start)
 {
-    int                  retval;
-    hpss_fileattr_t      fileattr;
-    ns_FilesetAttrBits_t fileset_attr_bits;
-    ns_FilesetAttrs_t    fileset_attr;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - Start->tv_sec) * 1000.0 +
+           (now.tv_nsec - Start->tv_nsec) / 1000000.0;
+}
 
-    memset(&fileattr, 0, sizeof(hpss_fileattr_t));
-    retval = Hpss_FileGetAttributes(Pathname, &fileattr);
-    if (retval)
-        return hpss_error_to_globus_result(retval);
+static void *
+stor_clear_uda_thread(void *Arg)
+{
+    stor_meta_op_t *op = Arg;
+    op->Result    = cksm_clear_uda_checksum(op->Pathname);
+    op->ElapsedMS = stor_elapsed_ms(&op->Start);
+    return NULL;
+}
 
-    fileset_attr_bits = orbit64m(0, NS_FS_ATTRINDEX_COS);
-    memset(&fileset_attr, 0, sizeof(ns_FilesetAttrs_t));
-    retval = Hpss_FilesetGetAttributes(NULL,
-                                       &fileattr.Attrs.FilesetId,
-                                       NULL,
-                                       NULL,
-                                       fileset_attr_bits,
-                                       &fileset_attr);
-    if (retval)
-        return hpss_error_to_globus_result(retval);
+static void *
+stor_cos_probe_thread(void *Arg)
+{
+    stor_meta_op_t *op = Arg;
+    op->Result    = cos_can_change(op->Pathname, &op->CanChangeCOS);
+    op->ElapsedMS = stor_elapsed_ms(&op->Start);
+    return NULL;
+}
 
-    *can_change_cos = !fileset_attr.ClassOfService;
-    return GLOBUS_SUCCESS;
+/* Runs ThreadEntry inline if a thread can not be launched. */
+static void
+stor_meta_op_launch(stor_meta_op_t *Op,
+                    char *          Pathname,
+                    void *(*ThreadEntry)(void *Arg))
+{
+    memset(Op, 0, sizeof(*Op));
+    Op->Pathname = Pathname;
+    clock_gettime(CLOCK_MONOTONIC, &Op->Start);
+
+    if (pio_launch_attached(ThreadEntry, Op, &Op->Thread) == GLOBUS_SUCCESS)
+        Op->Launched = true;
+    else
+        ThreadEntry(Op);
+}
+
+static globus_result_t
+stor_meta_op_join(stor_meta_op_t *Op)
+{
+    if (Op->Launched)
+    {
+        pthread_join(Op->Thread, NULL);
+        Op->Launched = false;
+    }
+    return Op->Result;
 }
 
 globus_result_t
@@ -50,14 +80,17 @@ stor_open_for_writing(char *        Pathname,
 {
     int                   oflags         = 0;
     int                   retval         = 0;
-    int                   can_change_cos = 0;
+    bool                  can_change_cos = false;
     globus_off_t          file_length    = 0;
     globus_result_t       result         = GLOBUS_SUCCESS;
     hpss_cos_hints_t      hints_in;
     hpss_cos_hints_t      hints_out;
     hpss_cos_priorities_t priorities;
+    stor_meta_op_t        cos_probe;
+    struct timespec       start;
 
     *FileFD = -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     /* Initialize the hints in. */
     memset(&hints_in, 0, sizeof(hpss_cos_hints_t));
@@ -92,9 +125,24 @@ stor_open_for_writing(char *        Pathname,
              *  is enabled on the COS (it doesn't even try).
              */
             priorities.MaxFileSizePriority = HIGHLY_DESIRED_PRIORITY;
+        } else
+        {
+            /*
+             * No ALLO. Guess the size, if enabled, so that the file does
+             * not land in the default COS. This must happen before the
+             * open truncates the file.
+             */
+            cos_predict_hints(Pathname, &hints_in, &priorities);
         }
     }
 
+    /*
+     * Whether we can change the COS of an existing file only depends on the
+     * parent directory, so find out while the open is in flight.
+     */
+    if (Truncate == GLOBUS_TRUE)
+        stor_meta_op_launch(&cos_probe, Pathname, stor_cos_probe_thread);
+
     /* Always use O_CREAT in support of S3 transfers. */
     oflags = O_WRONLY | O_CREAT;
     if (Truncate == GLOBUS_TRUE)
@@ -107,17 +155,28 @@ stor_open_for_writing(char *        Pathname,
                         &hints_in,
                         &priorities,
                         &hints_out);
+    double open_ms = stor_elapsed_ms(&start);
+
+    /* Handle the case of the file that already existed. */
+    if (Truncate == GLOBUS_TRUE)
+    {
+        result         = stor_meta_op_join(&cos_probe);
+        can_change_cos = cos_probe.CanChangeCOS;
+        DEBUG("STOR open of %s: Hpss_Open %.3f ms, COS probe %.3f ms",
+              Pathname,
+              open_ms,
+              cos_probe.ElapsedMS);
+    }
+
     if (*FileFD < 0)
     {
         result = hpss_error_to_globus_result(*FileFD);
         goto cleanup;
     }
 
-    result = stor_can_change_cos(Pathname, &can_change_cos);
     if (result != GLOBUS_SUCCESS)
         goto cleanup;
 
-    /* Handle the case of the file that already existed. */
     if (Truncate == GLOBUS_TRUE && can_change_cos)
     {
         hpss_cos_md_t cos_md;
@@ -129,6 +188,9 @@ stor_open_for_writing(char *        Pathname,
             result = hpss_error_to_globus_result(retval);
             goto cleanup;
         }
+        DEBUG("STOR open of %s: Hpss_SetCOSByHints done at %.3f ms",
+              Pathname,
+              stor_elapsed_ms(&start));
     }
 
     /* Copy out the file stripe width. */
@@ -145,6 +207,9 @@ cleanup:
     return result;
 }
 
+globus_result_t
+stor_launch_gridftp_reads(stor_info_t *StorInfo);
+
 void
 stor_gridftp_callback(globus_gfs_operation_t Operation,
                       globus_result_t        Result,
@@ -193,12 +258,34 @@ stor_gridftp_callback(globus_gfs_operation_t Operation,
         /* Decrease the current connection count. */
         stor_info->CurConnCnt--;
 
-        /* Wake the PIO thread */
-        pthread_cond_signal(&stor_info->Cond);
+        /* Replace this read so that the PIO thread need not wake to do it. */
+        if (!stor_info->Result && !stor_info->Eof)
+            stor_info->Result = stor_launch_gridftp_reads(stor_info);
+
+        /* Only wake the PIO thread if it can make progress. */
+        if (stor_info->WaitOffset >= 0 &&
+            ((Length && Offset == stor_info->WaitOffset) ||
+             stor_info->Result ||
+             (stor_info->Eof && stor_info->CurConnCnt == 0)))
+        {
+            pthread_cond_signal(&stor_info->DataCond);
+        }
+
+        if (stor_info->CondWaiters)
+            pthread_cond_broadcast(&stor_info->Cond);
     }
     pthread_mutex_unlock(&stor_info->Mutex);
 }
 
+/* Called locked. Waits for any change in buffer, EOF or error state. */
+static void
+stor_wait(stor_info_t *StorInfo)
+{
+    StorInfo->CondWaiters++;
+    pthread_cond_wait(&StorInfo->Cond, &StorInfo->Mutex);
+    StorInfo->CondWaiters--;
+}
+
 /* 1 = found, 0 = not found */
 int
 stor_find_buffer(void *Datum, void *Arg)
@@ -209,6 +296,14 @@ stor_find_buffer(void *Datum, void *Arg)
     return 0;
 }
 
+/* Called locked. */
+static bool
+stor_find_buffer_at(stor_info_t *StorInfo, uint64_t Offset)
+{
+    return globus_list_search_pred(
+               StorInfo->ReadyBufferList, stor_find_buffer, &Offset) != NULL;
+}
+
 /* Called locked. */
 uint64_t
 stor_copy_out_buffers(stor_info_t *StorInfo,
@@ -332,6 +427,118 @@ stor_launch_gridftp_reads(stor_info_t *StorInfo)
     return result;
 }
 
+/*
+ * Only called from the PIO thread. Any data that does not land exactly where
+ * the checksum left off (gaps, restarts, multiple ranges) disables the inline
+ * checksum for the rest of this transfer.
+ */
+static void
+stor_update_inline_cksm(stor_info_t *StorInfo,
+                        char *       Buffer,
+                        uint64_t     Offset,
+                        uint64_t     Length)
+{
+    if (!StorInfo->InlineCksm)
+        return;
+
+    if (Offset != StorInfo->CksmOffset)
+    {
+        DEBUG("Disabling inline checksum. Expected offset %lu, received %lu",
+              StorInfo->CksmOffset,
+              Offset);
+        StorInfo->InlineCksm = false;
+        return;
+    }
+
+    StorInfo->PrevCksmOffset = StorInfo->CksmOffset;
+    StorInfo->PrevMD5Context = StorInfo->MD5Context;
+
+    if (MD5_Update(&StorInfo->MD5Context, Buffer, Length) != 1)
+    {
+        WARN("MD5_Update() failed, disabling inline checksum");
+        StorInfo->InlineCksm = false;
+        return;
+    }
+
+    StorInfo->CksmOffset += Length;
+}
+
+/*
+ * Called after a successful close. The checksum only represents the file if
+ * every byte from offset 0 went through stor_update_inline_cksm().
+ */
+static void
+stor_save_inline_cksm(stor_info_t *StorInfo)
+{
+    char            cksm_string[2 * MD5_DIGEST_LENGTH + 1];
+    globus_result_t result;
+
+    if (!StorInfo->InlineCksm)
+        return;
+
+    result = cksm_md5_final(&StorInfo->MD5Context, cksm_string);
+    if (!result)
+        result = cksm_set_uda_checksum(
+            StorInfo->TransferInfo->pathname, "md5", cksm_string);
+    if (result)
+    {
+        WARN("Failed to save the checksum of %s",
+             StorInfo->TransferInfo->pathname);
+        return;
+    }
+
+    DEBUG("Saved inline checksum %s for %s (%lu bytes)",
+          cksm_string,
+          StorInfo->TransferInfo->pathname,
+          StorInfo->CksmOffset);
+}
+
+/*
+ * Called after a failed transfer. Records the digest of everything up to the
+ * last restart marker so that SITE VERIFYPREFIX can answer without reading
+ * the file back. Markers start at 0 and are contiguous whenever the inline
+ * checksum is still enabled.
+ */
+static void
+stor_save_prefix_digest(stor_info_t *StorInfo)
+{
+    char            cksm_string[2 * MD5_DIGEST_LENGTH + 1];
+    MD5_CTX *       context   = NULL;
+    globus_off_t    committed = StorInfo->MarkerOffset;
+    globus_result_t result;
+
+    if (!StorInfo->InlineCksm || committed == 0)
+        return;
+
+    if (committed == StorInfo->CksmOffset)
+        context = &StorInfo->MD5Context;
+    else if (committed == StorInfo->PrevCksmOffset)
+        context = &StorInfo->PrevMD5Context;
+    else
+    {
+        DEBUG("No prefix digest for %s at offset %lld",
+              StorInfo->TransferInfo->pathname,
+              committed);
+        return;
+    }
+
+    result = cksm_md5_final(context, cksm_string);
+    if (!result)
+        result = cksm_set_uda_prefix(
+            StorInfo->TransferInfo->pathname, committed, cksm_string);
+    if (result)
+    {
+        WARN("Failed to save the prefix digest of %s",
+             StorInfo->TransferInfo->pathname);
+        return;
+    }
+
+    DEBUG("Saved prefix digest %s for %s (%lld bytes)",
+          cksm_string,
+          StorInfo->TransferInfo->pathname,
+          committed);
+}
+
 int
 stor_pio_callout(char     * Buffer,
                  uint32_t * Length,
@@ -369,13 +576,30 @@ stor_pio_callout(char     * Buffer,
             if ((result = stor_launch_gridftp_reads(stor_info)))
                 break;
 
-            if (copied_length != *Length)
-                pthread_cond_wait(&stor_info->Cond, &stor_info->Mutex);
+            if (copied_length != *Length && !stor_info->Result)
+            {
+                offset_needed = Offset + copied_length;
+
+                stor_info->WaitOffset = offset_needed;
+                stor_info->PioWaits++;
+                pthread_cond_wait(&stor_info->DataCond, &stor_info->Mutex);
+                stor_info->WaitOffset = -1;
+
+                if (!stor_find_buffer_at(stor_info, offset_needed) &&
+                    !stor_info->Result && !stor_info->Eof)
+                    stor_info->PioSpuriousWakeups++;
+            }
         }
 
         if (copied_length)
+        {
             globus_gridftp_server_update_bytes_recvd(stor_info->Operation,
                                                      copied_length);
+            if (stor_info->BytesWritten == 0)
+                DEBUG("STOR first block handed to PIO at %.3f ms",
+                      stor_elapsed_ms(&stor_info->StartTime));
+            stor_info->BytesWritten += copied_length;
+        }
 
         // If no other error has occurred, store our error
         if (stor_info->Result == GLOBUS_SUCCESS)
@@ -386,6 +610,9 @@ stor_pio_callout(char     * Buffer,
     }
     pthread_mutex_unlock(&stor_info->Mutex);
 
+    if (result == GLOBUS_SUCCESS && copied_length)
+        stor_update_inline_cksm(stor_info, Buffer, Offset, copied_length);
+
     int exit_code = !(result == GLOBUS_SUCCESS);
     TRACE("PIO stor callout: exit_code:%d", exit_code);
 // XXX copied_length == *Length if exit_code == 0 (ALWAYS)
@@ -406,12 +633,63 @@ stor_wait_for_gridftp(stor_info_t *StorInfo)
                 globus_list_size(StorInfo->FreeBufferList))
                 break;
 
-            pthread_cond_wait(&StorInfo->Cond, &StorInfo->Mutex);
+            stor_wait(StorInfo);
         }
     }
     pthread_mutex_unlock(&StorInfo->Mutex);
 }
 
+/*
+ * Restart markers are coalesced so that many small ranges do not flood the
+ * control channel and the log. A marker is sent once the pending range
+ * reaches $HPSS_DSI_STOR_MARKER_BYTES or $HPSS_DSI_STOR_MARKER_INTERVAL
+ * milliseconds have passed since the last one, which bounds how much a
+ * restart can lose. Setting either one to 0 sends a marker for every
+ * range.
+ */
+#define STOR_MARKER_DEFAULT_BYTES    (256 * 1024 * 1024)
+#define STOR_MARKER_DEFAULT_INTERVAL 5000
+
+static void
+stor_flush_restart_marker(stor_info_t *StorInfo)
+{
+    if (StorInfo->MarkerLength == 0)
+        return;
+
+    DEBUG("Restart marker sent: %lld, %lld",
+          StorInfo->MarkerOffset,
+          StorInfo->MarkerLength);
+    globus_gridftp_server_update_range_recvd(
+        StorInfo->Operation, StorInfo->MarkerOffset, StorInfo->MarkerLength);
+
+    StorInfo->MarkerOffset += StorInfo->MarkerLength;
+    StorInfo->MarkerLength = 0;
+    clock_gettime(CLOCK_MONOTONIC, &StorInfo->LastMarkerTime);
+}
+
+static void
+stor_add_restart_marker(stor_info_t * StorInfo,
+                        globus_off_t  Offset,
+                        globus_off_t  Length)
+{
+    if (Length == 0)
+        return;
+
+    if (StorInfo->MarkerLength == 0 ||
+        Offset != StorInfo->MarkerOffset + StorInfo->MarkerLength)
+    {
+        stor_flush_restart_marker(StorInfo);
+        StorInfo->MarkerOffset = Offset;
+    }
+    StorInfo->MarkerLength += Length;
+
+    if (StorInfo->MarkerLength >= StorInfo->MarkerBytes ||
+        stor_elapsed_ms(&StorInfo->LastMarkerTime) >= StorInfo->MarkerInterval)
+    {
+        stor_flush_restart_marker(StorInfo);
+    }
+}
+
 void
 stor_range_complete_callback(globus_off_t *Offset,
                              globus_off_t *Length,
@@ -420,10 +698,7 @@ stor_range_complete_callback(globus_off_t *Offset,
 {
     stor_info_t *stor_info = UserArg;
 
-    DEBUG("Restart marker sent: %lld, %lld", *Offset, *Length);
-    globus_gridftp_server_update_range_recvd(stor_info->Operation,
-                                             *Offset, 
-                                             *Length);
+    stor_add_restart_marker(stor_info, *Offset, *Length);
 
     assert(*Length <= stor_info->RangeLength);
 
@@ -437,7 +712,10 @@ stor_range_complete_callback(globus_off_t *Offset,
         globus_gridftp_server_get_write_range(
             stor_info->Operation, Offset, Length);
         if (*Length == -1)
+        {
             *Eot = 1;
+            stor_flush_restart_marker(stor_info);
+        }
         stor_info->RangeLength = *Length;
     }
 }
@@ -451,6 +729,12 @@ release_buffer(void *Datum, void *Arg)
     return 0;
 }
 
+static void
+stor_close_failed(const char *Pathname)
+{
+    cksm_clear_uda_checksum((char *)Pathname);
+}
+
 void
 stor_transfer_complete_callback(globus_result_t Result, void *UserArg)
 {
@@ -468,19 +752,67 @@ stor_transfer_complete_callback(globus_result_t Result, void *UserArg)
                 result = stor_launch_gridftp_reads(stor_info);
                 if (result)
                     break;
-                pthread_cond_wait(&stor_info->Cond, &stor_info->Mutex);
+                stor_wait(stor_info);
             }
         }
         pthread_mutex_unlock(&stor_info->Mutex);
     }
 
+    /*
+     * The coordinator has exited. Report whatever completed, particularly
+     * on error, so that a restart does not resend it.
+     */
+    stor_flush_restart_marker(stor_info);
+
     /* Prefer our error over PIO's. */
     if (stor_info->Result)
         result = stor_info->Result;
 
-    rc = Hpss_Close(stor_info->FileFD);
-    if (rc && !result)
-        result = hpss_error_to_globus_result(rc);
+    /*
+     * Unless strict durability is configured, a successful upload may be
+     * reported before the close completes. A failed deferred close
+     * invalidates any checksum we saved.
+     */
+    bool close_async = !result && async_close_enabled_for_writes();
+    if (!close_async)
+    {
+        rc = Hpss_Close(stor_info->FileFD);
+        if (rc && !result)
+            result = hpss_error_to_globus_result(rc);
+    }
+
+    /* A stale checksum must never survive a successful upload. */
+    if (stor_info->ClearUDA)
+    {
+        globus_result_t clear_result = stor_meta_op_join(&stor_info->UDAClear);
+        if (clear_result && !result)
+            result = clear_result;
+        DEBUG("STOR UDA checksum clear took %.3f ms",
+              stor_info->UDAClear.ElapsedMS);
+    }
+
+    /*
+     * Save the checksum before reporting success so that the CKSM which
+     * usually follows the upload finds it.
+     */
+    if (!result)
+        stor_save_inline_cksm(stor_info);
+    else
+        stor_save_prefix_digest(stor_info);
+
+    if (!result && stor_info->RecordSize)
+        cos_record_size(stor_info->TransferInfo->pathname,
+                        stor_info->BytesWritten);
+
+    /* An overwritten member must not keep pointing into its container. */
+    if (!result && stor_info->Aggregate && !stor_info->Aggregated)
+        result = aggregate_clear(stor_info->TransferInfo->pathname);
+
+    /* Queue it before TransferInfo goes away. */
+    if (close_async)
+        async_close(stor_info->FileFD,
+                    stor_info->TransferInfo->pathname,
+                    stor_info->ClearUDA ? stor_close_failed : NULL);
 
     globus_gridftp_server_finished_transfer(stor_info->Operation, result);
 
@@ -493,7 +825,12 @@ stor_transfer_complete_callback(globus_result_t Result, void *UserArg)
      */
     stor_wait_for_gridftp(stor_info);
 
+    DEBUG("STOR PIO thread waited for data %lu times, %lu spurious wakeups",
+          stor_info->PioWaits,
+          stor_info->PioSpuriousWakeups);
+
     pthread_mutex_destroy(&stor_info->Mutex);
+    pthread_cond_destroy(&stor_info->DataCond);
     pthread_cond_destroy(&stor_info->Cond);
     globus_list_free(stor_info->FreeBufferList);
     globus_list_free(stor_info->ReadyBufferList);
@@ -509,6 +846,198 @@ this_is_a_restart(globus_off_t Offset)
     return (Offset != 0);
 }
 
+static globus_result_t
+stor_start_pio(stor_info_t *StorInfo)
+{
+    return pio_start(HPSS_PIO_WRITE,
+                     StorInfo->FileFD,
+                     StorInfo->FileStripeWidth,
+                     StorInfo->BlockSize,
+                     StorInfo->InitialOffset,
+                     StorInfo->RangeLength,
+                     stor_pio_callout,
+                     stor_range_complete_callback,
+                     stor_transfer_complete_callback,
+                     StorInfo);
+}
+
+/*
+ * Small files skip PIO entirely. Files no larger than
+ * $HPSS_DSI_STOR_SMALL_FILE_SIZE, either according to ALLO or because all
+ * of the data arrived before that many bytes were buffered, are written with
+ * a single Hpss_Write(). 0 disables the direct path.
+ */
+#define STOR_SMALL_FILE_DEFAULT_SIZE (1024 * 1024)
+
+static int
+stor_sum_ready_bytes(void *Datum, void *Arg)
+{
+    *(globus_off_t *)Arg += ((stor_buffer_t *)Datum)->BufferLength;
+    return 0;
+}
+
+/* Called locked. */
+static globus_off_t
+stor_ready_bytes(stor_info_t *StorInfo)
+{
+    globus_off_t ready_bytes = 0;
+    globus_list_search_pred(
+        StorInfo->ReadyBufferList, stor_sum_ready_bytes, &ready_bytes);
+    return ready_bytes;
+}
+
+/* Called locked. True if the ready buffers cover [Offset, Offset+Length). */
+static bool
+stor_ready_bytes_contiguous(stor_info_t *StorInfo,
+                            uint64_t     Offset,
+                            uint64_t     Length)
+{
+    globus_list_t *buf_entry = NULL;
+    uint64_t       end       = Offset + Length;
+
+    while (Offset < end)
+    {
+        buf_entry = globus_list_search_pred(
+            StorInfo->ReadyBufferList, stor_find_buffer, &Offset);
+        if (!buf_entry)
+            return false;
+        Offset += ((stor_buffer_t *)globus_list_first(buf_entry))->BufferLength;
+    }
+    return true;
+}
+
+static globus_result_t
+stor_write_direct(stor_info_t *StorInfo, globus_off_t Length)
+{
+    char *          buffer = NULL;
+    ssize_t         rc     = 0;
+    globus_result_t result = GLOBUS_SUCCESS;
+
+    if (StorInfo->TransferInfo->alloc_size > 0 &&
+        Length != StorInfo->TransferInfo->alloc_size)
+        return GlobusGFSErrorGeneric("Premature end of data transfer");
+
+    if (Length == 0)
+        return GLOBUS_SUCCESS;
+
+    buffer = malloc(Length);
+    if (!buffer)
+        return GlobusGFSErrorMemory("stor buffer");
+
+    pthread_mutex_lock(&StorInfo->Mutex);
+    {
+        stor_copy_out_buffers(StorInfo, buffer, 0, Length);
+    }
+    pthread_mutex_unlock(&StorInfo->Mutex);
+
+    if (StorInfo->Aggregate && Length <= aggregate_max_member_size())
+    {
+        /* The file itself stays empty. */
+        result = aggregate_store(
+            StorInfo->TransferInfo->pathname, buffer, Length);
+        StorInfo->Aggregated = (result == GLOBUS_SUCCESS);
+    } else
+    {
+        rc = Hpss_Write(StorInfo->FileFD, buffer, Length);
+        if (rc < 0)
+            result = hpss_error_to_globus_result(rc);
+        else if (rc != Length)
+            result = GlobusGFSErrorGeneric("Short write to HPSS");
+    }
+
+    if (!result)
+    {
+        globus_gridftp_server_update_bytes_recvd(StorInfo->Operation, Length);
+        StorInfo->BytesWritten = Length;
+        stor_update_inline_cksm(StorInfo, buffer, 0, Length);
+        stor_add_restart_marker(StorInfo, 0, Length);
+    }
+
+    free(buffer);
+    return result;
+}
+
+/*
+ * Buffers incoming data until we know whether the file is small. Runs on a
+ * detached thread; finishes the transfer either directly or through PIO.
+ */
+static void *
+stor_small_file_thread(void *Arg)
+{
+    stor_info_t *   stor_info   = Arg;
+    globus_result_t result      = GLOBUS_SUCCESS;
+    globus_off_t    ready_bytes = 0;
+    bool            direct      = false;
+
+    pthread_mutex_lock(&stor_info->Mutex);
+    {
+        while (!stor_info->Result)
+        {
+            ready_bytes = stor_ready_bytes(stor_info);
+
+            if (stor_info->Eof && stor_info->CurConnCnt == 0)
+            {
+                direct = stor_ready_bytes_contiguous(stor_info, 0, ready_bytes);
+                break;
+            }
+
+            if (ready_bytes > stor_info->SmallFileSize)
+                break;
+
+            if ((stor_info->Result = stor_launch_gridftp_reads(stor_info)))
+                break;
+
+            /* Every buffer is full and we still have not seen EOF. */
+            if (stor_info->CurConnCnt == 0)
+                break;
+
+            stor_wait(stor_info);
+        }
+        result = stor_info->Result;
+    }
+    pthread_mutex_unlock(&stor_info->Mutex);
+
+    DEBUG("STOR of %s: %lld bytes buffered, %s",
+          stor_info->TransferInfo->pathname,
+          ready_bytes,
+          direct ? "writing directly" : "starting PIO");
+
+    if (!result && !direct)
+    {
+        /* Buffers already received are picked up by stor_pio_callout(). */
+        result = stor_start_pio(stor_info);
+        if (!result)
+            return NULL;
+    }
+
+    if (!result)
+        result = stor_write_direct(stor_info, ready_bytes);
+
+    if (result)
+    {
+        pthread_mutex_lock(&stor_info->Mutex);
+        if (!stor_info->Result)
+            stor_info->Result = result;
+        pthread_mutex_unlock(&stor_info->Mutex);
+    }
+
+    stor_transfer_complete_callback(result, stor_info);
+    return NULL;
+}
+
+static bool
+stor_use_small_file_path(stor_info_t *StorInfo)
+{
+    if (StorInfo->SmallFileSize <= 0)
+        return false;
+    if (this_is_a_restart(StorInfo->InitialOffset))
+        return false;
+    if (!StorInfo->TransferInfo->truncate)
+        return false;
+    /* Without ALLO we find out once the data arrives. */
+    return StorInfo->TransferInfo->alloc_size <= StorInfo->SmallFileSize;
+}
+
 static globus_result_t
 validate_restart(const char * Pathname,
                  globus_off_t Offset,
@@ -525,6 +1054,29 @@ validate_restart(const char * Pathname,
     return GLOBUS_SUCCESS;
 }
 
+static globus_result_t
+stor_check_not_member(char *Pathname)
+{
+    hpss_stat_t        hpss_stat_buf;
+    aggregate_member_t member;
+
+    int retval = Hpss_Stat(Pathname, &hpss_stat_buf);
+    if (retval)
+        return hpss_error_to_globus_result(retval);
+
+    globus_result_t result = aggregate_lookup(Pathname, &hpss_stat_buf, &member);
+    if (result)
+        return result;
+
+    if (member.Container)
+    {
+        aggregate_member_destroy(&member);
+        return GlobusGFSErrorGeneric(
+            "Appending to an aggregated file is not supported");
+    }
+    return GLOBUS_SUCCESS;
+}
+
 void
 stor(globus_gfs_operation_t      Operation,
      globus_gfs_transfer_info_t *TransferInfo,
@@ -549,7 +1101,17 @@ stor(globus_gfs_operation_t      Operation,
     stor_info->TransferInfo = TransferInfo;
     stor_info->FileFD       = -1;
     pthread_mutex_init(&stor_info->Mutex, NULL);
+    pthread_cond_init(&stor_info->DataCond, NULL);
     pthread_cond_init(&stor_info->Cond, NULL);
+    stor_info->WaitOffset = -1;
+    clock_gettime(CLOCK_MONOTONIC, &stor_info->StartTime);
+    stor_info->LastMarkerTime = stor_info->StartTime;
+    stor_info->MarkerBytes    = config_get_env_int(
+        "HPSS_DSI_STOR_MARKER_BYTES", STOR_MARKER_DEFAULT_BYTES);
+    stor_info->MarkerInterval = config_get_env_int(
+        "HPSS_DSI_STOR_MARKER_INTERVAL", STOR_MARKER_DEFAULT_INTERVAL);
+    stor_info->SmallFileSize = config_get_env_int(
+        "HPSS_DSI_STOR_SMALL_FILE_SIZE", STOR_SMALL_FILE_DEFAULT_SIZE);
 
     globus_gridftp_server_get_block_size(Operation, &stor_info->BlockSize);
 
@@ -559,12 +1121,16 @@ stor(globus_gfs_operation_t      Operation,
      * _any_ value in UDA when the endpoint admin has disabled UDA would
      * seem to violate that configuration option. So we check if we should
      * be using UDA at all before clearing the stored value.
+     *
+     * The clear runs alongside the open and the transfer. ENOENT is ignored
+     * so it is safe in either order with respect to file creation. It is
+     * joined before we report success.
      */
     if (UseUDAChecksums)
     {
-        result = cksm_clear_uda_checksum(TransferInfo->pathname);
-        if (result)
-            goto cleanup;
+        stor_info->ClearUDA = true;
+        stor_meta_op_launch(
+            &stor_info->UDAClear, TransferInfo->pathname, stor_clear_uda_thread);
     }
 
     /*
@@ -577,6 +1143,7 @@ stor(globus_gfs_operation_t      Operation,
                                    &file_stripe_width);
     if (result)
         goto cleanup;
+    stor_info->FileStripeWidth = file_stripe_width;
 
     // Write_range() must occur before begin_transfer() so that
     // offsets are correct for DSIs that require ordered offsets
@@ -584,6 +1151,8 @@ stor(globus_gfs_operation_t      Operation,
         Operation, &offset, &stor_info->RangeLength);
 
     globus_gridftp_server_begin_transfer(Operation, 0, NULL);
+    DEBUG("STOR begin_transfer at %.3f ms",
+          stor_elapsed_ms(&stor_info->StartTime));
 
     INFO("Receiving %s: Offset:%lld  Length:%lld",
            TransferInfo->pathname,
@@ -601,19 +1170,52 @@ stor(globus_gfs_operation_t      Operation,
             goto cleanup;
     }
 
+    /*
+     * Checksum the data as it passes through so that the UDA checksum is
+     * available as soon as the upload completes. Without truncate, bytes
+     * beyond what we write would remain in the file.
+     */
+    if (UseUDAChecksums && !this_is_a_restart(offset) && TransferInfo->truncate)
+    {
+        if (MD5_Init(&stor_info->MD5Context) == 1)
+            stor_info->InlineCksm = true;
+    }
+
+    /* Only whole file uploads tell us something about file sizes. */
+    stor_info->RecordSize = !this_is_a_restart(offset) && TransferInfo->truncate;
+
+    stor_info->InitialOffset = offset;
+
+    /*
+     * Aggregation only applies to whole file uploads, which take the small
+     * file path. Appending to a member would strand its data in the
+     * container.
+     */
+    if (aggregate_enabled_for(TransferInfo->pathname))
+    {
+        if (TransferInfo->truncate && !this_is_a_restart(offset))
+        {
+            stor_info->Aggregate = true;
+            if (stor_info->SmallFileSize < aggregate_max_member_size())
+                stor_info->SmallFileSize = aggregate_max_member_size();
+        } else
+        {
+            result = stor_check_not_member(TransferInfo->pathname);
+            if (result)
+                goto cleanup;
+        }
+    }
+
+    if (stor_use_small_file_path(stor_info))
+    {
+        result = pio_launch_detached(stor_small_file_thread, stor_info);
+        goto cleanup;
+    }
+
     /*
      * Setup PIO
      */
-    result = pio_start(HPSS_PIO_WRITE,
-                       stor_info->FileFD,
-                       file_stripe_width,
-                       stor_info->BlockSize,
-                       offset,
-                       stor_info->RangeLength,
-                       stor_pio_callout,
-                       stor_range_complete_callback,
-                       stor_transfer_complete_callback,
-                       stor_info);
+    result = stor_start_pio(stor_info);
 
 cleanup:
     if (result)
@@ -623,7 +1225,10 @@ cleanup:
         {
             if (stor_info->FileFD >= 0)
                 Hpss_Close(stor_info->FileFD);
+            if (stor_info->ClearUDA)
+                stor_meta_op_join(&stor_info->UDAClear);
             pthread_mutex_destroy(&stor_info->Mutex);
+            pthread_cond_destroy(&stor_info->DataCond);
             pthread_cond_destroy(&stor_info->Cond);
             free(stor_info);
         }
@@ -4,8 +4,10 @@
 /*
  * System includes
  */
+#include <openssl/md5.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 
 /*
  * Globus includes
@@ -36,6 +38,22 @@ typedef struct
     int Valid; // Debug Entry
 } stor_buffer_t;
 
+/*
+ * A metadata operation issued during STOR startup that does not depend on
+ * the open. It runs on its own thread so that its round trip overlaps with
+ * Hpss_Open().
+ */
+typedef struct
+{
+    char *          Pathname;
+    pthread_t       Thread;
+    bool            Launched;
+    struct timespec Start;
+    double          ElapsedMS;
+    globus_result_t Result;
+    bool            CanChangeCOS; // COS probe only
+} stor_meta_op_t;
+
 typedef struct stor_info
 {
     globus_gfs_operation_t      Operation;
@@ -47,7 +65,20 @@ typedef struct stor_info
     globus_size_t   BlockSize;
 
     pthread_mutex_t Mutex;
-    pthread_cond_t  Cond;
+
+    /*
+     * The PIO thread waits on DataCond for the buffer at WaitOffset (-1 when
+     * it is not waiting). GridFTP callbacks only signal it when that offset
+     * arrives, on error or once all reads are done after EOF. Everyone else
+     * waits on Cond, which is only signalled when CondWaiters is non zero.
+     */
+    pthread_cond_t DataCond;
+    globus_off_t   WaitOffset;
+    pthread_cond_t Cond;
+    int            CondWaiters;
+
+    uint64_t PioWaits;          // Times the PIO thread waited for data
+    uint64_t PioSpuriousWakeups; // Wakeups that made no progress
 
     globus_off_t  RangeLength; // Current range transfer length
     globus_bool_t Eof;
@@ -60,6 +91,55 @@ typedef struct stor_info
     globus_list_t *ReadyBufferList;
     globus_list_t *FreeBufferList;
 
+    /*
+     * Inline checksum of the data as it is handed to PIO. Only used when the
+     * entire file is written in order from offset 0. Only the PIO thread
+     * touches these.
+     */
+    bool     InlineCksm;
+    uint64_t CksmOffset; // Next offset expected by the checksum
+    MD5_CTX  MD5Context;
+
+    /*
+     * The checksum before the last block. PIO may fail after a block was
+     * handed to it but before it was written, so the prefix digest saved
+     * on failure comes from whichever one matches the last restart marker.
+     */
+    uint64_t PrevCksmOffset;
+    MD5_CTX  PrevMD5Context;
+
+    bool     RecordSize;   // Report the final size for COS prediction
+    uint64_t BytesWritten; // Bytes handed to PIO
+
+    /*
+     * Invalidates the UDA checksum. Must be joined before the transfer
+     * completes and before the inline checksum is saved.
+     */
+    bool           ClearUDA;
+    stor_meta_op_t UDAClear;
+
+    struct timespec StartTime; // For startup phase timings
+
+    /* PIO parameters, kept for a deferred pio_start(). */
+    int          FileStripeWidth;
+    globus_off_t InitialOffset;
+
+    globus_off_t SmallFileSize; // Direct write threshold, 0 disables
+
+    bool Aggregate;  // Small enough uploads go to a container
+    bool Aggregated; // This upload went to a container
+
+    /*
+     * Completed ranges not yet reported as restart markers. Contiguous
+     * ranges are coalesced until MarkerBytes or MarkerInterval is reached.
+     * Only the PIO coordinator touches these.
+     */
+    globus_off_t    MarkerOffset;
+    globus_off_t    MarkerLength;
+    globus_off_t    MarkerBytes;
+    double          MarkerInterval; // ms
+    struct timespec LastMarkerTime;
+
 } stor_info_t;
 
 void
@@ -0,0 +1,370 @@
+/*
+ * System includes
+ */
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "config.h"
+#include "logging.h"
+#include "treehash.h"
+
+/*
+ * Chunks are hashed by up to $HPSS_DSI_CKSM_TREE_WORKERS threads shared by
+ * all checksums in the process and started on demand. Each checksum holds
+ * at most TREEHASH_BUFFERS_PER_WORKER chunk buffers per worker, so PIO is
+ * throttled once the workers fall behind.
+ */
+#define TREEHASH_MAX_DEFAULT_WORKERS 8
+#define TREEHASH_BUFFERS_PER_WORKER  2
+
+struct treehash_chunk
+{
+    treehash_t *           Tree;
+    size_t                 Index;
+    size_t                 Length;
+    unsigned char *        Buffer;
+    unsigned char          Digest[SHA256_DIGEST_LENGTH];
+    struct treehash_chunk *Next;
+};
+
+struct treehash
+{
+    pthread_mutex_t        Lock;
+    pthread_cond_t         Cond;
+    struct treehash_chunk *Current; // Being filled by treehash_update()
+    struct treehash_chunk *Free;
+    int                    Buffers; // Allocated chunk buffers
+    int                    MaxBuffers;
+    int                    Outstanding; // Chunks queued or being hashed
+    size_t                 Chunks;      // Chunks submitted
+    unsigned char *        Leaves;      // Chunks * SHA256_DIGEST_LENGTH
+    size_t                 LeafCapacity;
+    bool                   Failed;
+};
+
+static struct
+{
+    pthread_mutex_t        Lock;
+    pthread_cond_t         WorkCond;
+    int                    MaxWorkers;
+    int                    Workers;
+    int                    Idle;
+    struct treehash_chunk *Head;
+    struct treehash_chunk *Tail;
+} TreeHash = {.Lock = PTHREAD_MUTEX_INITIALIZER,
+              .WorkCond = PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t TreeHashInitialized = PTHREAD_ONCE_INIT;
+
+static void
+treehash_init()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0)
+        cpus = 1;
+    if (cpus > TREEHASH_MAX_DEFAULT_WORKERS)
+        cpus = TREEHASH_MAX_DEFAULT_WORKERS;
+
+    TreeHash.MaxWorkers = config_get_env_int("HPSS_DSI_CKSM_TREE_WORKERS", cpus);
+    if (TreeHash.MaxWorkers < 0)
+        TreeHash.MaxWorkers = 0;
+}
+
+static void
+treehash_chunk_free(struct treehash_chunk *Chunk)
+{
+    free(Chunk->Buffer);
+    free(Chunk);
+}
+
+/* Records the chunk digest and returns the buffer for reuse. */
+static void
+treehash_chunk_done(struct treehash_chunk *Chunk, bool Failed)
+{
+    treehash_t *tree = Chunk->Tree;
+
+    pthread_mutex_lock(&tree->Lock);
+    {
+        if (Failed)
+            tree->Failed = true;
+        else
+            memcpy(tree->Leaves + Chunk->Index * SHA256_DIGEST_LENGTH,
+                   Chunk->Digest,
+                   SHA256_DIGEST_LENGTH);
+
+        Chunk->Length = 0;
+        Chunk->Next   = tree->Free;
+        tree->Free    = Chunk;
+        tree->Outstanding--;
+        pthread_cond_broadcast(&tree->Cond);
+    }
+    pthread_mutex_unlock(&tree->Lock);
+}
+
+static void
+treehash_chunk_hash(struct treehash_chunk *Chunk)
+{
+    int ok = EVP_Digest(
+        Chunk->Buffer, Chunk->Length, Chunk->Digest, NULL, EVP_sha256(), NULL);
+    treehash_chunk_done(Chunk, ok != 1);
+}
+
+static void *
+treehash_worker(void *Arg)
+{
+    pthread_mutex_lock(&TreeHash.Lock);
+    while (1)
+    {
+        while (!TreeHash.Head)
+        {
+            TreeHash.Idle++;
+            pthread_cond_wait(&TreeHash.WorkCond, &TreeHash.Lock);
+            TreeHash.Idle--;
+        }
+
+        struct treehash_chunk *chunk = TreeHash.Head;
+        TreeHash.Head                = chunk->Next;
+        if (!TreeHash.Head)
+            TreeHash.Tail = NULL;
+
+        pthread_mutex_unlock(&TreeHash.Lock);
+        treehash_chunk_hash(chunk);
+        pthread_mutex_lock(&TreeHash.Lock);
+    }
+    return NULL;
+}
+
+/* Hashes the chunk inline if no worker is available. */
+static void
+treehash_queue(struct treehash_chunk *Chunk)
+{
+    pthread_t      thread;
+    pthread_attr_t attr;
+    bool           queued = false;
+
+    pthread_mutex_lock(&TreeHash.Lock);
+    {
+        if (TreeHash.Idle == 0 && TreeHash.Workers < TreeHash.MaxWorkers)
+        {
+            if (pthread_attr_init(&attr) == 0)
+            {
+                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+                if (pthread_create(&thread, &attr, treehash_worker, NULL) == 0)
+                    TreeHash.Workers++;
+                pthread_attr_destroy(&attr);
+            }
+        }
+
+        if (TreeHash.Workers > 0)
+        {
+            Chunk->Next = NULL;
+            if (TreeHash.Tail)
+                TreeHash.Tail->Next = Chunk;
+            else
+                TreeHash.Head = Chunk;
+            TreeHash.Tail = Chunk;
+            pthread_cond_signal(&TreeHash.WorkCond);
+            queued = true;
+        }
+    }
+    pthread_mutex_unlock(&TreeHash.Lock);
+
+    if (!queued)
+        treehash_chunk_hash(Chunk);
+}
+
+static globus_result_t
+treehash_submit(treehash_t *Tree)
+{
+    struct treehash_chunk *chunk = Tree->Current;
+
+    Tree->Current = NULL;
+
+    pthread_mutex_lock(&Tree->Lock);
+    {
+        if (Tree->Chunks == Tree->LeafCapacity)
+        {
+            size_t capacity = Tree->LeafCapacity ? Tree->LeafCapacity * 2 : 64;
+            unsigned char *leaves =
+                realloc(Tree->Leaves, capacity * SHA256_DIGEST_LENGTH);
+            if (!leaves)
+            {
+                chunk->Next = Tree->Free;
+                Tree->Free  = chunk;
+                pthread_mutex_unlock(&Tree->Lock);
+                return GlobusGFSErrorMemory("tree hash leaves");
+            }
+            Tree->Leaves       = leaves;
+            Tree->LeafCapacity = capacity;
+        }
+        chunk->Index = Tree->Chunks++;
+        Tree->Outstanding++;
+    }
+    pthread_mutex_unlock(&Tree->Lock);
+
+    treehash_queue(chunk);
+    return GLOBUS_SUCCESS;
+}
+
+/* Waits for a free buffer once MaxBuffers are in use. */
+static globus_result_t
+treehash_get_chunk(treehash_t *Tree)
+{
+    struct treehash_chunk *chunk = NULL;
+
+    pthread_mutex_lock(&Tree->Lock);
+    {
+        while (!Tree->Free && Tree->Buffers >= Tree->MaxBuffers)
+            pthread_cond_wait(&Tree->Cond, &Tree->Lock);
+
+        if (Tree->Free)
+        {
+            chunk      = Tree->Free;
+            Tree->Free = chunk->Next;
+        } else
+        {
+            chunk = calloc(1, sizeof(*chunk));
+            if (chunk)
+                chunk->Buffer = malloc(TREEHASH_CHUNK_SIZE);
+            if (chunk && !chunk->Buffer)
+            {
+                free(chunk);
+                chunk = NULL;
+            }
+            if (chunk)
+            {
+                chunk->Tree = Tree;
+                Tree->Buffers++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&Tree->Lock);
+
+    if (!chunk)
+        return GlobusGFSErrorMemory("tree hash chunk");
+
+    Tree->Current = chunk;
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+treehash_create(treehash_t **Tree)
+{
+    pthread_once(&TreeHashInitialized, treehash_init);
+
+    *Tree = calloc(1, sizeof(treehash_t));
+    if (!*Tree)
+        return GlobusGFSErrorMemory("treehash_t");
+
+    pthread_mutex_init(&(*Tree)->Lock, NULL);
+    pthread_cond_init(&(*Tree)->Cond, NULL);
+    (*Tree)->MaxBuffers = TreeHash.MaxWorkers * TREEHASH_BUFFERS_PER_WORKER;
+    if ((*Tree)->MaxBuffers == 0)
+        (*Tree)->MaxBuffers = 1;
+
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+treehash_update(treehash_t *Tree, const void *Buffer, size_t Length)
+{
+    globus_result_t      result = GLOBUS_SUCCESS;
+    const unsigned char *data   = Buffer;
+
+    while (Length > 0)
+    {
+        if (!Tree->Current)
+        {
+            result = treehash_get_chunk(Tree);
+            if (result)
+                return result;
+        }
+
+        struct treehash_chunk *chunk = Tree->Current;
+
+        size_t room = TREEHASH_CHUNK_SIZE - chunk->Length;
+        size_t n    = Length < room ? Length : room;
+
+        memcpy(chunk->Buffer + chunk->Length, data, n);
+        chunk->Length += n;
+        data += n;
+        Length -= n;
+
+        if (chunk->Length == TREEHASH_CHUNK_SIZE)
+        {
+            result = treehash_submit(Tree);
+            if (result)
+                return result;
+        }
+    }
+
+    return GLOBUS_SUCCESS;
+}
+
+globus_result_t
+treehash_final(treehash_t *Tree, unsigned char Root[SHA256_DIGEST_LENGTH])
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+
+    if (Tree->Current && Tree->Current->Length > 0)
+        result = treehash_submit(Tree);
+
+    pthread_mutex_lock(&Tree->Lock);
+    {
+        while (Tree->Outstanding > 0)
+            pthread_cond_wait(&Tree->Cond, &Tree->Lock);
+    }
+    pthread_mutex_unlock(&Tree->Lock);
+
+    if (!result && Tree->Failed)
+        result = GlobusGFSErrorGeneric("Failed to hash a chunk");
+
+    if (!result && EVP_Digest(Tree->Leaves,
+                              Tree->Chunks * SHA256_DIGEST_LENGTH,
+                              Root,
+                              NULL,
+                              EVP_sha256(),
+                              NULL) != 1)
+    {
+        result = GlobusGFSErrorGeneric("Failed to hash the chunk digests");
+    }
+
+    DEBUG("Tree hash of %zu chunks using %d buffers", Tree->Chunks, Tree->Buffers);
+
+    treehash_destroy(Tree);
+    return result;
+}
+
+void
+treehash_destroy(treehash_t *Tree)
+{
+    struct treehash_chunk *chunk = NULL;
+
+    pthread_mutex_lock(&Tree->Lock);
+    {
+        while (Tree->Outstanding > 0)
+            pthread_cond_wait(&Tree->Cond, &Tree->Lock);
+    }
+    pthread_mutex_unlock(&Tree->Lock);
+
+    if (Tree->Current)
+        treehash_chunk_free(Tree->Current);
+
+    while ((chunk = Tree->Free))
+    {
+        Tree->Free = chunk->Next;
+        treehash_chunk_free(chunk);
+    }
+
+    pthread_mutex_destroy(&Tree->Lock);
+    pthread_cond_destroy(&Tree->Cond);
+    free(Tree->Leaves);
+    free(Tree);
+}
@@ -0,0 +1,39 @@
+#ifndef HPSS_DSI_TREEHASH_H
+#define HPSS_DSI_TREEHASH_H
+
+/*
+ * System includes
+ */
+#include <openssl/sha.h>
+#include <stddef.h>
+
+/*
+ * Globus includes
+ */
+#include <_globus_gridftp_server.h>
+
+/*
+ * The sha256tree checksum. Data is split into TREEHASH_CHUNK_SIZE chunks,
+ * the last one possibly short, which are hashed with SHA-256 in parallel.
+ * The result is the SHA-256 of the chunk digests concatenated in order, so
+ * an empty file has the SHA-256 of no data.
+ */
+#define TREEHASH_CHUNK_SIZE (8 * 1024 * 1024)
+
+typedef struct treehash treehash_t;
+
+globus_result_t
+treehash_create(treehash_t **Tree);
+
+globus_result_t
+treehash_update(treehash_t *Tree, const void *Buffer, size_t Length);
+
+/* Tree is destroyed. */
+globus_result_t
+treehash_final(treehash_t *Tree, unsigned char Root[SHA256_DIGEST_LENGTH]);
+
+/* Waits for outstanding chunks. */
+void
+treehash_destroy(treehash_t *Tree);
+
+#endif /* HPSS_DSI_TREEHASH_H */
@@ -35,6 +35,8 @@ static const char * HELP_MSG =
     "                       Valid values are: ERROR, WARN, INFO, DEBUG, TRACE, ALL\n"
     "                       or any combination of those values separated by '|'.\n"
     "-i <task_id>           UUID used to compute the request ID for this file.\n"
+    "-c <path>              Residency cache shared with the DSI on this node.\n"
+    "                       Defaults to $HPSS_DSI_RESIDENCY_CACHE.\n"
     "Examples:\n"
     "$ stage -a unix -p hpssftp -t /var/hpss/etc/keytab -u user1 /my/file 5\n"
     "\n"
@@ -67,10 +69,11 @@ main(int argc, char * argv[])
     const char * log_level     = NULL; // -v (ALL, INFO, etc)
     const char * path          = NULL;
     const char * task_id       = NULL; // Optional UUID
+    const char * cache         = NULL; // -c (residency cache)
     int          timeout       = -1;
 
     int i;
-    while ((i = getopt(argc, argv, "p:a:t:u:v:i:")) != -1)
+    while ((i = getopt(argc, argv, "p:a:t:u:v:i:c:")) != -1)
     {
         switch(i)
         {
@@ -98,6 +101,10 @@ main(int argc, char * argv[])
             task_id = optarg;
             break;
 
+        case 'c':
+            cache = optarg;
+            break;
+
         case '?':
         default:
             fprintf(stderr, HELP_MSG);
@@ -149,6 +156,10 @@ main(int argc, char * argv[])
     path = argv[optind];
     timeout = atoi(argv[optind+1]);
 
+    // stage_ex() checks the residency cache before asking HPSS
+    if (cache)
+        setenv("HPSS_DSI_RESIDENCY_CACHE", cache, 1);
+
     //
     // Initialize Globus command so that error codes work
     //
@@ -0,0 +1,383 @@
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Project includes
+ */
+#include <hpss_log.h>
+#include <logging.h>
+#include <shmtab.h>
+#include <stage.h>
+#include <utils.h>
+
+static const char * HELP_MSG =
+    "Usage: stage_listener [OPTIONS]\n"
+    "Receive HPSS stage completion callbacks and publish them to the DSI.\n"
+    "Run one per node, at the address given to the DSI in ASYNC_CALLBACK_ADDR.\n"
+    "\n"
+    "OPTIONS:\n"
+    "-l <[host:]port>       Address to listen on; every interface without a host.\n"
+    "                       Defaults to $ASYNC_CALLBACK_ADDR.\n"
+    "-m <name>              Shared memory table to publish to, ie. /hpss_dsi_stage.\n"
+    "                       Defaults to $HPSS_DSI_STAGE_CALLBACK_SHM.\n"
+    "-n <slots>             Completions kept in the table. Defaults to 4096.\n"
+    "-s <request id>        Instead of listening, send a stand-in callback for\n"
+    "                       this request ID to the address and exit. It uses the\n"
+    "                       record layout this listener assumes, so it tests the\n"
+    "                       path to the DSI, not the core server's format.\n"
+    "-v <log_level>         The level of additional logging to print to stdout.\n"
+    "                       Valid values are: ERROR, WARN, INFO, DEBUG, TRACE, ALL\n"
+    "                       or any combination of those values separated by '|'.\n"
+    "Examples:\n"
+    "$ stage_listener -l 5555 -m /hpss_dsi_stage\n"
+    "\n"
+    "$ stage_listener -l localhost:5555 -s 8b9e32b7-bdd0-4714-877a-8e8742168821\n"
+    "";
+
+/* Connections read at once; more wait in the listen backlog. */
+#define MAX_PEERS 64
+
+/* Peers that have not sent their record by then are dropped. */
+#define PEER_TIMEOUT_MS 5000
+
+static int
+_str_to_request_id(const char * Str, hpss_reqid_t * RequestID)
+{
+#if HPSS_MAJOR_VERSION <= 7
+    char * end = NULL;
+    *RequestID = strtoul(Str, &end, 0);
+    return (*end == '\0') ? 0 : -1;
+#else
+    unsigned char bytes[UUID_BYTE_COUNT];
+    if (!is_valid_uuid(Str))
+        return -1;
+    uuid_str_to_bytes(Str, bytes);
+    bytes_to_hpss_uuid(bytes, RequestID);
+    return 0;
+#endif
+}
+
+// Splits [host:]port. Host is NULL if missing.
+static void
+_split_address(const char * Address, char ** Host, char ** Port)
+{
+    const char * colon = strrchr(Address, ':');
+
+    *Host = NULL;
+    if (colon)
+    {
+        *Host = strndup(Address, colon - Address);
+        *Port = strdup(colon + 1);
+    } else
+    {
+        *Port = strdup(Address);
+    }
+}
+
+static struct addrinfo *
+_resolve(const char * Address, int Passive)
+{
+    char *            host = NULL;
+    char *            port = NULL;
+    struct addrinfo   hints;
+    struct addrinfo * info = NULL;
+
+    _split_address(Address, &host, &port);
+    if (host && *host == '\0')
+    {
+        free(host);
+        host = NULL;
+    }
+
+    // Listen on every interface only when no host is given
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = Passive && !host ? AI_PASSIVE : 0;
+
+    int rc = getaddrinfo(host, port, &hints, &info);
+    if (rc)
+    {
+        fprintf(stderr, "Failed to resolve %s: %s\n", Address, gai_strerror(rc));
+        info = NULL;
+    }
+
+    free(host);
+    free(port);
+    return info;
+}
+
+//
+// The core server connects to the callback address once per completed
+// stage. Its record is taken to begin with the callback address ID, which
+// the DSI sets to the stage request ID, in host byte order; nothing else is
+// used. This layout is not documented by HPSS and has not been checked
+// against every release. Run with -v DEBUG and compare the logged request
+// IDs with the DSI's "Using request ID" messages to confirm it. If it does
+// not match, the DSI still polls on its usual schedule.
+//
+typedef struct
+{
+    int           Fd;
+    size_t        Length;
+    unsigned char Record[sizeof(hpss_reqid_t)];
+    int64_t       Accepted;
+} peer_t;
+
+static int64_t
+_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Returns 1 once Peer is done with, whether or not it sent a whole record.
+static int
+_read_peer(peer_t * Peer, shmtab_t * Table)
+{
+    unsigned char key[SHMTAB_KEY_SIZE];
+    hpss_reqid_t  request_id;
+
+    ssize_t rc = read(Peer->Fd,
+                      Peer->Record + Peer->Length,
+                      sizeof(Peer->Record) - Peer->Length);
+    if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (rc <= 0)
+    {
+        WARN("Ignoring a short stage callback message");
+        return 1;
+    }
+
+    Peer->Length += rc;
+    if (Peer->Length < sizeof(Peer->Record))
+        return 0;
+
+    // Whatever follows the record is not needed.
+    memcpy(&request_id, Peer->Record, sizeof(request_id));
+    stage_request_key(&request_id, key);
+    shmtab_publish(Table, key);
+    DEBUG("Stage complete for request ID %s", HPSS_REQID_T(request_id));
+    return 1;
+}
+
+static int
+_send_callback(const char * Address, const char * RequestIDStr)
+{
+    hpss_reqid_t      request_id;
+    struct addrinfo * info = NULL;
+    int               fd   = -1;
+
+    if (_str_to_request_id(RequestIDStr, &request_id))
+    {
+        fprintf(stderr, "Illegal request ID: %s\n", RequestIDStr);
+        return 1;
+    }
+
+    info = _resolve(Address, 0);
+    if (!info)
+        return 1;
+
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen))
+    {
+        perror("Failed to connect");
+        freeaddrinfo(info);
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
+    freeaddrinfo(info);
+
+    if (write(fd, &request_id, sizeof(request_id)) != sizeof(request_id))
+    {
+        perror("Failed to send the callback");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int
+_listen(const char * Address, shmtab_t * Table)
+{
+    struct addrinfo * info = NULL;
+    int               fd   = -1;
+    int               on   = 1;
+    peer_t            peers[MAX_PEERS];
+    int               count = 0;
+    struct pollfd     fds[MAX_PEERS + 1];
+
+    info = _resolve(Address, 1);
+    if (!info)
+        return 1;
+
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd == -1 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+        bind(fd, info->ai_addr, info->ai_addrlen) ||
+        listen(fd, 128))
+    {
+        perror("Failed to listen");
+        freeaddrinfo(info);
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
+    freeaddrinfo(info);
+
+    INFO("Listening for stage callbacks on %s", Address);
+
+    // One thread, no blocking reads: a stalled peer only holds its own slot.
+    while (1)
+    {
+        for (int i = 0; i < count; i++)
+            fds[i] = (struct pollfd){.fd = peers[i].Fd, .events = POLLIN};
+        fds[count] = (struct pollfd){.fd = fd, .events = POLLIN};
+
+        // A full table leaves new connections in the backlog.
+        bool accepting = count < MAX_PEERS;
+        if (poll(fds, accepting ? count + 1 : count, 1000) < 0)
+            continue;
+        accepting = accepting && (fds[count].revents & POLLIN);
+
+        int64_t now  = _now_ms();
+        int     kept = 0;
+        for (int i = 0; i < count; i++)
+        {
+            int done = 0;
+            if (fds[i].revents)
+                done = _read_peer(&peers[i], Table);
+            if (!done && now - peers[i].Accepted >= PEER_TIMEOUT_MS)
+            {
+                WARN("Dropping a stalled stage callback connection");
+                done = 1;
+            }
+
+            if (done)
+                close(peers[i].Fd);
+            else
+                peers[kept++] = peers[i];
+        }
+        count = kept;
+
+        if (accepting)
+        {
+            int client = accept(fd, NULL, NULL);
+            if (client != -1)
+            {
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                peers[count++] = (peer_t){.Fd = client, .Accepted = now};
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char * argv[])
+{
+    const char * address   = getenv("ASYNC_CALLBACK_ADDR"); // -l
+    const char * shm_name  = getenv("HPSS_DSI_STAGE_CALLBACK_SHM"); // -m
+    const char * send_id   = NULL; // -s
+    const char * log_level = NULL; // -v
+    int          slots     = 4096; // -n
+    shmtab_t *   table     = NULL;
+
+    int i;
+    while ((i = getopt(argc, argv, "l:m:n:s:v:")) != -1)
+    {
+        switch(i)
+        {
+        case 'l':
+            address = optarg;
+            break;
+
+        case 'm':
+            shm_name = optarg;
+            break;
+
+        case 'n':
+            slots = atoi(optarg);
+            break;
+
+        case 's':
+            send_id = optarg;
+            break;
+
+        case 'v': // ERROR WARN INFO DEBUG TRACE ALL
+            log_level = optarg;
+            break;
+
+        case '?':
+        default:
+            fprintf(stderr, HELP_MSG);
+            exit (1);
+        }
+    }
+
+    if (address == NULL)
+    {
+        fprintf(stderr, "Missing: -l <[host:]port>\n");
+        fprintf(stderr, HELP_MSG);
+        exit (1);
+    }
+
+    if (send_id)
+        return _send_callback(address, send_id);
+
+    if (shm_name == NULL)
+    {
+        fprintf(stderr, "Missing: -m <name>\n");
+        fprintf(stderr, HELP_MSG);
+        exit (1);
+    }
+
+    //
+    // Initialize Globus command so that error codes work
+    //
+    int rc = globus_module_activate(GLOBUS_COMMON_MODULE);
+    if (rc != GLOBUS_SUCCESS)
+    {
+        fprintf(stderr, "Failed to initialize Globus common\n");
+        exit(1);
+    }
+
+    if (log_level)
+    {
+        const char * env_str_fmt = "GLOBUS_GRIDFTP_SERVER_HPSS_DEBUG=%s,/dev/stdout";
+        char * env_string = malloc(strlen(env_str_fmt) + strlen(log_level) + 1);
+        sprintf(env_string, env_str_fmt, log_level);
+        putenv(env_string);
+        // Do not free env_string; it is part of the environment now
+        logging_init();
+    }
+
+    globus_result_t result = shmtab_create(shm_name, slots, &table);
+    if (result != GLOBUS_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create %s\n", shm_name);
+        fprintf(stderr, "%s\n", globus_error_print_chain(globus_error_peek(result)));
+        exit(1);
+    }
+
+    return _listen(address, table);
+}
@@ -0,0 +1,646 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* See feature_test_macros(7) */
+#endif
+
+/*
+ * System includes
+ */
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Project includes
+ */
+#include <authenticate.h>
+#include <logging.h>
+#include <stage.h>
+#include <stagemgr.h>
+#include <utils.h>
+
+static const char * HELP_MSG =
+    "Usage: stage_manager [OPTIONS]\n"
+    "Submit stage requests on behalf of the GridFTP processes on this node.\n"
+    "Requests for the same file are merged, submitted in tape order and kept\n"
+    "under the limits below. Point the DSI at it with $HPSS_DSI_STAGE_MANAGER.\n"
+    "Files are only staged for local accounts that may read them.\n"
+    "\n"
+    "OPTIONS:\n"
+    "-a <mech>              Authentication mechanism to use to authenticate to HPSS.\n"
+    "                       Valid values are krb5 and unix. Required.\n"
+    "-p <principal>         The HPSS account to log into HPSS with. Must be able\n"
+    "                       to read every file that users may stage. Required.\n"
+    "-t <authenticator>     Path to the file containing the principal's keytab.\n"
+    "                       Required.\n"
+    "-u <username>          The username to switch to once logged into HPSS.\n"
+    "-l <path>              Unix socket to listen on. Defaults to\n"
+    "                       $HPSS_DSI_STAGE_MANAGER.\n"
+    "-g <count>             Most stages outstanding at once. Defaults to 64.\n"
+    "-n <count>             Most stages outstanding per tape volume. Defaults to 4.\n"
+    "-b <ms>                How long new requests wait to be batched together.\n"
+    "                       Defaults to 2000.\n"
+    "-c <seconds>           How often submitted stages are checked. Defaults to 30.\n"
+    "-k <seconds>           How long finished and unclaimed requests are kept.\n"
+    "                       Defaults to 3600.\n"
+    "-i <task_id>           UUID used to compute request IDs. Keep it the same\n"
+    "                       across restarts so that requests are found again.\n"
+    "-x <seconds>           Stand-in mode for testing: do not use HPSS; every\n"
+    "                       stage completes after this many seconds. Requests\n"
+    "                       are not checked against file permissions.\n"
+    "-v <log_level>         The level of additional logging to print to stdout.\n"
+    "                       Valid values are: ERROR, WARN, INFO, DEBUG, TRACE, ALL\n"
+    "                       or any combination of those values separated by '|'.\n"
+    "Examples:\n"
+    "$ stage_manager -a unix -p hpssftp -t /var/hpss/etc/keytab -l /run/hpss_dsi_stage\n"
+    "\n"
+    "$ stage_manager -x 30 -l /tmp/stage_manager -v ALL\n"
+    "";
+
+/* stage_ex() xors this with the bitfile ID, giving one request ID per file. */
+#define DEFAULT_TASK_ID "5354474d-4752-0000-0000-000000000000"
+
+/* How often requests are scheduled and checked. */
+#define TICK_MS 250
+
+/* Threads making HPSS stage calls. */
+#define STAGE_WORKERS 8
+
+/* Connections served at once; more are closed right away. */
+#define MAX_CONNECTIONS 128
+
+static int StandInMS = -1; // -x
+
+/* The manager is shared by the connection threads and the main loop. */
+static pthread_mutex_t ManagerLock = PTHREAD_MUTEX_INITIALIZER;
+static stagemgr_t *    Manager     = NULL;
+static const char *    TaskID      = DEFAULT_TASK_ID; // -i
+static int             Connections = 0;
+
+static int64_t
+_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * HPSS calls can take a while, so _stage_hpss() only queues them for the
+ * workers and collects the outcome when the manager checks the request
+ * again. A request lives at least as long as it is submitted, and its job
+ * goes away once the manager is told that it is done.
+ */
+typedef enum
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_FINISHED,
+} job_state_t;
+
+typedef struct stage_job
+{
+    const stagemgr_request_t *Request;
+    char *                    Pathname;
+    job_state_t               State;
+    stagemgr_state_t          Outcome;
+    struct stage_job *        Next;
+} stage_job_t;
+
+static pthread_mutex_t JobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  JobCond = PTHREAD_COND_INITIALIZER;
+static stage_job_t *   Jobs    = NULL;
+
+static stagemgr_state_t
+_stage_file(const char * Pathname)
+{
+    hpss_reqid_t    request_id;
+    residency_t     residency;
+    globus_result_t result;
+
+    // A zero timeout checks residency once and submits the request if needed
+    result = stage_ex(Pathname, 0, TaskID, &request_id, &residency);
+    if (result)
+    {
+        char * error = globus_error_print_chain(globus_error_peek(result));
+        ERROR("Failed to stage %s: %s", Pathname, error);
+        free(error);
+        return STAGEMGR_FAILED;
+    }
+
+    if (residency == RESIDENCY_ARCHIVED)
+        return STAGEMGR_SUBMITTED;
+    return STAGEMGR_DONE;
+}
+
+static void *
+_stage_worker(void * Arg)
+{
+    pthread_mutex_lock(&JobLock);
+    while (1)
+    {
+        stage_job_t * job = NULL;
+
+        for (job = Jobs; job; job = job->Next)
+        {
+            if (job->State == JOB_QUEUED)
+                break;
+        }
+
+        if (!job)
+        {
+            pthread_cond_wait(&JobCond, &JobLock);
+            continue;
+        }
+
+        // Running jobs are not freed
+        job->State = JOB_RUNNING;
+        pthread_mutex_unlock(&JobLock);
+
+        stagemgr_state_t outcome = _stage_file(job->Pathname);
+
+        pthread_mutex_lock(&JobLock);
+        job->Outcome = outcome;
+        job->State   = JOB_FINISHED;
+    }
+    return NULL;
+}
+
+static stagemgr_state_t
+_stage_hpss(void * Arg, stagemgr_request_t * Request)
+{
+    stage_job_t *    job   = NULL;
+    stagemgr_state_t state = STAGEMGR_SUBMITTED;
+
+    pthread_mutex_lock(&JobLock);
+
+    stage_job_t ** next = &Jobs;
+    while (*next && (*next)->Request != Request)
+        next = &(*next)->Next;
+    job = *next;
+
+    if (!job)
+    {
+        job = calloc(1, sizeof(stage_job_t));
+        if (job)
+            job->Pathname = strdup(Request->Pathname);
+        if (!job || !job->Pathname)
+        {
+            ERROR("Failed to stage %s: out of memory", Request->Pathname);
+            free(job);
+            state = STAGEMGR_FAILED;
+            goto cleanup;
+        }
+
+        job->Request = Request;
+        job->State   = JOB_QUEUED;
+        job->Next    = Jobs;
+        Jobs         = job;
+        pthread_cond_signal(&JobCond);
+        goto cleanup;
+    }
+
+    if (job->State != JOB_FINISHED)
+        goto cleanup;
+
+    // Still archived; look again
+    if (job->Outcome == STAGEMGR_SUBMITTED)
+    {
+        job->State = JOB_QUEUED;
+        pthread_cond_signal(&JobCond);
+        goto cleanup;
+    }
+
+    state = job->Outcome;
+    *next = job->Next;
+    free(job->Pathname);
+    free(job);
+
+cleanup:
+    pthread_mutex_unlock(&JobLock);
+    return state;
+}
+
+static stagemgr_state_t
+_stage_stand_in(void * Arg, stagemgr_request_t * Request)
+{
+    if (Request->State == STAGEMGR_PENDING)
+    {
+        INFO("Stand-in stage of %s on volume %s position %lld",
+             Request->Pathname,
+             Request->Volume[0] ? Request->Volume : "unknown",
+             (long long)Request->Position);
+        return STAGEMGR_SUBMITTED;
+    }
+
+    if (_now_ms() - Request->Submitted < StandInMS)
+        return STAGEMGR_SUBMITTED;
+
+    INFO("Stand-in stage of %s completed", Request->Pathname);
+    return STAGEMGR_DONE;
+}
+
+static int
+_listen(const char * Path)
+{
+    struct sockaddr_un address;
+    int                fd = -1;
+
+    if (strlen(Path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", Path);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Path);
+
+    // Left over from the last run
+    unlink(Path);
+
+    // Sessions run as their users; _authorize() checks each request.
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+        chmod(Path, 0666) ||
+        listen(fd, 128))
+    {
+        perror("Failed to listen");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Sessions only hand us files their users may read, so requests from
+ * anyone else are refused. The key comes from HPSS rather than the client
+ * so that a request can not stand in for another file's.
+ */
+static globus_result_t
+_authorize(int Fd, stagemgr_request_t * Request)
+{
+    struct ucred    cred;
+    socklen_t       length = sizeof(cred);
+    struct passwd   pwd;
+    struct passwd * user = NULL;
+    char            buffer[4096];
+    gid_t *         groups = NULL;
+    int             count  = 64;
+    globus_result_t result = GLOBUS_SUCCESS;
+
+    if (StandInMS >= 0)
+        return GLOBUS_SUCCESS;
+
+    if (getsockopt(Fd, SOL_SOCKET, SO_PEERCRED, &cred, &length))
+        return GlobusGFSErrorSystemError("getsockopt", errno);
+
+    getpwuid_r(cred.uid, &pwd, buffer, sizeof(buffer), &user);
+
+    while (1)
+    {
+        gid_t * tmp = realloc(groups, count * sizeof(gid_t));
+        if (!tmp)
+        {
+            result = GlobusGFSErrorMemory("groups");
+            goto cleanup;
+        }
+        groups = tmp;
+
+        if (!user)
+        {
+            groups[0] = cred.gid;
+            count     = 1;
+            break;
+        }
+
+        int found = count;
+        if (getgrouplist(user->pw_name, cred.gid, groups, &found) != -1)
+        {
+            count = found;
+            break;
+        }
+        // Too small; found is the number needed
+        count = found > count ? found : count * 2;
+    }
+
+    result = stage_authorize(Request->Pathname, cred.uid, groups, count, Request->Key);
+    if (result)
+    {
+        char * error = globus_error_print_chain(globus_error_peek(result));
+        INFO("Refused %s to uid %d: %s", Request->Pathname, (int)cred.uid, error);
+        free(error);
+    }
+
+cleanup:
+    free(groups);
+    return result;
+}
+
+// One request per connection; see stagemgr.h
+static void *
+_serve(void * Arg)
+{
+    int                fd = (int)(intptr_t)Arg;
+    char               line[PATH_MAX + 256];
+    size_t             length = 0;
+    stagemgr_request_t request;
+    stagemgr_state_t   state;
+    globus_result_t    result;
+    int                counts[STAGEMGR_STATE_COUNT];
+    struct timeval     timeout = {.tv_sec = 1, .tv_usec = 0};
+
+    // Don't let a stalled client hold a connection for long.
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    while (length < sizeof(line) - 1 && !memchr(line, '\n', length))
+    {
+        ssize_t rc = read(fd, line + length, sizeof(line) - 1 - length);
+        if (rc <= 0)
+            goto cleanup;
+        length += rc;
+    }
+    line[length] = '\0';
+
+    if (strncmp(line, "STATUS", strlen("STATUS")) == 0)
+    {
+        pthread_mutex_lock(&ManagerLock);
+        stagemgr_counts(Manager, counts);
+        pthread_mutex_unlock(&ManagerLock);
+
+        dprintf(fd,
+                "PENDING %d SUBMITTED %d DONE %d FAILED %d\n",
+                counts[STAGEMGR_PENDING],
+                counts[STAGEMGR_SUBMITTED],
+                counts[STAGEMGR_DONE],
+                counts[STAGEMGR_FAILED]);
+        goto cleanup;
+    }
+
+    if (stagemgr_parse_request(line, &request))
+    {
+        dprintf(fd, "ERROR Illegal request\n");
+        goto cleanup;
+    }
+
+    if (_authorize(fd, &request))
+    {
+        dprintf(fd, "ERROR Permission denied\n");
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&ManagerLock);
+    result = stagemgr_add(Manager, &request, _now_ms(), &state);
+    pthread_mutex_unlock(&ManagerLock);
+
+    if (result)
+    {
+        dprintf(fd, "ERROR Out of memory\n");
+        goto cleanup;
+    }
+
+    DEBUG("Request for %s is %s", request.Pathname, stagemgr_state_name(state));
+    dprintf(fd, "%s %s\n", stagemgr_state_name(state), TaskID);
+
+cleanup:
+    close(fd);
+
+    pthread_mutex_lock(&ManagerLock);
+    Connections--;
+    pthread_mutex_unlock(&ManagerLock);
+    return NULL;
+}
+
+int
+main(int argc, char * argv[])
+{
+    const char * login_name    = NULL; // -p (aka principal)
+    const char * auth_mech     = NULL; // -a (ie unix, krb5)
+    const char * authenticator = NULL; // -t (auth_keytab:<path>)
+    const char * username      = NULL; // -u (user to setuid to)
+    const char * log_level     = NULL; // -v (ALL, INFO, etc)
+    const char * socket_path   = getenv("HPSS_DSI_STAGE_MANAGER"); // -l
+    int          fd            = -1;
+
+    stagemgr_config_t config = {
+        .GlobalLimit = 64,
+        .VolumeLimit = 4,
+        .BatchMS     = 2000,
+        .CheckMS     = 30 * 1000,
+        .KeepMS      = 3600 * 1000,
+        .Stage       = _stage_hpss,
+    };
+
+    int i;
+    while ((i = getopt(argc, argv, "p:a:t:u:l:g:n:b:c:k:i:x:v:")) != -1)
+    {
+        switch(i)
+        {
+        case 'a': // unix or krb5
+            auth_mech = optarg;
+            break;
+
+        case 'p':
+            login_name = optarg;
+            break;
+
+        case 't':
+            authenticator = optarg;
+            break;
+
+        case 'u':
+            username = optarg;
+            break;
+
+        case 'l':
+            socket_path = optarg;
+            break;
+
+        case 'g':
+            config.GlobalLimit = atoi(optarg);
+            break;
+
+        case 'n':
+            config.VolumeLimit = atoi(optarg);
+            break;
+
+        case 'b':
+            config.BatchMS = atoll(optarg);
+            break;
+
+        case 'c':
+            config.CheckMS = atoll(optarg) * 1000;
+            break;
+
+        case 'k':
+            config.KeepMS = atoll(optarg) * 1000;
+            break;
+
+        case 'i':
+            TaskID = optarg;
+            break;
+
+        case 'x':
+            StandInMS = atoi(optarg) * 1000;
+            break;
+
+        case 'v': // ERROR WARN INFO DEBUG TRACE ALL
+            log_level = optarg;
+            break;
+
+        case '?':
+        default:
+            fprintf(stderr, HELP_MSG);
+            exit (1);
+        }
+    }
+
+    if (socket_path == NULL)
+    {
+        fprintf(stderr, "Missing: -l <path>\n");
+        fprintf(stderr, HELP_MSG);
+        exit (1);
+    }
+
+    if (!is_valid_uuid(TaskID))
+    {
+        fprintf(stderr, "Illegal task ID: %s\n", TaskID);
+        exit (1);
+    }
+
+    if (StandInMS < 0 && (!login_name || !auth_mech || !authenticator))
+    {
+        fprintf(stderr, "Missing: -a, -p and -t are required without -x\n");
+        fprintf(stderr, HELP_MSG);
+        exit (1);
+    }
+
+    // stage_ex() must not hand our own requests back to us
+    socket_path = strdup(socket_path);
+    unsetenv("HPSS_DSI_STAGE_MANAGER");
+
+    //
+    // Initialize Globus command so that error codes work
+    //
+    int rc = globus_module_activate(GLOBUS_COMMON_MODULE);
+    if (rc != GLOBUS_SUCCESS)
+    {
+        fprintf(stderr, "Failed to initialize Globus common\n");
+        exit(1);
+    }
+
+    if (log_level)
+    {
+        const char * env_str_fmt = "GLOBUS_GRIDFTP_SERVER_HPSS_DEBUG=%s,/dev/stdout";
+        char * env_string = malloc(strlen(env_str_fmt) + strlen(log_level) + 1);
+        sprintf(env_string, env_str_fmt, log_level);
+        putenv(env_string);
+        // Do not free env_string; it is part of the environment now
+        logging_init();
+    }
+
+    globus_result_t result = GLOBUS_SUCCESS;
+    if (StandInMS < 0)
+    {
+        // XXX Discarding const is a HPSS issue
+        result = authenticate((char *)login_name, (char *)auth_mech, (char *)authenticator, (char *)username);
+        if (result != GLOBUS_SUCCESS)
+        {
+            fprintf(stderr, "Failed to log into HPSS.\n");
+            fprintf(stderr, "%s\n", globus_error_print_chain(globus_error_peek(result)));
+            exit(1);
+        }
+    } else
+    {
+        config.Stage = _stage_stand_in;
+    }
+
+    result = stagemgr_create(&config, &Manager);
+    if (result != GLOBUS_SUCCESS)
+    {
+        fprintf(stderr, "%s\n", globus_error_print_chain(globus_error_peek(result)));
+        exit(1);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; StandInMS < 0 && i < STAGE_WORKERS; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, _stage_worker, NULL))
+        {
+            fprintf(stderr, "Failed to start the stage workers\n");
+            exit(1);
+        }
+    }
+
+    fd = _listen(socket_path);
+    if (fd == -1)
+        exit(1);
+
+    INFO("Stage manager listening on %s", socket_path);
+
+    int64_t last_tick = _now_ms();
+    while (1)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+        if (poll(&pfd, 1, TICK_MS) > 0)
+        {
+            int client = accept(fd, NULL, NULL);
+            if (client != -1)
+            {
+                pthread_t thread;
+                bool      busy = false;
+
+                pthread_mutex_lock(&ManagerLock);
+                busy = Connections >= MAX_CONNECTIONS;
+                if (!busy)
+                    Connections++;
+                pthread_mutex_unlock(&ManagerLock);
+
+                // The client stages the file itself if we hang up
+                if (busy)
+                {
+                    close(client);
+                } else if (pthread_create(&thread, &attr, _serve, (void *)(intptr_t)client))
+                {
+                    close(client);
+                    pthread_mutex_lock(&ManagerLock);
+                    Connections--;
+                    pthread_mutex_unlock(&ManagerLock);
+                }
+            }
+        }
+
+        // Busy sockets should not make us schedule after every request
+        int64_t now = _now_ms();
+        if (now - last_tick >= TICK_MS)
+        {
+            pthread_mutex_lock(&ManagerLock);
+            stagemgr_tick(Manager, now);
+            pthread_mutex_unlock(&ManagerLock);
+            last_tick = now;
+        }
+    }
+
+    return 0;
+}
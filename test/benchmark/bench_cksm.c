@@ -0,0 +1,284 @@
+/*
+ * CKSM hashing benchmark. Runs cksm_compute() against a simulated file: the
+ * HPSS open/stat/close calls are stand-ins and PIO is replaced by a loop that
+ * hands the same buffer to cksm_pio_callout() block after block, followed by
+ * the transfer complete callback. Reports throughput for each checksum
+ * algorithm and block size, both per second of wall time and per second of
+ * CPU time (GB/s per core), so that the cost of the hash can be compared
+ * without a mover in the way.
+ *
+ * Usage: bench_cksm [-a algorithm] [-b block size] [-m megabytes]
+ *                   [-p pipeline buffers]
+ *
+ * Without -a, runs every algorithm. Without -b, runs with 256KB, 1MB, 4MB
+ * and 16MB blocks. -p sets $HPSS_DSI_CKSM_PIPELINE_BUFFERS.
+ */
+
+/*
+ * System includes
+ */
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "cksm.h"
+#include "digest.h"
+#include "hpss.h"
+#include "pio.h"
+
+static globus_result_t (*cksm_compute_p)(globus_gfs_operation_t Operation,
+                                         char *                 Pathname,
+                                         globus_off_t           Offset,
+                                         globus_off_t           Length,
+                                         const digest_engine_t *Engine,
+                                         int                    Flags,
+                                         cksm_done_callback     Done,
+                                         void *                 DoneArg) = NULL;
+
+static const digest_engine_t *(*digest_lookup_p)(const char *Algorithm) = NULL;
+
+static const char *Algorithms[] = {
+    "md5", "sha1", "sha256", "sha256tree", "adler32", "crc32c", NULL};
+
+static uint32_t BlockSizes[] = {
+    256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024, 0};
+
+static struct
+{
+    uint32_t        BlockSize;
+    uint64_t        TotalBytes;
+    globus_result_t Result;
+    char            Checksum[DIGEST_MAX_STRING];
+} File;
+
+/*
+ * Stand-ins for the HPSS and GridFTP calls made by cksm_compute().
+ */
+int
+Hpss_Stat(const char *Path, hpss_stat_t *Buf)
+{
+    memset(Buf, 0, sizeof(*Buf));
+    Buf->st_size = File.TotalBytes;
+    Buf->st_mode = S_IFREG | S_IRUSR;
+    return 0;
+}
+
+int
+Hpss_Open(const char *                 Path,
+          int                          Oflag,
+          mode_t                       Mode,
+          const hpss_cos_hints_t *     HintsIn,
+          const hpss_cos_priorities_t *HintsPri,
+          hpss_cos_hints_t *           HintsOut)
+{
+    HintsOut->StripeWidth = 1;
+    return 3;
+}
+
+int
+Hpss_Close(int Fildes)
+{
+    return 0;
+}
+
+void
+globus_gridftp_server_get_block_size(globus_gfs_operation_t Op,
+                                     globus_size_t *        BlockSize)
+{
+    *BlockSize = File.BlockSize;
+}
+
+/*
+ * Plays the part of PIO on the calling thread. The buffer is filled once;
+ * the hash cost does not depend on the data.
+ */
+globus_result_t
+pio_start(hpss_pio_operation_t           PioOpType,
+          int                            FD,
+          int                            FileStripeWidth,
+          uint32_t                       BlockSize,
+          globus_off_t                   Offset,
+          globus_off_t                   Length,
+          pio_data_callout               DataCO,
+          pio_range_complete_callback    RngCmpltCB,
+          pio_transfer_complete_callback XferCmpltCB,
+          void *                         UserArg)
+{
+    globus_result_t result = GLOBUS_SUCCESS;
+    int             eot    = 0;
+    char *          buffer = malloc(BlockSize);
+
+    if (!buffer)
+        return GlobusGFSErrorMemory("pio buffer");
+
+    for (uint32_t i = 0; i < BlockSize; i++)
+        buffer[i] = (char)(i * 2654435761u >> 24);
+
+    while (!eot && !result)
+    {
+        globus_off_t moved = 0;
+
+        while (moved < Length)
+        {
+            uint32_t length = BlockSize;
+            if (length > Length - moved)
+                length = Length - moved;
+
+            if (DataCO(buffer, &length, Offset + moved, UserArg))
+            {
+                result = GlobusGFSErrorGeneric("Callout failed");
+                break;
+            }
+            moved += length;
+        }
+
+        if (!result)
+            RngCmpltCB(&Offset, &Length, &eot, UserArg);
+    }
+
+    free(buffer);
+    XferCmpltCB(result, UserArg);
+    return GLOBUS_SUCCESS;
+}
+
+static void
+done(globus_result_t Result, char *Checksum, void *UserArg)
+{
+    File.Result = Result;
+    if (!Result)
+        snprintf(File.Checksum, sizeof(File.Checksum), "%s", Checksum);
+}
+
+static double
+seconds(const struct timespec *Start, const struct timespec *End)
+{
+    return (End->tv_sec - Start->tv_sec) +
+           (End->tv_nsec - Start->tv_nsec) / 1000000000.0;
+}
+
+static int
+run(const char *Algorithm, uint32_t BlockSize, uint64_t TotalBytes)
+{
+    globus_result_t        result = GLOBUS_SUCCESS;
+    const digest_engine_t *engine = digest_lookup_p(Algorithm);
+    struct timespec        start, end, cpu_start, cpu_end;
+
+    if (!engine)
+    {
+        printf("Unknown algorithm %s\n", Algorithm);
+        return 1;
+    }
+
+    memset(&File, 0, sizeof(File));
+    File.BlockSize  = BlockSize;
+    File.TotalBytes = TotalBytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+    result = cksm_compute_p(NULL,
+                            "/bench",
+                            0,
+                            -1,
+                            engine,
+                            CKSM_FLAG_NO_MARKERS,
+                            done,
+                            NULL);
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!result)
+        result = File.Result;
+
+    double secs     = seconds(&start, &end);
+    double cpu_secs = seconds(&cpu_start, &cpu_end);
+    double gb       = TotalBytes / (1024.0 * 1024.0 * 1024.0);
+
+    printf("%-10s %10u %10.1f %10.2f %10.2f%s\n",
+           Algorithm,
+           BlockSize,
+           secs * 1000.0,
+           gb / secs,
+           gb / cpu_secs,
+           result ? " (failed)" : "");
+
+    return result != GLOBUS_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int         opt        = 0;
+    const char *algorithm  = NULL;
+    uint32_t    block_size = 0;
+    uint64_t    megabytes  = 1024;
+
+    while ((opt = getopt(argc, argv, "a:b:m:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            algorithm = optarg;
+            break;
+        case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            megabytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            setenv("HPSS_DSI_CKSM_PIPELINE_BUFFERS", optarg, 1);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-a algorithm] [-b block size] [-m megabytes] "
+                    "[-p pipeline buffers]\n",
+                    argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    void *module = dlopen(MODULE, RTLD_LAZY);
+    if (!module)
+    {
+        printf("Failed to open %s: %s\n", MODULE, dlerror());
+        return 1;
+    }
+
+    cksm_compute_p  = dlsym(module, "cksm_compute");
+    digest_lookup_p = dlsym(module, "digest_lookup");
+    if (!cksm_compute_p || !digest_lookup_p)
+    {
+        printf("Failed to find cksm_compute: %s\n", dlerror());
+        return 1;
+    }
+
+    printf("%-10s %10s %10s %10s %10s\n",
+           "Algorithm", "Block", "ms", "GB/s", "GB/s/core");
+
+    for (int a = 0; Algorithms[a]; a++)
+    {
+        if (algorithm && a > 0)
+            break;
+
+        for (int b = 0; BlockSizes[b]; b++)
+        {
+            if (block_size && b > 0)
+                break;
+
+            if (run(algorithm ? algorithm : Algorithms[a],
+                    block_size ? block_size : BlockSizes[b],
+                    megabytes << 20))
+                return 1;
+        }
+    }
+    return 0;
+}
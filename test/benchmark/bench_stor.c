@@ -0,0 +1,307 @@
+/*
+ * STOR contention benchmark. Many simulated GridFTP streams complete reads
+ * out of order while a single thread plays the part of PIO, pulling blocks
+ * in offset order through stor_pio_callout(). Reports throughput and how
+ * often the PIO thread waited for data and woke without being able to make
+ * progress.
+ *
+ * Usage: bench_stor [-s streams] [-b block size] [-m megabytes] [-d usecs]
+ *
+ * Without -s, runs with 1, 2, 4, ... 64 streams.
+ */
+
+/*
+ * System includes
+ */
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Local includes
+ */
+#include "stor.h"
+
+static int (*stor_pio_callout)(char *    Buffer,
+                               uint32_t *Length,
+                               uint64_t  Offset,
+                               void *    CallbackArg) = NULL;
+
+/*
+ * Outstanding reads registered by the DSI, served by the stream threads.
+ */
+struct read_request
+{
+    globus_byte_t *                 Buffer;
+    globus_size_t                   Length;
+    globus_gridftp_server_read_cb_t Callback;
+    void *                          UserArg;
+    struct read_request *           Next;
+};
+
+static struct
+{
+    pthread_mutex_t      Lock;
+    pthread_cond_t       Cond;
+    struct read_request *Head;
+    struct read_request *Tail;
+    bool                 Done;
+
+    int      Streams;
+    uint64_t TotalBytes;
+    uint64_t NextOffset;
+    int      DelayUSecs;
+} Network = {.Lock = PTHREAD_MUTEX_INITIALIZER,
+             .Cond = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Stand-ins for the GridFTP calls made on the STOR data path.
+ */
+void
+globus_gridftp_server_get_optimal_concurrency(globus_gfs_operation_t Op,
+                                              int *                  Count)
+{
+    *Count = Network.Streams;
+}
+
+void
+globus_gridftp_server_update_bytes_recvd(globus_gfs_operation_t Op,
+                                         globus_off_t           Length)
+{
+}
+
+globus_result_t
+globus_gridftp_server_register_read(globus_gfs_operation_t          Op,
+                                    globus_byte_t *                 Buffer,
+                                    globus_size_t                   Length,
+                                    globus_gridftp_server_read_cb_t Callback,
+                                    void *                          UserArg)
+{
+    struct read_request *request = calloc(1, sizeof(*request));
+    if (!request)
+        return GlobusGFSErrorMemory("read_request");
+
+    request->Buffer   = Buffer;
+    request->Length   = Length;
+    request->Callback = Callback;
+    request->UserArg  = UserArg;
+
+    pthread_mutex_lock(&Network.Lock);
+    {
+        if (Network.Tail)
+            Network.Tail->Next = request;
+        else
+            Network.Head = request;
+        Network.Tail = request;
+        pthread_cond_signal(&Network.Cond);
+    }
+    pthread_mutex_unlock(&Network.Lock);
+    return GLOBUS_SUCCESS;
+}
+
+/*
+ * Each stream claims the next block of the file and completes the read
+ * after an optional random delay so that blocks arrive out of order.
+ */
+static void *
+stream_thread(void *Arg)
+{
+    unsigned int seed = (uintptr_t)Arg;
+
+    while (1)
+    {
+        struct read_request *request = NULL;
+        uint64_t             offset  = 0;
+        globus_size_t        length  = 0;
+
+        pthread_mutex_lock(&Network.Lock);
+        {
+            while (!Network.Head && !Network.Done)
+                pthread_cond_wait(&Network.Cond, &Network.Lock);
+
+            if (!Network.Head)
+            {
+                pthread_mutex_unlock(&Network.Lock);
+                break;
+            }
+
+            request      = Network.Head;
+            Network.Head = request->Next;
+            if (!Network.Head)
+                Network.Tail = NULL;
+
+            offset = Network.NextOffset;
+            length = request->Length;
+            if (length > Network.TotalBytes - offset)
+                length = Network.TotalBytes - offset;
+            Network.NextOffset += length;
+        }
+        pthread_mutex_unlock(&Network.Lock);
+
+        if (length && Network.DelayUSecs)
+            usleep(rand_r(&seed) % Network.DelayUSecs);
+
+        if (length)
+            memset(request->Buffer, offset & 0xFF, length);
+
+        request->Callback(NULL,
+                          GLOBUS_SUCCESS,
+                          request->Buffer,
+                          length,
+                          offset,
+                          length == 0,
+                          request->UserArg);
+        free(request);
+    }
+    return NULL;
+}
+
+static int
+release_buffer(void *Datum, void *Arg)
+{
+    free(((stor_buffer_t *)Datum)->Buffer);
+    return 0;
+}
+
+static int
+run(int Streams, uint32_t BlockSize, uint64_t TotalBytes, int DelayUSecs)
+{
+    globus_gfs_transfer_info_t transfer_info;
+    stor_info_t                stor_info;
+    pthread_t                  threads[Streams];
+    struct timespec            start, end;
+    char *                     buffer = malloc(BlockSize);
+    int                        rc     = 0;
+
+    if (!buffer)
+        return 1;
+
+    memset(&Network, 0, sizeof(Network));
+    pthread_mutex_init(&Network.Lock, NULL);
+    pthread_cond_init(&Network.Cond, NULL);
+    Network.Streams    = Streams;
+    Network.TotalBytes = TotalBytes;
+    Network.DelayUSecs = DelayUSecs;
+
+    memset(&transfer_info, 0, sizeof(transfer_info));
+    transfer_info.alloc_size = TotalBytes;
+
+    memset(&stor_info, 0, sizeof(stor_info));
+    stor_info.TransferInfo = &transfer_info;
+    stor_info.BlockSize    = BlockSize;
+    stor_info.RangeLength  = TotalBytes;
+    stor_info.WaitOffset   = -1;
+    pthread_mutex_init(&stor_info.Mutex, NULL);
+    pthread_cond_init(&stor_info.DataCond, NULL);
+    pthread_cond_init(&stor_info.Cond, NULL);
+
+    for (int i = 0; i < Streams; i++)
+        pthread_create(&threads[i], NULL, stream_thread, (void *)(uintptr_t)i);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint64_t offset = 0; offset < TotalBytes && !rc; offset += BlockSize)
+    {
+        uint32_t length = BlockSize;
+        if (length > TotalBytes - offset)
+            length = TotalBytes - offset;
+        rc = stor_pio_callout(buffer, &length, offset, &stor_info);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&Network.Lock);
+    Network.Done = true;
+    pthread_cond_broadcast(&Network.Cond);
+    pthread_mutex_unlock(&Network.Lock);
+
+    for (int i = 0; i < Streams; i++)
+        pthread_join(threads[i], NULL);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    printf("%7d %10.1f %10.1f %10lu %10lu%s\n",
+           Streams,
+           secs * 1000.0,
+           (TotalBytes / (1024.0 * 1024.0)) / secs,
+           stor_info.PioWaits,
+           stor_info.PioSpuriousWakeups,
+           rc ? " (failed)" : "");
+
+    globus_list_search_pred(stor_info.AllBufferList, release_buffer, NULL);
+    globus_list_destroy_all(stor_info.AllBufferList, free);
+    globus_list_free(stor_info.FreeBufferList);
+    globus_list_free(stor_info.ReadyBufferList);
+    pthread_mutex_destroy(&stor_info.Mutex);
+    pthread_cond_destroy(&stor_info.DataCond);
+    pthread_cond_destroy(&stor_info.Cond);
+    free(buffer);
+    return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int      opt         = 0;
+    int      streams     = 0;
+    uint32_t block_size  = 256 * 1024;
+    uint64_t megabytes   = 1024;
+    int      delay_usecs = 50;
+
+    while ((opt = getopt(argc, argv, "s:b:m:d:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            streams = atoi(optarg);
+            break;
+        case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            megabytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            delay_usecs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-s streams] [-b block size] [-m megabytes] "
+                    "[-d usecs]\n",
+                    argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    void *module = dlopen(MODULE, RTLD_LAZY);
+    if (!module)
+    {
+        printf("Failed to open %s: %s\n", MODULE, dlerror());
+        return 1;
+    }
+
+    stor_pio_callout = dlsym(module, "stor_pio_callout");
+    if (!stor_pio_callout)
+    {
+        printf("Failed to find stor_pio_callout: %s\n", dlerror());
+        return 1;
+    }
+
+    printf("%7s %10s %10s %10s %10s\n",
+           "Streams", "ms", "MB/s", "Waits", "Spurious");
+
+    if (streams > 0)
+        return run(streams, block_size, megabytes << 20, delay_usecs);
+
+    for (streams = 1; streams <= 64; streams *= 2)
+    {
+        if (run(streams, block_size, megabytes << 20, delay_usecs))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <testing.h>
+#include <driver.h>
+
+#include <digest.h>
+
+static const digest_engine_t * (*_digest_lookup)(const char * Algorithm);
+static globus_result_t (*_digest_init)(digest_t * Digest, const digest_engine_t * Engine);
+static globus_result_t (*_digest_update)(digest_t * Digest, const void * Buffer, size_t Length);
+static globus_result_t (*_digest_final)(digest_t * Digest, char String[DIGEST_MAX_STRING]);
+static bool (*_digest_combine)(const digest_engine_t * Engine, const char * First, const char * Second, uint64_t SecondLength, char Result[DIGEST_MAX_STRING]);
+
+
+static int
+checksum(const char * Algorithm, const char * Input, char String[DIGEST_MAX_STRING])
+{
+    digest_t digest;
+
+    const digest_engine_t * engine = _digest_lookup(Algorithm);
+    if (!engine)
+        return 0;
+
+    if (_digest_init(&digest, engine))
+        return 0;
+    if (_digest_update(&digest, Input, strlen(Input)))
+        return 0;
+    if (_digest_final(&digest, String))
+        return 0;
+    return 1;
+}
+
+static int
+checksum_matches(const char * Algorithm, const char * Input, const char * Expected)
+{
+    char string[DIGEST_MAX_STRING];
+
+    if (!checksum(Algorithm, Input, string))
+        return 0;
+    return strcmp(string, Expected) == 0;
+}
+
+// Combines the checksums of Input split at Split.
+static int
+combine_matches(const char * Algorithm, const char * Input, size_t Split)
+{
+    char first[DIGEST_MAX_STRING];
+    char second[DIGEST_MAX_STRING];
+    char whole[DIGEST_MAX_STRING];
+    char combined[DIGEST_MAX_STRING];
+    char prefix[256];
+
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)Split, Input);
+    if (!checksum(Algorithm, prefix, first) ||
+        !checksum(Algorithm, Input + Split, second) ||
+        !checksum(Algorithm, Input, whole))
+        return 0;
+
+    if (!_digest_combine(_digest_lookup(Algorithm),
+                         first,
+                         second,
+                         strlen(Input + Split),
+                         combined))
+        return 0;
+    return strcmp(combined, whole) == 0;
+}
+
+// Checksums a buffer in one update and again in odd sized pieces.
+static int
+chunking_matches(const char * Algorithm, size_t Length, const char * Expected)
+{
+    size_t          length = Length;
+    unsigned char * buffer = malloc(length);
+    digest_t        whole;
+    digest_t        pieces;
+    char            whole_string[DIGEST_MAX_STRING];
+    char            pieces_string[DIGEST_MAX_STRING];
+
+    for (size_t i = 0; i < length; i++)
+        buffer[i] = (unsigned char)(i * 2654435761U >> 24);
+
+    const digest_engine_t * engine = _digest_lookup(Algorithm);
+    _digest_init(&whole, engine);
+    _digest_update(&whole, buffer, length);
+    _digest_final(&whole, whole_string);
+
+    _digest_init(&pieces, engine);
+    size_t offset = 0;
+    size_t chunk  = 1;
+    while (offset < length)
+    {
+        size_t n = chunk < length - offset ? chunk : length - offset;
+        _digest_update(&pieces, buffer + offset, n);
+        offset += n;
+        chunk = chunk * 3 + 1;
+    }
+    _digest_final(&pieces, pieces_string);
+
+    free(buffer);
+    if (Expected && strcmp(whole_string, Expected) != 0)
+        return 0;
+    return strcmp(whole_string, pieces_string) == 0;
+}
+
+
+void
+test_digest_lookup(void * Arg)
+{
+    ASSERT(_digest_lookup("md5"));
+    ASSERT(_digest_lookup("MD5"));
+    ASSERT(_digest_lookup("SHA-256") == _digest_lookup("sha256"));
+    ASSERT(_digest_lookup("CRC32C"));
+    ASSERT(!_digest_lookup("crc32"));
+    ASSERT(!_digest_lookup("sha2567"));
+    ASSERT(!_digest_lookup(""));
+    ASSERT(!_digest_lookup(NULL));
+}
+
+void
+test_digest_vectors(void * Arg)
+{
+    ASSERT(checksum_matches("md5", "", "d41d8cd98f00b204e9800998ecf8427e"));
+    ASSERT(checksum_matches("md5", "abc", "900150983cd24fb0d6963f7d28e17f72"));
+    ASSERT(checksum_matches("sha1", "abc", "a9993e364706816aba3e25717850c26c9cd0d89d"));
+    ASSERT(checksum_matches("sha256", "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    ASSERT(checksum_matches("adler32", "", "00000001"));
+    ASSERT(checksum_matches("adler32", "Wikipedia", "11e60398"));
+    ASSERT(checksum_matches("crc32c", "", "00000000"));
+    ASSERT(checksum_matches("crc32c", "123456789", "e3069283"));
+    ASSERT(checksum_matches("sha256tree", "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    ASSERT(checksum_matches("sha256tree", "abc", "4f8b42c22dd3729b519ba6f68d2da7cc5b2d606d05daed5ad5128cc03e6c6358"));
+}
+
+void
+test_digest_combine(void * Arg)
+{
+    const char * input = "The quick brown fox jumps over the lazy dog";
+
+    ASSERT(combine_matches("adler32", input, 0));
+    ASSERT(combine_matches("adler32", input, 4));
+    ASSERT(combine_matches("adler32", input, strlen(input)));
+    ASSERT(combine_matches("crc32c", input, 0));
+    ASSERT(combine_matches("crc32c", input, 17));
+    ASSERT(combine_matches("crc32c", input, strlen(input)));
+    ASSERT(!combine_matches("md5", input, 4));
+}
+
+void
+test_digest_chunking(void * Arg)
+{
+    ASSERT(chunking_matches("md5", 1000003, NULL));
+    ASSERT(chunking_matches("adler32", 1000003, NULL));
+    ASSERT(chunking_matches("crc32c", 1000003, NULL));
+    // Three chunks, the last one short
+    ASSERT(chunking_matches("md5", 20 * 1024 * 1024 + 5, "2a092d1d628e748da124d239d96f1a0e"));
+    ASSERT(chunking_matches("sha256tree", 20 * 1024 * 1024 + 5, "09eee178e9959bb27b66debaeefccaf9cd018b510131cb616b51803d6a369901"));
+}
+
+
+test_status_t
+test_setup(void * Arg)
+{
+    if (!_digest_lookup)
+        _digest_lookup = lookup_symbol("digest_lookup");
+    if (!_digest_init)
+        _digest_init = lookup_symbol("digest_init");
+    if (!_digest_update)
+        _digest_update = lookup_symbol("digest_update");
+    if (!_digest_final)
+        _digest_final = lookup_symbol("digest_final");
+    if (!_digest_combine)
+        _digest_combine = lookup_symbol("digest_combine");
+    return TEST_SUCCESS;
+}
+
+
+struct test_suite TEST_SUITE = {
+    .setup = test_setup,
+    .teardown = NULL,
+    .test_cases = (struct test_case[]) {
+        {"test_digest_lookup",   test_digest_lookup},
+        {"test_digest_vectors",  test_digest_vectors},
+        {"test_digest_combine",  test_digest_combine},
+        {"test_digest_chunking", test_digest_chunking},
+        {NULL,  NULL},
+    }
+};
+
+void * TEST_SUITE_ARG = NULL;
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <testing.h>
+#include <driver.h>
+
+#include <rescache.h>
+
+static globus_result_t (*_rescache_open)(const char * Pathname, int Entries, rescache_t ** Cache);
+static bool (*_rescache_lookup)(rescache_t * Cache, const unsigned char Key[RESCACHE_KEY_SIZE], void * Value, size_t Length);
+static void (*_rescache_store)(rescache_t * Cache, const unsigned char Key[RESCACHE_KEY_SIZE], const void * Value, size_t Length, int TTL);
+static void (*_rescache_close)(rescache_t * Cache);
+
+static char pathname[64];
+
+static void
+make_key(int Value, unsigned char Key[RESCACHE_KEY_SIZE])
+{
+    memset(Key, 0, RESCACHE_KEY_SIZE);
+    memcpy(Key, &Value, sizeof(Value));
+}
+
+void
+test_rescache_shared(void * Arg)
+{
+    rescache_t *  first  = NULL;
+    rescache_t *  second = NULL;
+    unsigned char key[RESCACHE_KEY_SIZE];
+    int           value  = 0;
+
+    ASSERT(_rescache_open(pathname, 16, &first) == GLOBUS_SUCCESS);
+    // The size of an existing cache wins
+    ASSERT(_rescache_open(pathname, 1024, &second) == GLOBUS_SUCCESS);
+
+    make_key(1, key);
+    ASSERT(!_rescache_lookup(second, key, &value, sizeof(value)));
+
+    value = 42;
+    _rescache_store(first, key, &value, sizeof(value), 60);
+    value = 0;
+    ASSERT(_rescache_lookup(second, key, &value, sizeof(value)));
+    ASSERT(value == 42);
+
+    // Stores replace the key's entry
+    value = 43;
+    _rescache_store(second, key, &value, sizeof(value), 60);
+    ASSERT(_rescache_lookup(first, key, &value, sizeof(value)));
+    ASSERT(value == 43);
+
+    // Values of a different size are a miss
+    long long other = 0;
+    ASSERT(!_rescache_lookup(first, key, &other, sizeof(other)));
+
+    make_key(2, key);
+    ASSERT(!_rescache_lookup(first, key, &value, sizeof(value)));
+
+    _rescache_close(second);
+    _rescache_close(first);
+}
+
+void
+test_rescache_expires(void * Arg)
+{
+    rescache_t *  cache = NULL;
+    unsigned char key[RESCACHE_KEY_SIZE];
+    int           value = 7;
+
+    ASSERT(_rescache_open(pathname, 16, &cache) == GLOBUS_SUCCESS);
+
+    make_key(1, key);
+    _rescache_store(cache, key, &value, sizeof(value), 1);
+    ASSERT(_rescache_lookup(cache, key, &value, sizeof(value)));
+
+    sleep(2);
+    ASSERT(!_rescache_lookup(cache, key, &value, sizeof(value)));
+
+    // Expired entries are reused first
+    for (int i = 2; i < 100; i++)
+    {
+        make_key(i, key);
+        _rescache_store(cache, key, &i, sizeof(i), 60);
+    }
+    make_key(99, key);
+    ASSERT(_rescache_lookup(cache, key, &value, sizeof(value)));
+    ASSERT(value == 99);
+
+    _rescache_close(cache);
+}
+
+void
+test_rescache_invalid(void * Arg)
+{
+    rescache_t * cache = NULL;
+    FILE *       file  = fopen(pathname, "w");
+
+    ASSERT(file != NULL);
+    fprintf(file, "not a residency cache, not a residency cache, not a residency cache");
+    fclose(file);
+
+    ASSERT(_rescache_open(pathname, 16, &cache) != GLOBUS_SUCCESS);
+    ASSERT(cache == NULL);
+}
+
+void
+test_rescache_untrusted(void * Arg)
+{
+    rescache_t * cache = NULL;
+
+    ASSERT(_rescache_open(pathname, 16, &cache) == GLOBUS_SUCCESS);
+    _rescache_close(cache);
+    cache = NULL;
+
+    // Anyone could forge entries
+    ASSERT(chmod(pathname, 0666) == 0);
+    ASSERT(_rescache_open(pathname, 16, &cache) != GLOBUS_SUCCESS);
+    ASSERT(cache == NULL);
+}
+
+test_status_t
+test_setup(void * Arg)
+{
+    if (!_rescache_open)
+        _rescache_open = lookup_symbol("rescache_open");
+    if (!_rescache_lookup)
+        _rescache_lookup = lookup_symbol("rescache_lookup");
+    if (!_rescache_store)
+        _rescache_store = lookup_symbol("rescache_store");
+    if (!_rescache_close)
+        _rescache_close = lookup_symbol("rescache_close");
+
+    snprintf(pathname, sizeof(pathname), "/tmp/hpss_dsi_test_rescache_%d", (int)getpid());
+    return TEST_SUCCESS;
+}
+
+test_status_t
+test_teardown(void * Arg)
+{
+    unlink(pathname);
+    return TEST_SUCCESS;
+}
+
+struct test_suite TEST_SUITE = {
+    .setup = test_setup,
+    .teardown = test_teardown,
+    .test_cases = (struct test_case[]) {
+        {"test_rescache_shared",  test_rescache_shared},
+        {"test_rescache_expires", test_rescache_expires},
+        {"test_rescache_invalid", test_rescache_invalid},
+        {"test_rescache_untrusted", test_rescache_untrusted},
+        {NULL,  NULL},
+    }
+};
+
+void * TEST_SUITE_ARG = NULL;
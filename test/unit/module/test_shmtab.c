@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <testing.h>
+#include <driver.h>
+
+#include <shmtab.h>
+
+static globus_result_t (*_shmtab_create)(const char * Name, uint32_t Slots, shmtab_t ** Table);
+static globus_result_t (*_shmtab_open)(const char * Name, shmtab_t ** Table);
+static void (*_shmtab_publish)(shmtab_t * Table, const unsigned char Key[SHMTAB_KEY_SIZE]);
+static uint64_t (*_shmtab_sequence)(shmtab_t * Table);
+static bool (*_shmtab_find)(shmtab_t * Table, uint64_t Since, const unsigned char Key[SHMTAB_KEY_SIZE]);
+static void (*_shmtab_close)(shmtab_t * Table);
+
+static char name[64];
+
+static void
+make_key(int Value, unsigned char Key[SHMTAB_KEY_SIZE])
+{
+    memset(Key, 0, SHMTAB_KEY_SIZE);
+    memcpy(Key, &Value, sizeof(Value));
+}
+
+void
+test_shmtab_find(void * Arg)
+{
+    shmtab_t *    writer = NULL;
+    shmtab_t *    reader = NULL;
+    unsigned char key[SHMTAB_KEY_SIZE];
+
+    ASSERT(_shmtab_create(name, 8, &writer) == GLOBUS_SUCCESS);
+    ASSERT(_shmtab_open(name, &reader) == GLOBUS_SUCCESS);
+
+    uint64_t since = _shmtab_sequence(reader);
+    ASSERT(since == 0);
+
+    make_key(1, key);
+    ASSERT(!_shmtab_find(reader, since, key));
+
+    _shmtab_publish(writer, key);
+    make_key(2, key);
+    _shmtab_publish(writer, key);
+
+    ASSERT(_shmtab_sequence(reader) == 2);
+    ASSERT(_shmtab_find(reader, since, key));
+    make_key(1, key);
+    ASSERT(_shmtab_find(reader, since, key));
+    // Only keys published after 'since'
+    ASSERT(!_shmtab_find(reader, 1, key));
+    make_key(3, key);
+    ASSERT(!_shmtab_find(reader, since, key));
+
+    _shmtab_close(reader);
+    _shmtab_close(writer);
+}
+
+void
+test_shmtab_wrap(void * Arg)
+{
+    shmtab_t *    writer = NULL;
+    shmtab_t *    reader = NULL;
+    unsigned char key[SHMTAB_KEY_SIZE];
+
+    ASSERT(_shmtab_create(name, 4, &writer) == GLOBUS_SUCCESS);
+    ASSERT(_shmtab_open(name, &reader) == GLOBUS_SUCCESS);
+
+    for (int i = 0; i < 6; i++)
+    {
+        make_key(i, key);
+        _shmtab_publish(writer, key);
+    }
+
+    // The last 4 are still there
+    make_key(5, key);
+    ASSERT(_shmtab_find(reader, 2, key));
+    make_key(100, key);
+    ASSERT(!_shmtab_find(reader, 2, key));
+
+    // Older keys may have been lost so the reader must check for itself
+    ASSERT(_shmtab_find(reader, 0, key));
+
+    _shmtab_close(reader);
+    _shmtab_close(writer);
+}
+
+void
+test_shmtab_recreate(void * Arg)
+{
+    shmtab_t *    writer = NULL;
+    shmtab_t *    reader = NULL;
+    shmtab_t *    again  = NULL;
+    unsigned char key[SHMTAB_KEY_SIZE];
+
+    ASSERT(_shmtab_create(name, 8, &writer) == GLOBUS_SUCCESS);
+    ASSERT(_shmtab_open(name, &reader) == GLOBUS_SUCCESS);
+    _shmtab_close(writer);
+
+    // A smaller table must not shrink the one the reader has mapped
+    ASSERT(_shmtab_create(name, 2, &writer) == GLOBUS_SUCCESS);
+    for (int i = 0; i < 4; i++)
+    {
+        make_key(i, key);
+        _shmtab_publish(writer, key);
+    }
+
+    ASSERT(_shmtab_sequence(reader) == 0);
+    ASSERT(!_shmtab_find(reader, 0, key));
+
+    ASSERT(_shmtab_open(name, &again) == GLOBUS_SUCCESS);
+    ASSERT(_shmtab_sequence(again) == 4);
+    ASSERT(_shmtab_find(again, 2, key));
+
+    _shmtab_close(again);
+    _shmtab_close(reader);
+    _shmtab_close(writer);
+}
+
+void
+test_shmtab_open_missing(void * Arg)
+{
+    shmtab_t * reader = NULL;
+
+    ASSERT(_shmtab_open("/hpss_dsi_test_missing", &reader) != GLOBUS_SUCCESS);
+    ASSERT(reader == NULL);
+}
+
+test_status_t
+test_setup(void * Arg)
+{
+    if (!_shmtab_create)
+        _shmtab_create = lookup_symbol("shmtab_create");
+    if (!_shmtab_open)
+        _shmtab_open = lookup_symbol("shmtab_open");
+    if (!_shmtab_publish)
+        _shmtab_publish = lookup_symbol("shmtab_publish");
+    if (!_shmtab_sequence)
+        _shmtab_sequence = lookup_symbol("shmtab_sequence");
+    if (!_shmtab_find)
+        _shmtab_find = lookup_symbol("shmtab_find");
+    if (!_shmtab_close)
+        _shmtab_close = lookup_symbol("shmtab_close");
+
+    snprintf(name, sizeof(name), "/hpss_dsi_test_%d", (int)getpid());
+    return TEST_SUCCESS;
+}
+
+test_status_t
+test_teardown(void * Arg)
+{
+    shm_unlink(name);
+    return TEST_SUCCESS;
+}
+
+struct test_suite TEST_SUITE = {
+    .setup = test_setup,
+    .teardown = test_teardown,
+    .test_cases = (struct test_case[]) {
+        {"test_shmtab_find",         test_shmtab_find},
+        {"test_shmtab_wrap",         test_shmtab_wrap},
+        {"test_shmtab_recreate",     test_shmtab_recreate},
+        {"test_shmtab_open_missing", test_shmtab_open_missing},
+        {NULL,  NULL},
+    }
+};
+
+void * TEST_SUITE_ARG = NULL;
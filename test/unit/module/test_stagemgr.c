@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <testing.h>
+#include <driver.h>
+
+#include <stagemgr.h>
+
+static globus_result_t (*_stagemgr_create)(const stagemgr_config_t * Config, stagemgr_t ** Manager);
+static globus_result_t (*_stagemgr_add)(stagemgr_t * Manager, const stagemgr_request_t * Request, int64_t Now, stagemgr_state_t * State);
+static void (*_stagemgr_tick)(stagemgr_t * Manager, int64_t Now);
+static void (*_stagemgr_counts)(stagemgr_t * Manager, int Counts[STAGEMGR_STATE_COUNT]);
+static void (*_stagemgr_destroy)(stagemgr_t * Manager);
+static int (*_stagemgr_parse_request)(char * Line, stagemgr_request_t * Request);
+
+/*
+ * Stand-in for HPSS. Records the order of submissions; every call returns
+ * Result.
+ */
+static struct {
+    char             Submitted[16][64];
+    int              Count;
+    int              Calls;
+    stagemgr_state_t Result;
+} stand_in;
+
+static stagemgr_state_t
+stand_in_stage(void * Arg, stagemgr_request_t * Request)
+{
+    stand_in.Calls++;
+    if (Request->State == STAGEMGR_PENDING && stand_in.Count < 16)
+        snprintf(stand_in.Submitted[stand_in.Count++], 64, "%s", Request->Pathname);
+    return stand_in.Result;
+}
+
+static stagemgr_config_t config = {
+    .GlobalLimit = 3,
+    .VolumeLimit = 1,
+    .BatchMS     = 1000,
+    .CheckMS     = 100,
+    .KeepMS      = 10000,
+    .Stage       = stand_in_stage,
+};
+
+static stagemgr_state_t
+add(stagemgr_t * Manager, int Key, const char * Pathname, const char * Volume, int Position, int64_t Now)
+{
+    stagemgr_request_t request;
+    stagemgr_state_t   state = STAGEMGR_STATE_COUNT;
+
+    memset(&request, 0, sizeof(request));
+    memcpy(request.Key, &Key, sizeof(Key));
+    request.Pathname = (char *)Pathname;
+    snprintf(request.Volume, sizeof(request.Volume), "%s", Volume);
+    request.Position = Position;
+
+    _stagemgr_add(Manager, &request, Now, &state);
+    return state;
+}
+
+void
+test_stagemgr_dedup(void * Arg)
+{
+    stagemgr_t * manager = NULL;
+    int          counts[STAGEMGR_STATE_COUNT];
+
+    ASSERT(_stagemgr_create(&config, &manager) == GLOBUS_SUCCESS);
+
+    ASSERT(add(manager, 1, "/a", "VOL001", 1, 0) == STAGEMGR_PENDING);
+    // Another session, another name for the same bitfile
+    ASSERT(add(manager, 1, "/b", "VOL001", 1, 10) == STAGEMGR_PENDING);
+
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_PENDING] == 1);
+
+    // Not until the batch is due
+    _stagemgr_tick(manager, 500);
+    ASSERT(stand_in.Calls == 0);
+
+    _stagemgr_tick(manager, 1000);
+    ASSERT(stand_in.Count == 1);
+    ASSERT(strcmp(stand_in.Submitted[0], "/b") == 0);
+    ASSERT(add(manager, 1, "/a", "VOL001", 1, 1010) == STAGEMGR_SUBMITTED);
+
+    // Checked every CheckMS until it is done
+    _stagemgr_tick(manager, 1050);
+    ASSERT(stand_in.Calls == 1);
+    stand_in.Result = STAGEMGR_DONE;
+    _stagemgr_tick(manager, 1100);
+    ASSERT(stand_in.Calls == 2);
+
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_DONE] == 1);
+    ASSERT(counts[STAGEMGR_SUBMITTED] == 0);
+
+    // Asking again means it was purged again
+    ASSERT(add(manager, 1, "/a", "VOL001", 1, 2000) == STAGEMGR_PENDING);
+
+    _stagemgr_tick(manager, 3000);
+    ASSERT(stand_in.Count == 2);
+
+    // Forgotten after KeepMS without asks
+    _stagemgr_tick(manager, 12999);
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_DONE] == 1);
+    _stagemgr_tick(manager, 13000);
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_PENDING] + counts[STAGEMGR_DONE] == 0);
+
+    _stagemgr_destroy(manager);
+}
+
+void
+test_stagemgr_limits(void * Arg)
+{
+    stagemgr_t * manager = NULL;
+    int          counts[STAGEMGR_STATE_COUNT];
+
+    ASSERT(_stagemgr_create(&config, &manager) == GLOBUS_SUCCESS);
+
+    add(manager, 1, "/a", "VOL002", 5, 0);
+    add(manager, 2, "/b", "VOL001", 9, 0);
+    add(manager, 3, "/c", "VOL001", 1, 0);
+    add(manager, 4, "/d", "VOL003", 1, 0);
+    add(manager, 5, "/e", "VOL002", 1, 0);
+    add(manager, 6, "/f", "", 0, 0);
+
+    // One per volume, in tape order, three at a time
+    _stagemgr_tick(manager, 1000);
+    ASSERT(stand_in.Count == 3);
+    ASSERT(strcmp(stand_in.Submitted[0], "/c") == 0);
+    ASSERT(strcmp(stand_in.Submitted[1], "/e") == 0);
+    ASSERT(strcmp(stand_in.Submitted[2], "/d") == 0);
+
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_SUBMITTED] == 3);
+    ASSERT(counts[STAGEMGR_PENDING] == 3);
+
+    // Finished stages free their volumes
+    stand_in.Result = STAGEMGR_DONE;
+    _stagemgr_tick(manager, 1100);
+    ASSERT(stand_in.Count == 6);
+    ASSERT(strcmp(stand_in.Submitted[3], "/b") == 0);
+    ASSERT(strcmp(stand_in.Submitted[4], "/a") == 0);
+    ASSERT(strcmp(stand_in.Submitted[5], "/f") == 0);
+
+    _stagemgr_counts(manager, counts);
+    ASSERT(counts[STAGEMGR_DONE] == 6);
+
+    _stagemgr_destroy(manager);
+}
+
+void
+test_stagemgr_parse(void * Arg)
+{
+    stagemgr_request_t request;
+    char line[] = "STAGE 000102030405060708090a0b0c0d0e0f VOL001 7 4096 /my dir/file\n";
+    char bad[]  = "STAGE 0001 VOL001 7 4096 /file\n";
+    char none[] = "STAGE 000102030405060708090a0b0c0d0e0f - 0 0 /file\n";
+
+    ASSERT(_stagemgr_parse_request(line, &request) == 0);
+    ASSERT(request.Key[0] == 0 && request.Key[15] == 15);
+    ASSERT(strcmp(request.Volume, "VOL001") == 0);
+    ASSERT(request.Position == 7);
+    ASSERT(request.Offset == 4096);
+    ASSERT(strcmp(request.Pathname, "/my dir/file") == 0);
+
+    ASSERT(_stagemgr_parse_request(bad, &request) != 0);
+
+    ASSERT(_stagemgr_parse_request(none, &request) == 0);
+    ASSERT(request.Volume[0] == '\0');
+}
+
+test_status_t
+test_setup(void * Arg)
+{
+    if (!_stagemgr_create)
+        _stagemgr_create = lookup_symbol("stagemgr_create");
+    if (!_stagemgr_add)
+        _stagemgr_add = lookup_symbol("stagemgr_add");
+    if (!_stagemgr_tick)
+        _stagemgr_tick = lookup_symbol("stagemgr_tick");
+    if (!_stagemgr_counts)
+        _stagemgr_counts = lookup_symbol("stagemgr_counts");
+    if (!_stagemgr_destroy)
+        _stagemgr_destroy = lookup_symbol("stagemgr_destroy");
+    if (!_stagemgr_parse_request)
+        _stagemgr_parse_request = lookup_symbol("stagemgr_parse_request");
+
+    memset(&stand_in, 0, sizeof(stand_in));
+    stand_in.Result = STAGEMGR_SUBMITTED;
+    return TEST_SUCCESS;
+}
+
+struct test_suite TEST_SUITE = {
+    .setup = test_setup,
+    .test_cases = (struct test_case[]) {
+        {"test_stagemgr_dedup",  test_stagemgr_dedup},
+        {"test_stagemgr_limits", test_stagemgr_limits},
+        {"test_stagemgr_parse",  test_stagemgr_parse},
+        {NULL,  NULL},
+    }
+};
+
+void * TEST_SUITE_ARG = NULL;